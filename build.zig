@@ -93,6 +93,20 @@ pub fn build(b: *std.Build) void {
     const test_step = b.step("test", "Run unit tests");
     test_step.dependOn(&run_engine_unit_tests.step);
     test_step.dependOn(&run_engine_system_tests.step);
+
+    // Benchmarks are only meaningful with optimizations, regardless of the selected mode.
+    const benchmarks = b.addExecutable(.{
+        .name = "CubeUniverseBenchmarks",
+        .root_source_file = .{ .path = "src/benchmarks.zig" },
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+
+    linkAndIncludeCLibs(target, b, benchmarks);
+
+    const run_benchmarks = b.addRunArtifact(benchmarks);
+    const bench_step = b.step("bench", "Run benchmarks");
+    bench_step.dependOn(&run_benchmarks.step);
 }
 
 fn linkAndIncludeCLibs(target: std.Build.ResolvedTarget, b: *std.Build, artifact: *std.Build.Step.Compile) void {
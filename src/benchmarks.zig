@@ -0,0 +1,698 @@
+//! Benchmarks comparing alternative code paths, such as serial and parallel passes over the `FatTree`.
+//! Run with `zig build bench`. Always built with `ReleaseFast`.
+
+const std = @import("std");
+const FatTree = @import("engine/world/fat_tree/FatTree.zig");
+const Chunk = @import("engine/world/chunk/Chunk.zig");
+const LoadedChunksHashMap = @import("engine/world/fat_tree/LoadedChunksHashMap.zig");
+const ConcurrentChunksHashMap = @import("engine/world/fat_tree/ConcurrentChunksHashMap.zig");
+const JobSystem = @import("engine/types/job_system.zig").JobSystem;
+const world_transform = @import("engine/world/world_transform.zig");
+const tree_layer_indices = @import("engine/world/fat_tree/tree_layer_indices.zig");
+const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
+const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
+const BlockPosition = world_transform.BlockPosition;
+const Allocator = std.mem.Allocator;
+const Atomic = std.atomic.Value;
+const AtomicOrder = std.builtin.AtomicOrder;
+
+/// Number of chunks along each horizontal axis of the benchmark worlds.
+const WORLD_CHUNKS_LENGTH = 320;
+/// Total number of chunks in the benchmark worlds.
+const WORLD_CHUNKS = WORLD_CHUNKS_LENGTH * WORLD_CHUNKS_LENGTH;
+/// Number of threads loading and unloading chunks at once, each in it's own region of the world.
+const STREAMING_THREADS = 4;
+/// Chunks each streaming thread loads, and then unloads, every round.
+const STREAMING_CHUNKS = 4096;
+const STREAMING_ROUNDS = 8;
+/// Numbers of chunks mapped when comparing chunk lookups against `std.AutoHashMap`.
+const MAP_LOOKUP_COUNTS = [_]usize{ 10_000, 100_000, 1_000_000 };
+/// Chunks within the map for batched lookups, enough that most lookups miss the cache.
+const FIND_MANY_CHUNKS = 1_000_000;
+/// Keys looked up by each `findMany()` call, like the neighborhoods of a batch of chunks being meshed.
+const FIND_MANY_KEYS = 256;
+/// Chunks along each side of the cube of loaded chunks walked by neighbor lookups.
+const NEIGHBOR_WALK_LENGTH = 48;
+/// Chunks within the maps shared by the concurrent lookup threads.
+const CONCURRENT_LOOKUP_CHUNKS = 100_000;
+/// Upper bound on the threads looking up chunks at once.
+const MAX_LOOKUP_THREADS = 16;
+/// Players loading spheres of chunks when measuring hash distribution, each far enough apart to not overlap.
+const DISTRIBUTION_PLAYERS = 8;
+/// View radius of each player, in chunks.
+const DISTRIBUTION_RADIUS = 16;
+/// Average chunks per group when measuring hash distribution.
+const DISTRIBUTION_CHUNKS_PER_GROUP = 16;
+/// Random positions converted to and from tree indices when comparing the divide per layer conversion against bit interleaving.
+const CONVERSION_POSITIONS = 1_000_000;
+
+pub fn main() !void {
+    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+    defer _ = gpa.deinit();
+    const allocator = gpa.allocator();
+
+    var jobs = try JobSystem.init(allocator, try std.Thread.getCpuCount());
+    defer jobs.deinit();
+
+    std.debug.print("FatTree with {} chunks, {} job threads\n", .{ WORLD_CHUNKS, jobs.threadCount() });
+
+    try benchInsert(allocator);
+    try benchForEachChunk(allocator, &jobs);
+    try benchDeinit(allocator, &jobs);
+    try benchStreaming(allocator);
+    try benchMapLookup(allocator);
+    try benchFindMany(allocator);
+    try benchNeighborWalk(allocator);
+    try benchConcurrentLookup(allocator);
+    try benchHashDistribution(allocator);
+    try benchPositionConversion(allocator);
+}
+
+fn benchInsert(allocator: Allocator) !void {
+    const singleTree = try FatTree.init(allocator);
+    defer singleTree.deinit();
+    const singleChunks = try createChunks(allocator, singleTree);
+    defer allocator.free(singleChunks);
+
+    var timer = try std.time.Timer.start();
+    {
+        const inner = singleTree.lockTreeModify();
+        defer singleTree.unlockTreeModify();
+        for (singleChunks) |chunk| {
+            try inner.insertChunk(chunk);
+        }
+    }
+    const singleTime = timer.read();
+
+    const bulkTree = try FatTree.init(allocator);
+    defer bulkTree.deinit();
+    const bulkChunks = try createChunks(allocator, bulkTree);
+    defer allocator.free(bulkChunks);
+
+    timer.reset();
+    {
+        const inner = bulkTree.lockTreeModify();
+        defer bulkTree.unlockTreeModify();
+        try inner.insertChunksBulk(bulkChunks);
+    }
+    const bulkTime = timer.read();
+
+    report("insert (one at a time vs bulk)", singleTime, bulkTime);
+}
+
+fn benchForEachChunk(allocator: Allocator, jobs: *JobSystem) !void {
+    const tree = try createWorld(allocator);
+    defer tree.deinit();
+
+    const inner = tree.lockChunkModify();
+    defer tree.unlockChunkModify();
+
+    var serialCount = Atomic(usize).init(0);
+    var timer = try std.time.Timer.start();
+    inner.forEachChunk(&serialCount, readChunk);
+    const serialTime = timer.read();
+
+    var parallelCount = Atomic(usize).init(0);
+    timer.reset();
+    inner.forEachChunkParallel(jobs, &parallelCount, readChunk);
+    const parallelTime = timer.read();
+
+    std.debug.assert(serialCount.load(AtomicOrder.Monotonic) == WORLD_CHUNKS);
+    std.debug.assert(parallelCount.load(AtomicOrder.Monotonic) == WORLD_CHUNKS);
+    report("forEachChunk (serial vs parallel)", serialTime, parallelTime);
+}
+
+fn benchDeinit(allocator: Allocator, jobs: *JobSystem) !void {
+    const serialTree = try createWorld(allocator);
+    var timer = try std.time.Timer.start();
+    serialTree.deinit();
+    const serialTime = timer.read();
+
+    const parallelTree = try createWorld(allocator);
+    timer.reset();
+    parallelTree.deinitParallel(jobs);
+    const parallelTime = timer.read();
+
+    report("deinit (serial vs parallel)", serialTime, parallelTime);
+}
+
+const StreamingAccess = enum {
+    treeModify,
+    subtreeModify,
+};
+
+fn benchStreaming(allocator: Allocator) !void {
+    const treeTime = try timeStreaming(allocator, .treeModify);
+    const subtreeTime = try timeStreaming(allocator, .subtreeModify);
+    report("streaming threads (TreeModify vs SubtreeModify)", treeTime, subtreeTime);
+}
+
+/// Time for `STREAMING_THREADS` threads to each stream chunks in and out of their own region of one world.
+fn timeStreaming(allocator: Allocator, access: StreamingAccess) !u64 {
+    const tree = try FatTree.init(allocator);
+    defer tree.deinit();
+
+    var threads: [STREAMING_THREADS]std.Thread = undefined;
+    var timer = try std.time.Timer.start();
+    for (&threads, 0..) |*thread, i| {
+        thread.* = try std.Thread.spawn(.{}, streamChunks, .{ tree, i, access });
+    }
+    for (threads) |thread| {
+        thread.join();
+    }
+    return timer.read();
+}
+
+/// Loads and unloads the chunks of the top level subtree at `subtree`, like a player moving around.
+fn streamChunks(tree: *FatTree, subtree: usize, access: StreamingAccess) void {
+    var base = TreeLayerIndices{};
+    base.setIndexAtLayer(0, .{ .index = @intCast(subtree) });
+
+    for (0..STREAMING_ROUNDS) |_| {
+        for (0..STREAMING_CHUNKS) |i| {
+            const position = streamingPosition(base, i);
+            const chunk = Chunk.init(tree, position) catch @panic("Out of memory");
+            switch (access) {
+                .treeModify => {
+                    const inner = tree.lockTreeModify();
+                    defer tree.unlockTreeModify();
+                    inner.insertChunk(chunk) catch @panic("Out of memory");
+                },
+                .subtreeModify => {
+                    const subtreeModify = tree.lockSubtreeModify(position) catch @panic("Out of memory");
+                    defer tree.unlockSubtreeModify(subtreeModify);
+                    subtreeModify.insertChunk(chunk) catch @panic("Out of memory");
+                },
+            }
+        }
+        for (0..STREAMING_CHUNKS) |i| {
+            const position = streamingPosition(base, i);
+            switch (access) {
+                .treeModify => {
+                    const inner = tree.lockTreeModify();
+                    defer tree.unlockTreeModify();
+                    inner.removeChunk(position) catch @panic("Out of memory");
+                },
+                .subtreeModify => {
+                    const subtreeModify = tree.lockSubtreeModify(position) catch @panic("Out of memory");
+                    defer tree.unlockSubtreeModify(subtreeModify);
+                    subtreeModify.removeChunk(position) catch @panic("Out of memory");
+                },
+            }
+        }
+    }
+}
+
+/// The `i`th chunk within the subtree of `base`, packed into the deepest layers.
+fn streamingPosition(base: TreeLayerIndices, i: usize) TreeLayerIndices {
+    var position = base;
+    position.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i % 64) });
+    position.setIndexAtLayer(TREE_LAYERS - 2, .{ .index = @intCast(i / 64 % 64) });
+    position.setIndexAtLayer(TREE_LAYERS - 3, .{ .index = @intCast(i / 4096 % 64) });
+    return position;
+}
+
+fn benchMapLookup(allocator: Allocator) !void {
+    for (MAP_LOOKUP_COUNTS) |count| {
+        const positions = try allocator.alloc(TreeLayerIndices, count);
+        defer allocator.free(positions);
+
+        var prng = std.rand.DefaultPrng.init(count);
+        const random = prng.random();
+        for (positions) |*position| {
+            for (0..TREE_LAYERS) |layer| {
+                position.setIndexAtLayer(layer, .{ .index = random.int(u6) });
+            }
+        }
+
+        var stdMap = std.AutoHashMap(TreeLayerIndices, Chunk).init(allocator);
+        defer stdMap.deinit();
+        var mapAllocator = allocator;
+        var map = LoadedChunksHashMap.init(&mapAllocator);
+        defer map.deinit();
+
+        // The maps only hold references to chunks, so they never need to be allocated.
+        for (positions, 0..) |position, i| {
+            const chunk = Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) };
+            try stdMap.put(position, chunk);
+            try map.insert(position, chunk);
+        }
+        random.shuffle(TreeLayerIndices, positions);
+
+        var timer = try std.time.Timer.start();
+        for (positions) |position| {
+            std.mem.doNotOptimizeAway(stdMap.get(position));
+        }
+        const stdTime = timer.read();
+
+        timer.reset();
+        for (positions) |position| {
+            std.mem.doNotOptimizeAway(map.find(position));
+        }
+        const mapTime = timer.read();
+
+        var nameBuffer: [96]u8 = undefined;
+        const name = try std.fmt.bufPrint(&nameBuffer, "lookup {} chunks (std.AutoHashMap vs LoadedChunksHashMap)", .{count});
+        report(name, stdTime, mapTime);
+    }
+}
+
+fn benchFindMany(allocator: Allocator) !void {
+    const positions = try allocator.alloc(TreeLayerIndices, FIND_MANY_CHUNKS);
+    defer allocator.free(positions);
+
+    var prng = std.rand.DefaultPrng.init(FIND_MANY_CHUNKS);
+    const random = prng.random();
+    for (positions) |*position| {
+        for (0..TREE_LAYERS) |layer| {
+            position.setIndexAtLayer(layer, .{ .index = random.int(u6) });
+        }
+    }
+
+    var mapAllocator = allocator;
+    var map = LoadedChunksHashMap.init(&mapAllocator);
+    defer map.deinit();
+
+    // The map only holds references to chunks, so they never need to be allocated.
+    for (positions, 0..) |position, i| {
+        try map.insert(position, Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) });
+    }
+    _ = try map.rehash(std.math.maxInt(usize));
+    random.shuffle(TreeLayerIndices, positions);
+
+    var found: [FIND_MANY_KEYS]?Chunk = undefined;
+
+    var timer = try std.time.Timer.start();
+    var start: usize = 0;
+    while (start + FIND_MANY_KEYS <= positions.len) : (start += FIND_MANY_KEYS) {
+        for (positions[start..][0..FIND_MANY_KEYS], 0..) |position, i| {
+            found[i] = map.find(position);
+        }
+        std.mem.doNotOptimizeAway(&found);
+    }
+    const findTime = timer.read();
+
+    timer.reset();
+    start = 0;
+    while (start + FIND_MANY_KEYS <= positions.len) : (start += FIND_MANY_KEYS) {
+        map.findMany(positions[start..][0..FIND_MANY_KEYS], &found);
+        std.mem.doNotOptimizeAway(&found);
+    }
+    const findManyTime = timer.read();
+
+    report("cold lookup of " ++ std.fmt.comptimePrint("{}", .{FIND_MANY_CHUNKS}) ++ " chunks (find vs findMany)", findTime, findManyTime);
+}
+
+/// Looks up the 6 neighbors of every chunk in a cube of loaded chunks, in order, like meshing or lighting does.
+fn benchNeighborWalk(allocator: Allocator) !void {
+    const length = NEIGHBOR_WALK_LENGTH;
+    const positions = try allocator.alloc(TreeLayerIndices, length * length * length);
+    defer allocator.free(positions);
+    for (0..length) |x| {
+        for (0..length) |y| {
+            for (0..length) |z| {
+                const position = BlockPosition{
+                    .x = @as(i64, @intCast(x)) * world_transform.CHUNK_LENGTH,
+                    .y = @as(i64, @intCast(y)) * world_transform.CHUNK_LENGTH,
+                    .z = @as(i64, @intCast(z)) * world_transform.CHUNK_LENGTH,
+                };
+                positions[(x * length + y) * length + z] = position.asTreeIndices();
+            }
+        }
+    }
+
+    var neighbors = try std.ArrayList(TreeLayerIndices).initCapacity(allocator, positions.len * 6);
+    defer neighbors.deinit();
+    for (0..length) |x| {
+        for (0..length) |y| {
+            for (0..length) |z| {
+                const index = (x * length + y) * length + z;
+                if (x > 0) neighbors.appendAssumeCapacity(positions[index - length * length]);
+                if (x + 1 < length) neighbors.appendAssumeCapacity(positions[index + length * length]);
+                if (y > 0) neighbors.appendAssumeCapacity(positions[index - length]);
+                if (y + 1 < length) neighbors.appendAssumeCapacity(positions[index + length]);
+                if (z > 0) neighbors.appendAssumeCapacity(positions[index - 1]);
+                if (z + 1 < length) neighbors.appendAssumeCapacity(positions[index + 1]);
+            }
+        }
+    }
+
+    var mapAllocator = allocator;
+    var hashed = LoadedChunksHashMap.initWithMode(&mapAllocator, .hashed);
+    defer hashed.deinit();
+    var spatial = LoadedChunksHashMap.initWithMode(&mapAllocator, .spatial);
+    defer spatial.deinit();
+
+    // The maps only hold references to chunks, so they never need to be allocated.
+    for (positions, 0..) |position, i| {
+        const chunk = Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) };
+        try hashed.insert(position, chunk);
+        try spatial.insert(position, chunk);
+    }
+    _ = try hashed.rehash(std.math.maxInt(usize));
+    _ = try spatial.rehash(std.math.maxInt(usize));
+
+    var timer = try std.time.Timer.start();
+    for (neighbors.items) |position| {
+        std.mem.doNotOptimizeAway(hashed.find(position));
+    }
+    const hashedTime = timer.read();
+
+    timer.reset();
+    for (neighbors.items) |position| {
+        std.mem.doNotOptimizeAway(spatial.find(position));
+    }
+    const spatialTime = timer.read();
+
+    report("neighbor walk (hashed vs spatial groups)", hashedTime, spatialTime);
+    const hashedStats = hashed.stats();
+    const spatialStats = spatial.stats();
+    std.debug.print("  slots: hashed {}, spatial {}\n", .{ hashedStats.slots, spatialStats.slots });
+}
+
+const LockedMap = struct {
+    lock: std.Thread.RwLock = .{},
+    map: LoadedChunksHashMap,
+};
+
+fn benchConcurrentLookup(allocator: Allocator) !void {
+    const positions = try allocator.alloc(TreeLayerIndices, CONCURRENT_LOOKUP_CHUNKS);
+    defer allocator.free(positions);
+
+    var prng = std.rand.DefaultPrng.init(CONCURRENT_LOOKUP_CHUNKS);
+    const random = prng.random();
+    for (positions) |*position| {
+        for (0..TREE_LAYERS) |layer| {
+            position.setIndexAtLayer(layer, .{ .index = random.int(u6) });
+        }
+    }
+
+    var mapAllocator = allocator;
+    var locked = LockedMap{ .map = LoadedChunksHashMap.init(&mapAllocator) };
+    defer locked.map.deinit();
+    var concurrent = try ConcurrentChunksHashMap.init(&mapAllocator);
+    defer concurrent.deinit();
+
+    // The maps only hold references to chunks, so they never need to be allocated.
+    for (positions, 0..) |position, i| {
+        const chunk = Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) };
+        try locked.map.insert(position, chunk);
+        try concurrent.insert(position, chunk);
+    }
+    random.shuffle(TreeLayerIndices, positions);
+
+    const threadCount = @min(try std.Thread.getCpuCount(), MAX_LOOKUP_THREADS);
+    var threads: [MAX_LOOKUP_THREADS]std.Thread = undefined;
+
+    var timer = try std.time.Timer.start();
+    for (threads[0..threadCount]) |*thread| {
+        thread.* = try std.Thread.spawn(.{}, lookupLocked, .{ &locked, positions });
+    }
+    for (threads[0..threadCount]) |thread| {
+        thread.join();
+    }
+    const lockedTime = timer.read();
+
+    timer.reset();
+    for (threads[0..threadCount]) |*thread| {
+        thread.* = try std.Thread.spawn(.{}, lookupConcurrent, .{ &concurrent, positions });
+    }
+    for (threads[0..threadCount]) |thread| {
+        thread.join();
+    }
+    const concurrentTime = timer.read();
+
+    var nameBuffer: [96]u8 = undefined;
+    const name = try std.fmt.bufPrint(&nameBuffer, "{} threads lookup (RwLock vs ConcurrentChunksHashMap)", .{threadCount});
+    report(name, lockedTime, concurrentTime);
+}
+
+/// Looks up every position, acquiring the shared lock for each lookup like a job thread would.
+fn lookupLocked(locked: *LockedMap, positions: []const TreeLayerIndices) void {
+    for (positions) |position| {
+        locked.lock.lockShared();
+        defer locked.lock.unlockShared();
+        std.mem.doNotOptimizeAway(locked.map.find(position));
+    }
+}
+
+fn lookupConcurrent(map: *ConcurrentChunksHashMap, positions: []const TreeLayerIndices) void {
+    for (positions) |position| {
+        std.mem.doNotOptimizeAway(map.find(position));
+    }
+}
+
+/// How evenly a hash function spreads a set of chunk positions over the groups and control bytes of a hash map.
+const Distribution = struct {
+    largestGroup: usize,
+    /// Average number of other chunks in the same group with the same control byte,
+    /// each of which a lookup has to compare keys with.
+    falseMatches: f64,
+
+    fn measure(allocator: Allocator, positions: []const TreeLayerIndices, comptime hashFn: fn (TreeLayerIndices) usize) !Distribution {
+        const groupCount = @max(positions.len / DISTRIBUTION_CHUNKS_PER_GROUP, 1);
+        // Control bytes within each group, the same as `LoadedChunksHashMap`.
+        const counts = try allocator.alloc([128]u32, groupCount);
+        defer allocator.free(counts);
+        @memset(counts, [_]u32{0} ** 128);
+
+        for (positions) |position| {
+            const hashCode = hashFn(position);
+            counts[(hashCode >> 7) % groupCount][hashCode & 127] += 1;
+        }
+
+        var largestGroup: usize = 0;
+        var falseMatches: usize = 0;
+        for (counts) |group| {
+            var groupSize: usize = 0;
+            for (group) |count| {
+                groupSize += count;
+                if (count > 0) falseMatches += count * (count - 1);
+            }
+            largestGroup = @max(largestGroup, groupSize);
+        }
+        return Distribution{
+            .largestGroup = largestGroup,
+            .falseMatches = @as(f64, @floatFromInt(falseMatches)) / @as(f64, @floatFromInt(positions.len)),
+        };
+    }
+};
+
+/// The hash used before `TreeLayerIndices.hash()` mixed every layer in.
+fn firstValueHash(position: TreeLayerIndices) usize {
+    return position.values[0];
+}
+
+fn benchHashDistribution(allocator: Allocator) !void {
+    var flat = try std.ArrayList(TreeLayerIndices).initCapacity(allocator, WORLD_CHUNKS);
+    defer flat.deinit();
+    const half = WORLD_CHUNKS_LENGTH / 2;
+    for (0..WORLD_CHUNKS_LENGTH) |x| {
+        for (0..WORLD_CHUNKS_LENGTH) |z| {
+            const position = BlockPosition{
+                .x = (@as(i64, @intCast(x)) - half) * world_transform.CHUNK_LENGTH,
+                .y = 0,
+                .z = (@as(i64, @intCast(z)) - half) * world_transform.CHUNK_LENGTH,
+            };
+            flat.appendAssumeCapacity(position.asTreeIndices());
+        }
+    }
+
+    var spheres = std.ArrayList(TreeLayerIndices).init(allocator);
+    defer spheres.deinit();
+    const radius: i64 = DISTRIBUTION_RADIUS;
+    for (0..DISTRIBUTION_PLAYERS) |player| {
+        const center = @as(i64, @intCast(player)) * radius * 4;
+        var x = -radius;
+        while (x <= radius) : (x += 1) {
+            var y = -radius;
+            while (y <= radius) : (y += 1) {
+                var z = -radius;
+                while (z <= radius) : (z += 1) {
+                    if (x * x + y * y + z * z > radius * radius) continue;
+                    const position = BlockPosition{
+                        .x = (center + x) * world_transform.CHUNK_LENGTH,
+                        .y = y * world_transform.CHUNK_LENGTH,
+                        .z = (center - z) * world_transform.CHUNK_LENGTH,
+                    };
+                    try spheres.append(position.asTreeIndices());
+                }
+            }
+        }
+    }
+
+    const sets = [_]struct { name: []const u8, positions: []const TreeLayerIndices }{
+        .{ .name = "flat terrain", .positions = flat.items },
+        .{ .name = "player spheres", .positions = spheres.items },
+    };
+    for (sets) |set| {
+        const before = try Distribution.measure(allocator, set.positions, firstValueHash);
+        const after = try Distribution.measure(allocator, set.positions, TreeLayerIndices.hash);
+        std.debug.print("hash distribution of {s} ({} chunks): largest group {} then {}, {d:.2} then {d:.2} false matches per lookup\n", .{
+            set.name,
+            set.positions.len,
+            before.largestGroup,
+            after.largestGroup,
+            before.falseMatches,
+            after.falseMatches,
+        });
+
+        var timer = try std.time.Timer.start();
+        for (set.positions) |position| {
+            std.mem.doNotOptimizeAway(firstValueHash(position));
+        }
+        const beforeTime = timer.read();
+        timer.reset();
+        for (set.positions) |position| {
+            std.mem.doNotOptimizeAway(position.hash());
+        }
+        const afterTime = timer.read();
+
+        var nameBuffer: [96]u8 = undefined;
+        report(try std.fmt.bufPrint(&nameBuffer, "hash {s} (first value vs mixed)", .{set.name}), beforeTime, afterTime);
+    }
+}
+
+/// The conversion used before `BlockPosition.asTreeIndices()` interleaved the bits of chunk coordinates,
+/// dividing the shifted position for every layer.
+fn divisionAsTreeIndices(position: BlockPosition) TreeLayerIndices {
+    const shifted = [3]i64{
+        @divTrunc(position.x + world_transform.WORLD_MAX_BLOCK_POS + 1, world_transform.CHUNK_LENGTH),
+        @divTrunc(position.y + world_transform.WORLD_MAX_BLOCK_POS + 1, world_transform.CHUNK_LENGTH),
+        @divTrunc(position.z + world_transform.WORLD_MAX_BLOCK_POS + 1, world_transform.CHUNK_LENGTH),
+    };
+    var indices: [TREE_LAYERS]TreeLayerIndices.Index = undefined;
+    inline for (0..TREE_LAYERS) |layer| {
+        const div = comptime std.math.pow(i64, tree_layer_indices.TREE_NODE_LENGTH, TREE_LAYERS - layer);
+        var digits: [3]u2 = undefined;
+        for (shifted, 0..) |component, axis| {
+            digits[axis] = @intCast(@divTrunc(@mod(component, div) * tree_layer_indices.TREE_NODE_LENGTH, div));
+        }
+        indices[layer] = TreeLayerIndices.Index.init(digits[0], digits[1], digits[2]);
+    }
+    return TreeLayerIndices.init(indices);
+}
+
+/// The conversion used before `BlockPosition.fromTreeIndices()` gathered the bits of chunk coordinates,
+/// multiplying the index of every layer.
+fn multiplyFromTreeIndices(indices: TreeLayerIndices) BlockPosition {
+    var components = @Vector(4, i64){ 0, 0, 0, 0 };
+    inline for (0..TREE_LAYERS) |layer| {
+        const multiplier = comptime std.math.pow(i64, tree_layer_indices.TREE_NODE_LENGTH, TREE_LAYERS - 1 - layer);
+        const index = indices.indexAtLayer(layer);
+        const indicesVec = @Vector(4, i64){ index.x(), index.y(), index.z(), 0 };
+        components += indicesVec * @as(@Vector(4, i64), @splat(multiplier));
+    }
+    components *= @splat(world_transform.CHUNK_LENGTH);
+    components -= @splat(world_transform.WORLD_MAX_BLOCK_POS + 1);
+    return BlockPosition{ .x = components[0], .y = components[1], .z = components[2] };
+}
+
+fn benchPositionConversion(allocator: Allocator) !void {
+    const positions = try allocator.alloc(BlockPosition, CONVERSION_POSITIONS);
+    defer allocator.free(positions);
+    var prng = std.rand.DefaultPrng.init(0);
+    const random = prng.random();
+    for (positions) |*position| {
+        position.* = BlockPosition{
+            .x = random.intRangeAtMost(i64, world_transform.WORLD_MIN_BLOCK_POS, world_transform.WORLD_MAX_BLOCK_POS),
+            .y = random.intRangeAtMost(i64, world_transform.WORLD_MIN_BLOCK_POS, world_transform.WORLD_MAX_BLOCK_POS),
+            .z = random.intRangeAtMost(i64, world_transform.WORLD_MIN_BLOCK_POS, world_transform.WORLD_MAX_BLOCK_POS),
+        };
+    }
+    const indices = try allocator.alloc(TreeLayerIndices, CONVERSION_POSITIONS);
+    defer allocator.free(indices);
+    const converted = try allocator.alloc(BlockPosition, CONVERSION_POSITIONS);
+    defer allocator.free(converted);
+
+    var timer = try std.time.Timer.start();
+    for (positions, indices) |position, *treePos| {
+        treePos.* = divisionAsTreeIndices(position);
+    }
+    const divisionTime = timer.read();
+    std.mem.doNotOptimizeAway(indices);
+
+    timer.reset();
+    for (positions, indices) |position, *treePos| {
+        treePos.* = position.asTreeIndices();
+    }
+    const interleavedTime = timer.read();
+    std.mem.doNotOptimizeAway(indices);
+
+    timer.reset();
+    BlockPosition.asTreeIndicesBatch(positions, indices);
+    const batchTime = timer.read();
+    std.mem.doNotOptimizeAway(indices);
+
+    report("block position to tree indices (divide per layer vs interleaved)", divisionTime, interleavedTime);
+    report("block position to tree indices (divide per layer vs interleaved batch)", divisionTime, batchTime);
+
+    timer.reset();
+    for (indices, converted) |treePos, *position| {
+        position.* = multiplyFromTreeIndices(treePos);
+    }
+    const multiplyTime = timer.read();
+    std.mem.doNotOptimizeAway(converted);
+
+    timer.reset();
+    for (indices, converted) |treePos, *position| {
+        position.* = BlockPosition.fromTreeIndices(treePos);
+    }
+    const gatheredTime = timer.read();
+    std.mem.doNotOptimizeAway(converted);
+
+    timer.reset();
+    BlockPosition.fromTreeIndicesBatch(indices, converted);
+    const gatheredBatchTime = timer.read();
+    std.mem.doNotOptimizeAway(converted);
+
+    report("tree indices to block position (multiply per layer vs gathered)", multiplyTime, gatheredTime);
+    report("tree indices to block position (multiply per layer vs gathered batch)", multiplyTime, gatheredBatchTime);
+}
+
+/// Creates a flat world of `WORLD_CHUNKS` chunks around the origin.
+fn createWorld(allocator: Allocator) !*FatTree {
+    const tree = try FatTree.init(allocator);
+    errdefer tree.deinit();
+
+    const chunks = try createChunks(allocator, tree);
+    defer allocator.free(chunks);
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+    try inner.insertChunksBulk(chunks);
+    return tree;
+}
+
+/// Creates, but does not insert, the `WORLD_CHUNKS` chunks of a flat world around the origin, in row order.
+fn createChunks(allocator: Allocator, tree: *FatTree) ![]Chunk {
+    const chunks = try allocator.alloc(Chunk, WORLD_CHUNKS);
+    errdefer allocator.free(chunks);
+
+    const half = WORLD_CHUNKS_LENGTH / 2;
+    for (0..WORLD_CHUNKS_LENGTH) |x| {
+        for (0..WORLD_CHUNKS_LENGTH) |z| {
+            const position = BlockPosition{
+                .x = (@as(i64, @intCast(x)) - half) * world_transform.CHUNK_LENGTH,
+                .y = 0,
+                .z = (@as(i64, @intCast(z)) - half) * world_transform.CHUNK_LENGTH,
+            };
+            chunks[x * WORLD_CHUNKS_LENGTH + z] = try Chunk.init(tree, position.asTreeIndices());
+        }
+    }
+    return chunks;
+}
+
+fn readChunk(counter: *Atomic(usize), chunk: Chunk) void {
+    const data = chunk.read();
+    defer chunk.unlockRead();
+    std.mem.doNotOptimizeAway(data.isAllAir());
+    _ = counter.fetchAdd(1, AtomicOrder.Monotonic);
+}
+
+/// Prints the time of a `baselineNs` code path against the time of it's `alternativeNs` replacement.
+fn report(name: []const u8, baselineNs: u64, alternativeNs: u64) void {
+    const baselineMs = @as(f64, @floatFromInt(baselineNs)) / std.time.ns_per_ms;
+    const alternativeMs = @as(f64, @floatFromInt(alternativeNs)) / std.time.ns_per_ms;
+    std.debug.print("{s}: {d:.2}ms, then {d:.2}ms, {d:.2}x\n", .{ name, baselineMs, alternativeMs, baselineMs / alternativeMs });
+}
@@ -10,6 +10,9 @@ const AtomicValue = std.atomic.Value;
 const AtomicOrder = std.builtin.AtomicOrder;
 const Window = @import("graphics/Window.zig");
 const OpenGLInstance = @import("graphics/opengl/OpenGLInstance.zig");
+const FatTree = @import("world/fat_tree/FatTree.zig");
+const ChunkMemoryPool = @import("world/ChunkMemoryPool.zig");
+const ArrayListUnmanaged = std.ArrayListUnmanaged;
 
 const Self = @This();
 
@@ -20,6 +23,12 @@ renderThread: *JobThread,
 jobSystem: JobSystem,
 _window: Window,
 _openglInstance: OpenGLInstance,
+/// Worlds that can be inspected through the engine, such as by `dumpWorldStats()`.
+_worlds: ArrayListUnmanaged(*FatTree),
+_worldsMutex: Mutex,
+/// Shared by every world, so memory freed by one is reused by the others.
+/// Create a `ChunkMemoryPool.World` through it for each `FatTree`.
+chunkMemory: ChunkMemoryPool,
 
 /// Initializes the engine globally, if it hasn't been already.
 /// Call `deinit()` to deinitialize the engine globally.
@@ -99,6 +108,34 @@ pub fn isCurrentOnRenderThread() bool {
     return std.Thread.getCurrentId() == engine.?.renderThread.threadId;
 }
 
+/// Makes `world` inspectable through the engine, such as by `dumpWorldStats()`.
+/// Call `unregisterWorld()` before deinitializing it.
+pub fn registerWorld(self: *Self, world: *FatTree) Allocator.Error!void {
+    self._worldsMutex.lock();
+    defer self._worldsMutex.unlock();
+    try self._worlds.append(self.allocator, world);
+}
+
+/// Asserts that `world` was registered.
+pub fn unregisterWorld(self: *Self, world: *FatTree) void {
+    self._worldsMutex.lock();
+    defer self._worldsMutex.unlock();
+
+    const index = std.mem.indexOfScalar(*FatTree, self._worlds.items, world) orelse @panic("Cannot unregister a world that is not registered");
+    _ = self._worlds.swapRemove(index);
+}
+
+/// Writes the `FatTree.stats()` of every registered world to `writer`, to see where memory is going on demand.
+pub fn dumpWorldStats(self: *Self, writer: anytype) !void {
+    self._worldsMutex.lock();
+    defer self._worldsMutex.unlock();
+
+    for (self._worlds.items, 0..) |world, i| {
+        try writer.print("World {}: {}", .{ i, world.stats() });
+    }
+    try writer.print("{}", .{self.chunkMemory.stats()});
+}
+
 fn create(allocator: Allocator, params: EngineInitializationParams) EngineInitError!*Self {
     const newEngine = try allocator.create(Self);
     newEngine.allocator = allocator;
@@ -106,11 +143,19 @@ fn create(allocator: Allocator, params: EngineInitializationParams) EngineInitEr
     newEngine.jobSystem = try JobSystem.init(newEngine.allocator, params.jobThreadCount);
     newEngine._window = Window.init(newEngine.renderThread, 640, 480);
     newEngine._openglInstance = OpenGLInstance.init(newEngine.renderThread);
+    newEngine._worlds = .{};
+    newEngine._worldsMutex = .{};
+    newEngine.chunkMemory = ChunkMemoryPool.init(allocator, params.maxCachedChunkMemory);
     return newEngine;
 }
 
 fn cleanup(self: *Self) void {
     const allocator = self.allocator;
+    if (self._worlds.items.len != 0) {
+        @panic("Cannot deinitialize the engine while worlds are still registered");
+    }
+    self._worlds.deinit(allocator);
+    self.chunkMemory.deinit();
     self._window.deinit();
     //self._openglInstance.deinit();
     self.renderThread.deinit();
@@ -124,6 +169,8 @@ pub const EngineInitializationParams = struct {
     /// This allows the total used threads by the engine to equal the amount of logical threads
     /// available. This is `jobThreadCount` + `1 main thread` + `1 OpenGL thread`.
     jobThreadCount: usize,
+    /// Bytes of freed chunks and layers the `ChunkMemoryPool` keeps for reuse by any world.
+    maxCachedChunkMemory: usize = ChunkMemoryPool.DEFAULT_MAX_CACHED_BYTES,
 
     pub fn default() EngineInitializationParams {
         var jobThreadCount: usize = 2; // leaves main thread + OpenGL render thread, meaning 4 used threads
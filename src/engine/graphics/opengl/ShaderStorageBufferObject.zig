@@ -23,6 +23,12 @@ pub fn bufferData(self: *Self, comptime T: type, data: []const T) void {
     c.glNamedBufferData(self.id, @intCast(data.len * @sizeOf(T)), @ptrCast(data.ptr), c.GL_STATIC_DRAW);
 }
 
+/// Overwrites part of the buffer starting `offset` bytes in, without reallocating it.
+/// The buffer must already be large enough.
+pub fn bufferSubData(self: *Self, comptime T: type, offset: usize, data: []const T) void {
+    c.glNamedBufferSubData(self.id, @intCast(offset), @intCast(data.len * @sizeOf(T)), @ptrCast(data.ptr));
+}
+
 pub fn bind(self: Self, index: u32) void {
     if (self.isBound()) {
         return;
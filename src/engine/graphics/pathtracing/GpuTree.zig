@@ -0,0 +1,677 @@
+//! Flattened encoding of a `FatTree`, to upload to the GPU as a std430 shader storage buffer.
+//! Every layer of the tree becomes a `GpuLayer` record within one array, referencing it's child layers
+//! by record index rather than by pointer, and it's chunks by slot within a separate chunk data buffer.
+//!
+//! The first `update()` encodes the whole tree. Afterwards, only the layers along the positions passed to
+//! `markDirty()` are compared against the nodes they were encoded from, and only the children that changed
+//! are rewritten. Records and chunk slots that are no longer used go on free lists, and are reused before
+//! the buffers grow. After each update, upload the `header`, `dirtyRecords()` and `dirtyChunks`,
+//! then call `clearDirty()`.
+//!
+//! Nothing here touches OpenGL, so `validate()` can check the encoding against the tree on the CPU,
+//! and `lookup()` walks the encoding the same way `pathtracer.comp` does.
+
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const ArrayListUnmanaged = std.ArrayListUnmanaged;
+const DynamicBitSetUnmanaged = std.bit_set.DynamicBitSetUnmanaged;
+const assert = std.debug.assert;
+const expect = std.testing.expect;
+const FatTree = @import("../../world/fat_tree/FatTree.zig");
+const Node = FatTree.Node;
+const Layer = FatTree.Layer;
+const tree_layer_indices = @import("../../world/fat_tree/tree_layer_indices.zig");
+const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
+const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
+const TREE_NODES_PER_LAYER = tree_layer_indices.TREE_NODES_PER_LAYER;
+const Chunk = @import("../../world/chunk/Chunk.zig");
+const world_transform = @import("../../world/world_transform.zig");
+const BlockIndex = world_transform.BlockIndex;
+const BlockPosition = world_transform.BlockPosition;
+
+const Self = @This();
+
+/// A record index, chunk slot, or block state referencing nothing.
+pub const NONE: u32 = std.math.maxInt(u32);
+
+/// Corresponds with GpuLayer in pathtracer.comp.
+/// Bit `i` of the masks is node `i`, with the first word holding nodes 0 to 31.
+pub const GpuLayer = extern struct {
+    /// Set for every node that is not empty.
+    occupancy: [2]u32,
+    /// Set for every uniform node, with it's child being the block state.
+    uniformMask: [2]u32,
+    /// Set for every chunk node, with it's child being the chunk slot.
+    chunkMask: [2]u32,
+    /// `NONE` if this record is on the free list.
+    treeLayer: u32,
+    /// First layer skipped over by a noodle layer, or `treeLayer` for a normal layer.
+    noodleStart: u32,
+    /// `TreeLayerIndices.values` holding the indices of the layers skipped over by a noodle layer.
+    noodlePath: [3]u32,
+    _padding: u32 = 0,
+    /// For every other occupied node, the record index of it's child layer.
+    children: [TREE_NODES_PER_LAYER]u32,
+};
+
+/// Corresponds with the start of the fatTree buffer in pathtracer.comp. The records directly follow it.
+pub const GpuHeader = extern struct {
+    /// Record index of the top layer, or `NONE`.
+    root: u32,
+    /// If the whole tree is a single uniform node, it's block state. Otherwise `NONE`.
+    rootUniformState: u32,
+    recordCount: u32,
+    chunkSlotCount: u32,
+};
+
+/// A chunk whose data must be uploaded into `slot` of the chunk data buffer,
+/// such as through `BlockStatePathtraceIndices.encode()`.
+/// `chunk` is only valid while the access to the tree used for `update()` is held.
+pub const DirtyChunk = struct {
+    slot: u32,
+    chunk: Chunk,
+};
+
+/// Records to upload, and the byte offset within the buffer to upload them to.
+pub const DirtyRecords = struct {
+    offset: usize,
+    records: []const GpuLayer,
+};
+
+/// What `lookup()` found at a position.
+pub const Lookup = union(enum) {
+    empty,
+    /// The block state of the uniform node.
+    uniform: u32,
+    /// The chunk slot.
+    chunk: u32,
+};
+
+allocator: Allocator,
+header: GpuHeader = GpuHeader{ .root = NONE, .rootUniformState = NONE, .recordCount = 0, .chunkSlotCount = 0 },
+records: ArrayListUnmanaged(GpuLayer) = .{},
+/// The raw value of every node each record was encoded from, parallel to `records`, to find which children changed.
+sources: ArrayListUnmanaged([TREE_NODES_PER_LAYER]usize) = .{},
+/// Always has the capacity for every record, so releasing can't fail.
+freeRecords: ArrayListUnmanaged(u32) = .{},
+/// Always has the capacity for every chunk slot, so releasing can't fail.
+freeChunkSlots: ArrayListUnmanaged(u32) = .{},
+/// Raw value of the top node when the tree was last encoded.
+rootSource: usize = 0,
+encoded: bool = false,
+dirtyPositions: ArrayListUnmanaged(TreeLayerIndices) = .{},
+/// Chunks to upload the data of since the last `clearDirty()`.
+dirtyChunks: ArrayListUnmanaged(DirtyChunk) = .{},
+/// Records rewritten since the last `clearDirty()` are within `dirtyBegin..dirtyEnd`.
+dirtyBegin: u32 = NONE,
+dirtyEnd: u32 = 0,
+
+pub fn init(allocator: Allocator) Self {
+    return Self{ .allocator = allocator };
+}
+
+pub fn deinit(self: *Self) void {
+    self.records.deinit(self.allocator);
+    self.sources.deinit(self.allocator);
+    self.freeRecords.deinit(self.allocator);
+    self.freeChunkSlots.deinit(self.allocator);
+    self.dirtyPositions.deinit(self.allocator);
+    self.dirtyChunks.deinit(self.allocator);
+}
+
+/// Marks the node at `position` as changed, such as after inserting, removing, filling, or writing to a chunk there,
+/// so the next `update()` rewrites the layers along it.
+pub fn markDirty(self: *Self, position: TreeLayerIndices) Allocator.Error!void {
+    try self.dirtyPositions.append(self.allocator, position);
+}
+
+/// Brings the encoding up to date with `inner`, which requires at least `ChunkModify` access.
+/// Encodes the whole tree the first time, and whenever the top node has been replaced by something other than a layer.
+/// Otherwise, only the layers along the positions marked dirty are rewritten.
+/// If this fails, the positions not yet rewritten stay marked, so calling it again picks up where it stopped.
+pub fn update(self: *Self, inner: *const FatTree.Inner) Allocator.Error!void {
+    const top = inner.topNode.atomicCopy();
+    if (self.encoded and top.value != self.rootSource and self.header.root != NONE and self.sameShape(self.header.root, top)) {
+        // A copy of the top layer, such as after writing to a tree shared with a `Snapshot`.
+        // Chunks written in place are still only found through the dirty positions.
+        try self.rewriteRecord(self.header.root, top.layerOrNull().?);
+        self.rootSource = top.value;
+    }
+    if (!self.encoded or top.value != self.rootSource) {
+        self.releaseRoot();
+        try self.encodeRoot(top);
+        self.encoded = true;
+        self.dirtyPositions.clearRetainingCapacity();
+        return;
+    }
+
+    // Sorted, consecutive positions share the layers near the top, which only need rewriting once.
+    const positions = self.dirtyPositions.items;
+    std.sort.pdq(TreeLayerIndices, positions, {}, pathLessThan);
+
+    var previous: ?TreeLayerIndices = null;
+    var rewrittenDepth: usize = 0;
+    for (positions, 0..) |position, i| {
+        var skipBelow: usize = 0;
+        if (previous) |last| {
+            // The same position marked twice would upload it's chunk twice.
+            if (last.equal(position)) {
+                continue;
+            }
+            skipBelow = @min(last.firstDifferingLayer(position) + 1, rewrittenDepth);
+        }
+        rewrittenDepth = self.updatePath(top, position, skipBelow) catch |err| {
+            // Anything left half rewritten along `position` no longer matches it's source, so is rewritten again.
+            std.mem.copyForwards(TreeLayerIndices, positions, positions[i..]);
+            self.dirtyPositions.shrinkRetainingCapacity(positions.len - i);
+            return err;
+        };
+        previous = position;
+    }
+    self.dirtyPositions.clearRetainingCapacity();
+}
+
+/// The records rewritten since the last `clearDirty()`, or null if there are none.
+pub fn dirtyRecords(self: *const Self) ?DirtyRecords {
+    if (self.dirtyBegin >= self.dirtyEnd) {
+        return null;
+    }
+    return DirtyRecords{
+        .offset = @sizeOf(GpuHeader) + @as(usize, self.dirtyBegin) * @sizeOf(GpuLayer),
+        .records = self.records.items[self.dirtyBegin..self.dirtyEnd],
+    };
+}
+
+/// Call once the dirty records and chunks have been uploaded.
+pub fn clearDirty(self: *Self) void {
+    self.dirtyBegin = NONE;
+    self.dirtyEnd = 0;
+    self.dirtyChunks.clearRetainingCapacity();
+}
+
+/// Walks the encoding to find the node at `position`, the same way `fat_tree_lookup()` in pathtracer.comp does.
+pub fn lookup(self: *const Self, position: TreeLayerIndices) Lookup {
+    if (self.header.root == NONE) {
+        return if (self.header.rootUniformState == NONE) .empty else Lookup{ .uniform = self.header.rootUniformState };
+    }
+
+    var record = self.header.root;
+    while (true) {
+        const gpu = &self.records.items[record];
+        const noodlePath = TreeLayerIndices{ .values = gpu.noodlePath };
+        for (gpu.noodleStart..gpu.treeLayer) |layer| {
+            if (noodlePath.indexAtLayer(layer).index != position.indexAtLayer(layer).index) {
+                return .empty;
+            }
+        }
+
+        const index = position.indexAtLayer(gpu.treeLayer).index;
+        const word = index / 32;
+        const bit = @as(u32, 1) << @intCast(index % 32);
+        if ((gpu.occupancy[word] & bit) == 0) {
+            return .empty;
+        }
+
+        const child = gpu.children[index];
+        if ((gpu.uniformMask[word] & bit) != 0) {
+            return Lookup{ .uniform = child };
+        }
+        if ((gpu.chunkMask[word] & bit) != 0) {
+            return Lookup{ .chunk = child };
+        }
+        record = child;
+    }
+}
+
+/// Checks that the encoding exactly matches `inner`, and that every record and chunk slot
+/// is either used once, or on a free list. Requires at least `ChunkModify` access.
+pub fn validate(self: *const Self, inner: *const FatTree.Inner) Allocator.Error!bool {
+    var visited = try DynamicBitSetUnmanaged.initEmpty(self.allocator, self.records.items.len);
+    defer visited.deinit(self.allocator);
+    var slots = try DynamicBitSetUnmanaged.initEmpty(self.allocator, self.header.chunkSlotCount);
+    defer slots.deinit(self.allocator);
+
+    if (self.header.recordCount != self.records.items.len) {
+        return false;
+    }
+
+    const top = inner.topNode.atomicCopy();
+    switch (top.kind()) {
+        .empty => if (self.header.root != NONE or self.header.rootUniformState != NONE) return false,
+        .uniform => if (self.header.root != NONE or self.header.rootUniformState != encodeBlockState(top)) return false,
+        .childLayer, .noodleLayer => if (!self.validateRecord(self.header.root, top, &visited, &slots)) return false,
+        .chunk => return false,
+    }
+
+    for (self.freeRecords.items) |record| {
+        if (visited.isSet(record) or self.records.items[record].treeLayer != NONE) return false;
+    }
+    for (self.freeChunkSlots.items) |slot| {
+        if (slots.isSet(slot)) return false;
+    }
+    return visited.count() + self.freeRecords.items.len == self.records.items.len and
+        slots.count() + self.freeChunkSlots.items.len == self.header.chunkSlotCount;
+}
+
+fn validateRecord(self: *const Self, record: u32, node: Node, visited: *DynamicBitSetUnmanaged, slots: *DynamicBitSetUnmanaged) bool {
+    if (record >= self.records.items.len or visited.isSet(record)) {
+        return false;
+    }
+    visited.set(record);
+
+    const layer = node.layerOrNull().?;
+    const gpu = &self.records.items[record];
+    if (gpu.treeLayer != layer.treeLayer) {
+        return false;
+    }
+    if (node.kind() == .noodleLayer) {
+        const noodle = node.noodleLayer();
+        if (gpu.noodleStart != noodle.jumpStart or !std.mem.eql(u32, &gpu.noodlePath, &noodlePathOf(node).values)) return false;
+    } else if (gpu.noodleStart != gpu.treeLayer) {
+        return false;
+    }
+
+    for (0..TREE_NODES_PER_LAYER) |i| {
+        const child = layer.nodeAt(.{ .index = @intCast(i) }).atomicCopy();
+        const kind = child.kind();
+        const word = i / 32;
+        const bit = @as(u32, 1) << @intCast(i % 32);
+
+        if (((gpu.occupancy[word] & bit) != 0) != (kind != .empty)) return false;
+        if (((gpu.uniformMask[word] & bit) != 0) != (kind == .uniform)) return false;
+        if (((gpu.chunkMask[word] & bit) != 0) != (kind == .chunk)) return false;
+        if (self.sources.items[record][i] != child.value) return false;
+
+        switch (kind) {
+            .empty => {},
+            .uniform => if (gpu.children[i] != encodeBlockState(child)) return false,
+            .chunk => {
+                const slot = gpu.children[i];
+                if (slot >= self.header.chunkSlotCount or slots.isSet(slot)) return false;
+                slots.set(slot);
+            },
+            .childLayer, .noodleLayer => if (!self.validateRecord(gpu.children[i], child, visited, slots)) return false,
+        }
+    }
+    return true;
+}
+
+/// Rewrites the layers along `position` that have changed, except for those above `skipBelow`.
+/// Returns the layer below the deepest one reached.
+fn updatePath(self: *Self, top: Node, position: TreeLayerIndices, skipBelow: usize) Allocator.Error!usize {
+    var record = self.header.root;
+    var layer = top.layerOrNull() orelse return 0;
+    while (true) {
+        const dirtyChunksBefore = self.dirtyChunks.items.len;
+        if (layer.treeLayer >= skipBelow) {
+            try self.rewriteRecord(record, layer);
+        }
+
+        const index = position.indexAtLayer(layer.treeLayer);
+        const node = layer.nodeAt(index).atomicCopy();
+        switch (node.kind()) {
+            .childLayer, .noodleLayer => {
+                if (node.kind() == .noodleLayer and !node.noodleLayer().covers(position)) {
+                    return layer.treeLayer + 1;
+                }
+                record = self.records.items[record].children[index.index];
+                layer = node.layerOrNull().?;
+            },
+            .chunk => {
+                // The chunk may be the same, but it's blocks have changed.
+                // If it was just re-encoded, `encodeChild()` has already queued it's upload.
+                const slot = self.records.items[record].children[index.index];
+                for (self.dirtyChunks.items[dirtyChunksBefore..]) |dirty| {
+                    if (dirty.slot == slot) return layer.treeLayer + 1;
+                }
+                try self.dirtyChunks.append(self.allocator, DirtyChunk{ .slot = slot, .chunk = node.chunk() });
+                return layer.treeLayer + 1;
+            },
+            .empty, .uniform => return layer.treeLayer + 1,
+        }
+    }
+}
+
+/// Re-encodes every child of `record` that no longer matches the node of `layer` it was encoded from.
+/// A child layer replaced by a copy of itself, such as one unshared from a `Snapshot`, keeps it's record,
+/// and only the children of it that changed are rewritten in turn.
+fn rewriteRecord(self: *Self, record: u32, layer: *const Layer) Allocator.Error!void {
+    for (0..TREE_NODES_PER_LAYER) |i| {
+        const node = layer.nodeAt(.{ .index = @intCast(i) }).atomicCopy();
+        if (node.value == self.sources.items[record][i]) {
+            continue;
+        }
+        if (self.holdsLayer(record, i)) {
+            const child = self.records.items[record].children[i];
+            if (self.sameShape(child, node)) {
+                try self.rewriteRecord(child, node.layerOrNull().?);
+                // Only once rewritten, so if that fails, it's compared again next time.
+                self.sources.items[record][i] = node.value;
+                continue;
+            }
+        }
+        self.releaseChild(record, i);
+        try self.encodeChild(record, i, node);
+        self.markRecordDirty(record);
+    }
+}
+
+fn encodeRoot(self: *Self, top: Node) Allocator.Error!void {
+    switch (top.kind()) {
+        .empty => {},
+        .uniform => self.header.rootUniformState = encodeBlockState(top),
+        .childLayer, .noodleLayer => self.header.root = try self.encodeLayer(top),
+        .chunk => unreachable,
+    }
+    self.rootSource = top.value;
+}
+
+fn releaseRoot(self: *Self) void {
+    if (self.header.root != NONE) {
+        self.releaseRecord(self.header.root);
+    }
+    self.header.root = NONE;
+    self.header.rootUniformState = NONE;
+    self.rootSource = 0;
+}
+
+/// Encodes the layer held by `node`, and everything below it, into new records.
+/// Returns the record of the layer.
+fn encodeLayer(self: *Self, node: Node) Allocator.Error!u32 {
+    const layer = node.layerOrNull().?;
+    const record = try self.allocRecord();
+    errdefer self.releaseRecord(record);
+
+    self.records.items[record] = GpuLayer{
+        .occupancy = .{ 0, 0 },
+        .uniformMask = .{ 0, 0 },
+        .chunkMask = .{ 0, 0 },
+        .treeLayer = layer.treeLayer,
+        .noodleStart = noodleStartOf(node),
+        .noodlePath = noodlePathOf(node).values,
+        .children = .{0} ** TREE_NODES_PER_LAYER,
+    };
+    self.sources.items[record] = .{0} ** TREE_NODES_PER_LAYER;
+
+    for (0..TREE_NODES_PER_LAYER) |i| {
+        const child = layer.nodeAt(.{ .index = @intCast(i) }).atomicCopy();
+        if (child.kind() != .empty) {
+            try self.encodeChild(record, i, child);
+        }
+    }
+    self.markRecordDirty(record);
+    return record;
+}
+
+/// Encodes `node` as child `i` of `record`, which must currently be empty.
+fn encodeChild(self: *Self, record: u32, i: usize, node: Node) Allocator.Error!void {
+    const word = i / 32;
+    const bit = @as(u32, 1) << @intCast(i % 32);
+
+    const child: u32 = switch (node.kind()) {
+        .empty => 0,
+        .uniform => encodeBlockState(node),
+        .chunk => blk: {
+            const slot = try self.allocChunkSlot();
+            errdefer self.freeChunkSlots.appendAssumeCapacity(slot);
+            try self.dirtyChunks.append(self.allocator, DirtyChunk{ .slot = slot, .chunk = node.chunk() });
+            break :blk slot;
+        },
+        // May grow `records`, so nothing within it is referenced until afterwards.
+        .childLayer, .noodleLayer => try self.encodeLayer(node),
+    };
+
+    const gpu = &self.records.items[record];
+    gpu.children[i] = child;
+    switch (node.kind()) {
+        .empty => {},
+        .uniform => gpu.uniformMask[word] |= bit,
+        .chunk => gpu.chunkMask[word] |= bit,
+        .childLayer, .noodleLayer => {},
+    }
+    if (node.kind() != .empty) {
+        gpu.occupancy[word] |= bit;
+    }
+    self.sources.items[record][i] = node.value;
+}
+
+/// Whether child `i` of `record` is a layer, referencing another record.
+fn holdsLayer(self: *const Self, record: u32, i: usize) bool {
+    const word = i / 32;
+    const bit = @as(u32, 1) << @intCast(i % 32);
+    const gpu = &self.records.items[record];
+    return (gpu.occupancy[word] & bit) != 0 and ((gpu.uniformMask[word] | gpu.chunkMask[word]) & bit) == 0;
+}
+
+/// Whether `node` is a layer at the same tree layer, skipping over the same layers, as `record` was encoded from,
+/// so `record` can be rewritten to match it in place.
+fn sameShape(self: *const Self, record: u32, node: Node) bool {
+    const layer = node.layerOrNull() orelse return false;
+    const gpu = &self.records.items[record];
+    return gpu.treeLayer == layer.treeLayer and gpu.noodleStart == noodleStartOf(node) and
+        std.mem.eql(u32, &gpu.noodlePath, &noodlePathOf(node).values);
+}
+
+/// Releases whatever child `i` of `record` references, leaving it empty.
+fn releaseChild(self: *Self, record: u32, i: usize) void {
+    const word = i / 32;
+    const bit = @as(u32, 1) << @intCast(i % 32);
+    const gpu = &self.records.items[record];
+    const child = gpu.children[i];
+
+    if ((gpu.occupancy[word] & bit) != 0 and (gpu.uniformMask[word] & bit) == 0) {
+        if ((gpu.chunkMask[word] & bit) != 0) {
+            self.freeChunkSlots.appendAssumeCapacity(child);
+        } else {
+            self.releaseRecord(child);
+        }
+    }
+
+    // Releasing a child record doesn't move `records`, so `gpu` is still valid.
+    gpu.occupancy[word] &= ~bit;
+    gpu.uniformMask[word] &= ~bit;
+    gpu.chunkMask[word] &= ~bit;
+    gpu.children[i] = 0;
+    self.sources.items[record][i] = 0;
+}
+
+/// Puts `record` and everything below it on the free lists.
+fn releaseRecord(self: *Self, record: u32) void {
+    for (0..TREE_NODES_PER_LAYER) |i| {
+        self.releaseChild(record, i);
+    }
+    self.records.items[record].treeLayer = NONE;
+    self.freeRecords.appendAssumeCapacity(record);
+}
+
+fn allocRecord(self: *Self) Allocator.Error!u32 {
+    if (self.freeRecords.popOrNull()) |record| {
+        return record;
+    }
+
+    const record: u32 = @intCast(self.records.items.len);
+    try self.freeRecords.ensureTotalCapacity(self.allocator, self.records.items.len + 1);
+    try self.sources.ensureTotalCapacity(self.allocator, self.records.items.len + 1);
+    try self.records.append(self.allocator, undefined);
+    self.sources.appendAssumeCapacity(undefined);
+    self.header.recordCount = record + 1;
+    return record;
+}
+
+fn allocChunkSlot(self: *Self) Allocator.Error!u32 {
+    if (self.freeChunkSlots.popOrNull()) |slot| {
+        return slot;
+    }
+
+    const slot = self.header.chunkSlotCount;
+    try self.freeChunkSlots.ensureTotalCapacity(self.allocator, slot + 1);
+    self.header.chunkSlotCount = slot + 1;
+    return slot;
+}
+
+fn markRecordDirty(self: *Self, record: u32) void {
+    self.dirtyBegin = @min(self.dirtyBegin, record);
+    self.dirtyEnd = @max(self.dirtyEnd, record + 1);
+}
+
+/// The first layer a noodle layer skips over, or the tree layer of a normal layer.
+fn noodleStartOf(node: Node) u32 {
+    if (node.kind() == .noodleLayer) {
+        return node.noodleLayer().jumpStart;
+    }
+    return node.layerOrNull().?.treeLayer;
+}
+
+/// The indices of the layers a noodle layer skips over, or nothing for a normal layer.
+fn noodlePathOf(node: Node) TreeLayerIndices {
+    var path = TreeLayerIndices{};
+    if (node.kind() == .noodleLayer) {
+        const noodle = node.noodleLayer();
+        for (noodle.jumpStart..noodle.jumpEnd) |layer| {
+            path.setIndexAtLayer(layer, noodle.indices[layer]);
+        }
+    }
+    return path;
+}
+
+/// Narrows the block state of a uniform node to the 32 bits the shader stores per child.
+/// `NONE` is reserved as the "no uniform root" sentinel, so the state must stay below it.
+fn encodeBlockState(node: Node) u32 {
+    const state = node.uniformState();
+    assert(state < NONE);
+    return @intCast(state);
+}
+
+fn pathLessThan(_: void, lhs: TreeLayerIndices, rhs: TreeLayerIndices) bool {
+    return lhs.pathKey() < rhs.pathKey();
+}
+
+// Tests
+
+test "GpuLayer layout" {
+    // Must match the std430 layout of GpuLayer in pathtracer.comp.
+    try expect(@sizeOf(GpuLayer) == 304);
+    try expect(@offsetOf(GpuLayer, "children") == 48);
+    try expect(@sizeOf(GpuHeader) == 16);
+}
+
+test "Encode whole tree" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    var gpu = Self.init(std.testing.allocator);
+    defer gpu.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    try gpu.update(inner);
+    try expect(try gpu.validate(inner));
+    try expect(gpu.lookup(TreeLayerIndices{}) == .empty);
+
+    const origin = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    try inner.insertChunk(try Chunk.init(tree, origin));
+    try gpu.markDirty(origin);
+    try gpu.update(inner);
+
+    try expect(try gpu.validate(inner));
+    try expect(gpu.lookup(origin) == .chunk);
+    try expect(gpu.dirtyRecords().?.records.len == gpu.records.items.len);
+    try expect(gpu.dirtyChunks.items.len > 0);
+}
+
+test "Update dirty paths" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    var gpu = Self.init(std.testing.allocator);
+    defer gpu.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const origin = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    const far = (BlockPosition{ .x = 100000, .y = -5000, .z = 320 }).asTreeIndices();
+    try inner.insertChunk(try Chunk.init(tree, origin));
+    try inner.insertChunk(try Chunk.init(tree, far));
+    try gpu.update(inner);
+    try expect(try gpu.validate(inner));
+    gpu.clearDirty();
+
+    // Writing to a chunk only re-uploads it's data.
+    try inner.setBlockState(origin, BlockIndex.init(1, 1, 1), 3);
+    try gpu.markDirty(origin);
+    try gpu.update(inner);
+    try expect(gpu.dirtyRecords() == null);
+    try expect(gpu.dirtyChunks.items.len == 1);
+    try expect(gpu.dirtyChunks.items[0].slot == gpu.lookup(origin).chunk);
+    gpu.clearDirty();
+
+    // Replacing a chunk with a uniform node frees it's slot.
+    try inner.fillUniform(far, TREE_LAYERS - 1, 7);
+    try gpu.markDirty(far);
+    try gpu.update(inner);
+    try expect(try gpu.validate(inner));
+    try expect(gpu.lookup(far).uniform == 7);
+    try expect(gpu.freeChunkSlots.items.len == 1);
+
+    // Removing a chunk frees every record left empty, which are reused by the next chunk.
+    const recordCount = gpu.records.items.len;
+    try inner.removeChunk(origin);
+    try gpu.markDirty(origin);
+    try gpu.update(inner);
+    try expect(try gpu.validate(inner));
+    try expect(gpu.lookup(origin) == .empty);
+    try expect(gpu.freeRecords.items.len > 0);
+    gpu.clearDirty();
+
+    // A new chunk is only uploaded once, however many times it's position is marked.
+    try inner.insertChunk(try Chunk.init(tree, origin));
+    try gpu.markDirty(origin);
+    try gpu.markDirty(origin);
+    try gpu.update(inner);
+    try expect(try gpu.validate(inner));
+    try expect(gpu.records.items.len == recordCount);
+    try expect(gpu.lookup(origin) == .chunk);
+    try expect(gpu.dirtyChunks.items.len == 1);
+    try expect(gpu.dirtyChunks.items[0].slot == gpu.lookup(origin).chunk);
+}
+
+test "Rewrite copied layers in place" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    var gpu = Self.init(std.testing.allocator);
+    defer gpu.deinit();
+
+    const origin = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    const far = (BlockPosition{ .x = 100000, .y = -5000, .z = 320 }).asTreeIndices();
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.insertChunk(try Chunk.init(tree, origin));
+        try inner.insertChunk(try Chunk.init(tree, far));
+        try gpu.update(inner);
+        gpu.clearDirty();
+    }
+
+    var snap = tree.snapshot();
+    defer snap.release();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    // Copies every layer along the path, and the chunk, from those shared with the snapshot.
+    try inner.setBlockState(origin, BlockIndex.init(1, 1, 1), 3);
+    try expect(inner.topNode.value != gpu.rootSource);
+
+    const recordCount = gpu.records.items.len;
+    try gpu.markDirty(origin);
+    try gpu.update(inner);
+    try expect(try gpu.validate(inner));
+    try expect(gpu.records.items.len == recordCount);
+    try expect(gpu.freeRecords.items.len == 0);
+    try expect(gpu.dirtyRecords().?.records.len == 1);
+    try expect(gpu.dirtyChunks.items.len == 1);
+    try expect(gpu.dirtyChunks.items[0].slot == gpu.lookup(origin).chunk);
+}
@@ -2,6 +2,9 @@ const std = @import("std");
 const world_transform = @import("../../world/world_transform.zig");
 const CHUNK_LENGTH = world_transform.CHUNK_LENGTH;
 const CHUNK_SIZE = world_transform.CHUNK_SIZE;
+const BlockIndex = world_transform.BlockIndex;
+const ChunkInner = @import("../../world/chunk/Inner.zig");
+const AIR_BLOCK_STATE = ChunkInner.AIR_BLOCK_STATE;
 
 // TODO maybe possible to specify an offset into a buffer, and then use heavy compression to then indirectly specify the BlockState.
 
@@ -10,4 +13,12 @@ pub const BlockStatePathtraceIndices = extern struct {
     /// A value of 0 for an index means air.
     /// FOR NOW, 0 is air, 1 is a full block. TODO actual block states.
     indices: [CHUNK_SIZE]u32 = std.mem.zeroes([CHUNK_SIZE]u32),
+
+    /// Encodes the blocks of `chunk`, such as for a chunk slot from `GpuTree.dirtyChunks`.
+    pub fn encode(self: *BlockStatePathtraceIndices, chunk: *const ChunkInner) void {
+        for (0..CHUNK_SIZE) |i| {
+            const state = chunk.blockStateAt(BlockIndex{ .index = @intCast(i) });
+            self.indices[i] = if (state == AIR_BLOCK_STATE) 0 else 1;
+        }
+    }
 };
@@ -0,0 +1,324 @@
+//! Epoch based memory reclamation.
+//! Allows readers to traverse shared structures without acquiring any lock, by pinning
+//! the current global epoch in a per-thread slot. Writers unlink nodes using atomic stores,
+//! and then retire them rather than freeing them immediately. A retired node is only
+//! reclaimed once the global epoch has advanced twice, at which point no pinned
+//! thread can still be holding a reference to it.
+//!
+//! # Rules
+//!
+//! - Readers must not hold a reference obtained while pinned after calling `unpin()`.
+//! - Writers must unlink a node before retiring it, and must retire it while pinned.
+
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const Mutex = std.Thread.Mutex;
+const ArrayListUnmanaged = std.ArrayListUnmanaged;
+const Atomic = std.atomic.Value;
+const AtomicOrder = std.builtin.AtomicOrder;
+const assert = std.debug.assert;
+const expect = std.testing.expect;
+
+/// Maximum number of threads that can have an epoch pinned at the same time.
+/// Any more wait within `pin()` until another thread unpins.
+pub const MAX_PINNED_THREADS = 64;
+/// Number of retired objects within an epoch before trying to advance the global epoch.
+const ADVANCE_THRESHOLD = 64;
+/// Slot value of a thread that is not pinned.
+const UNPINNED: u64 = 0;
+
+/// Index of the slot the calling thread last pinned with.
+/// Allows pinning to normally succeed on the first attempt.
+threadlocal var slotHint: usize = 0;
+/// The manager the calling thread has pinned, so nested pins, such as reading a `Snapshot` from within
+/// a pinned job, reuse it's slot rather than claiming another. Pinning a different manager while pinned
+/// claims a slot of that manager as normal.
+threadlocal var pinnedManager: ?*EpochManager = null;
+/// Slot of `pinnedManager` the calling thread holds.
+threadlocal var pinnedSlot: usize = 0;
+/// Number of guards the calling thread holds on `pinnedSlot`.
+threadlocal var pinDepth: usize = 0;
+
+pub const EpochManager = struct {
+    const Self = @This();
+
+    globalEpoch: Atomic(u64) align(64) = Atomic(u64).init(1),
+    slots: [MAX_PINNED_THREADS]Slot = .{Slot{}} ** MAX_PINNED_THREADS,
+    /// Must be held to retire objects, or to advance the global epoch.
+    retiredMutex: Mutex = .{},
+    /// Objects retired during each of the 3 epochs that can be live at once, indexed by `epoch % 3`.
+    retired: [3]ArrayListUnmanaged(Retired) = .{ .{}, .{}, .{} },
+    allocator: *Allocator,
+
+    pub fn init(allocator: *Allocator) Self {
+        return Self{ .allocator = allocator };
+    }
+
+    /// Reclaims every retired object.
+    /// Asserts that no thread is pinned.
+    pub fn deinit(self: *Self) void {
+        for (&self.slots) |*slot| {
+            assert(slot.state.load(AtomicOrder.Acquire) == UNPINNED);
+        }
+
+        for (0..3) |i| {
+            self.reclaimBag(i);
+            self.retired[i].deinit(self.allocator.*);
+        }
+    }
+
+    /// Pins the current global epoch for the calling thread. While pinned, any object
+    /// that is retired cannot be reclaimed. Call `unpin()` on the returned guard when done.
+    /// Pinning only touches the calling thread's slot, unless all slots are in use.
+    /// Pinning again while already pinned shares the same slot, keeping the epoch first pinned.
+    pub fn pin(self: *Self) Guard {
+        if (pinnedManager == self) {
+            pinDepth += 1;
+            return Guard{ .manager = self, .slot = pinnedSlot };
+        }
+
+        var epoch = self.globalEpoch.load(AtomicOrder.Acquire);
+
+        var index = slotHint;
+        var attempts: usize = 0;
+        while (self.slots[index].state.cmpxchgWeak(UNPINNED, pinnedState(epoch), AtomicOrder.SeqCst, AtomicOrder.Monotonic) != null) {
+            index = (index + 1) % MAX_PINNED_THREADS;
+            attempts += 1;
+            if (attempts % MAX_PINNED_THREADS == 0) {
+                // Every slot is held by another thread. Let them make progress and unpin.
+                std.Thread.yield() catch {};
+                epoch = self.globalEpoch.load(AtomicOrder.Acquire);
+            }
+        }
+        slotHint = index;
+        if (pinnedManager == null) {
+            pinnedManager = self;
+            pinnedSlot = index;
+            pinDepth = 1;
+        }
+
+        // The global epoch may have advanced before the slot was published.
+        // Nothing has been read yet, so it's safe to move forward to it.
+        const current = self.globalEpoch.load(AtomicOrder.SeqCst);
+        if (current != epoch) {
+            epoch = current;
+            self.slots[index].state.store(pinnedState(epoch), AtomicOrder.SeqCst);
+        }
+
+        return Guard{ .manager = self, .slot = index };
+    }
+
+    /// Tries to advance the global epoch, which is only possible if every pinned thread has observed
+    /// the current one. Reclaims the objects retired two epochs ago if successful.
+    pub fn tryAdvance(self: *Self) bool {
+        self.retiredMutex.lock();
+        defer self.retiredMutex.unlock();
+        return self.tryAdvanceLocked();
+    }
+
+    fn tryAdvanceLocked(self: *Self) bool {
+        const epoch = self.globalEpoch.load(AtomicOrder.SeqCst);
+        for (&self.slots) |*slot| {
+            const state = slot.state.load(AtomicOrder.SeqCst);
+            if (state != UNPINNED and state != pinnedState(epoch)) {
+                return false;
+            }
+        }
+
+        self.globalEpoch.store(epoch + 1, AtomicOrder.SeqCst);
+        // Every pinned thread is now at `epoch` or later, so nothing retired at `epoch - 1` can be observed.
+        self.reclaimBag(@intCast((epoch + 2) % 3));
+        return true;
+    }
+
+    fn reclaimBag(self: *Self, bagIndex: usize) void {
+        for (self.retired[bagIndex].items) |retired| {
+            retired.destroy(retired.ptr);
+        }
+        self.retired[bagIndex].clearRetainingCapacity();
+    }
+
+    /// Waits until every other thread that is currently pinned has unpinned at least once.
+    /// Used as a fallback when a retired object cannot be queued.
+    fn synchronize(self: *Self, ownSlot: usize) void {
+        for (0..MAX_PINNED_THREADS) |i| {
+            if (i == ownSlot) continue;
+
+            const observed = self.slots[i].state.load(AtomicOrder.SeqCst);
+            if (observed == UNPINNED) continue;
+
+            while (self.slots[i].state.load(AtomicOrder.SeqCst) == observed) {
+                std.Thread.yield() catch {};
+            }
+        }
+    }
+};
+
+/// A pinned epoch. While held, nothing that was reachable when pinned will be reclaimed.
+pub const Guard = struct {
+    manager: *EpochManager,
+    slot: usize,
+
+    /// Unpins the epoch. Every reference obtained while pinned is invalid afterwards.
+    /// Must be called by the thread that pinned it. The slot stays pinned until every nested guard is unpinned.
+    pub fn unpin(self: Guard) void {
+        if (pinnedManager == self.manager and pinnedSlot == self.slot) {
+            pinDepth -= 1;
+            if (pinDepth > 0) {
+                return;
+            }
+            pinnedManager = null;
+        }
+        self.manager.slots[self.slot].state.store(UNPINNED, AtomicOrder.Release);
+    }
+
+    /// Retires `ptr`, calling `destroy` with it once no pinned thread can still observe it.
+    /// `ptr` must have already been unlinked from the shared structure.
+    pub fn retire(self: Guard, ptr: *anyopaque, destroy: *const fn (*anyopaque) void) void {
+        const manager = self.manager;
+        manager.retiredMutex.lock();
+
+        const epoch = manager.globalEpoch.load(AtomicOrder.SeqCst);
+        const bag = &manager.retired[@intCast(epoch % 3)];
+
+        if (bag.append(manager.allocator.*, Retired{ .ptr = ptr, .destroy = destroy })) {
+            if (bag.items.len >= ADVANCE_THRESHOLD) {
+                _ = manager.tryAdvanceLocked();
+            }
+            manager.retiredMutex.unlock();
+        } else |_| {
+            // Could not queue it, so wait out the grace period right here instead.
+            manager.retiredMutex.unlock();
+            manager.synchronize(self.slot);
+            destroy(ptr);
+        }
+    }
+
+    /// Type safe version of `retire()`.
+    pub fn retireObject(self: Guard, comptime T: type, ptr: *T, comptime destroy: fn (*T) void) void {
+        const Wrapper = struct {
+            fn call(erased: *anyopaque) void {
+                destroy(@ptrCast(@alignCast(erased)));
+            }
+        };
+        self.retire(@ptrCast(ptr), Wrapper.call);
+    }
+};
+
+const Slot = struct {
+    /// Either `UNPINNED`, or the pinned epoch as `pinnedState()`.
+    state: Atomic(u64) align(64) = Atomic(u64).init(UNPINNED),
+};
+
+const Retired = struct {
+    ptr: *anyopaque,
+    destroy: *const fn (*anyopaque) void,
+};
+
+fn pinnedState(epoch: u64) u64 {
+    return (epoch << 1) | 1;
+}
+
+// Tests
+
+var testDestroyedCount: usize = 0;
+
+fn testDestroy(ptr: *anyopaque) void {
+    _ = ptr;
+    testDestroyedCount += 1;
+}
+
+test "Slot size align" {
+    try expect(@sizeOf(Slot) == 64);
+    try expect(@alignOf(Slot) == 64);
+}
+
+test "Pin unpin" {
+    var allocator = std.testing.allocator;
+    var manager = EpochManager.init(&allocator);
+    defer manager.deinit();
+
+    const guard = manager.pin();
+    guard.unpin();
+}
+
+test "Nested pins share a slot" {
+    var allocator = std.testing.allocator;
+    var manager = EpochManager.init(&allocator);
+    defer manager.deinit();
+
+    // More guards than there are slots would never finish pinning if each claimed it's own.
+    var guards: [MAX_PINNED_THREADS + 1]Guard = undefined;
+    for (&guards) |*guard| {
+        guard.* = manager.pin();
+    }
+    try expect(guards[0].slot == guards[MAX_PINNED_THREADS].slot);
+
+    var i: usize = guards.len;
+    while (i > 1) {
+        i -= 1;
+        guards[i].unpin();
+    }
+    try expect(manager.slots[guards[0].slot].state.load(AtomicOrder.Acquire) != UNPINNED);
+    guards[0].unpin();
+    try expect(manager.slots[guards[0].slot].state.load(AtomicOrder.Acquire) == UNPINNED);
+}
+
+test "Retired object reclaimed after two epochs" {
+    var allocator = std.testing.allocator;
+    var manager = EpochManager.init(&allocator);
+    defer manager.deinit();
+
+    testDestroyedCount = 0;
+    var object: u32 = 0;
+    {
+        const guard = manager.pin();
+        defer guard.unpin();
+        guard.retire(@ptrCast(&object), testDestroy);
+    }
+
+    try expect(manager.tryAdvance());
+    try expect(testDestroyedCount == 0);
+    try expect(manager.tryAdvance());
+    try expect(testDestroyedCount == 1);
+}
+
+test "Pinned thread blocks reclamation" {
+    var allocator = std.testing.allocator;
+    var manager = EpochManager.init(&allocator);
+    defer manager.deinit();
+
+    testDestroyedCount = 0;
+    var object: u32 = 0;
+
+    const reader = manager.pin();
+    {
+        const writer = manager.pin();
+        defer writer.unpin();
+        writer.retire(@ptrCast(&object), testDestroy);
+    }
+
+    try expect(manager.tryAdvance()); // reader has observed the current epoch
+    try expect(!manager.tryAdvance()); // but not the next one
+    try expect(testDestroyedCount == 0);
+
+    reader.unpin();
+    try expect(manager.tryAdvance());
+    try expect(testDestroyedCount == 1);
+}
+
+test "Deinit reclaims everything" {
+    var allocator = std.testing.allocator;
+    var manager = EpochManager.init(&allocator);
+
+    testDestroyedCount = 0;
+    var object: u32 = 0;
+    {
+        const guard = manager.pin();
+        defer guard.unpin();
+        guard.retire(@ptrCast(&object), testDestroy);
+    }
+
+    manager.deinit();
+    try expect(testDestroyedCount == 1);
+}
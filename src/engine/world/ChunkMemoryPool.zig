@@ -0,0 +1,426 @@
+//! Memory shared by several worlds, such as every dimension of a server.
+//! Each world allocates through it's own `World`, passing `World.allocator()` to `FatTree.init()`.
+//!
+//! Once freed, allocations the size of a layer, noodle layer, chunk, or chunk's block state indices
+//! are kept on free lists shared by every world, so memory freed by one world is reused by any other.
+//! Peak memory then follows the total loaded across all worlds, rather than the sum of the peak of
+//! each world. Every other allocation goes directly to the backing allocator.
+//!
+//! A world can be given a quota, past which it's allocations fail with `error.OutOfMemory`,
+//! which the `FatTree` already handles.
+//!
+//! # Thread safety
+//!
+//! Every function is thread safe, as long as the backing allocator is.
+//! The pool must not be moved once a `World` has been created.
+
+const std = @import("std");
+const assert = std.debug.assert;
+const expect = std.testing.expect;
+const Allocator = std.mem.Allocator;
+const Mutex = std.Thread.Mutex;
+const ArrayListUnmanaged = std.ArrayListUnmanaged;
+const FatTree = @import("fat_tree/FatTree.zig");
+const Chunk = @import("chunk/Chunk.zig");
+const BlockStateIndices = @import("chunk/BlockStateIndices.zig");
+const IndexBitWidth = BlockStateIndices.IndexBitWidth;
+const world_transform = @import("world_transform.zig");
+const BlockPosition = world_transform.BlockPosition;
+
+const Self = @This();
+
+/// Bytes kept on the free lists by default, before returning memory to the backing allocator.
+pub const DEFAULT_MAX_CACHED_BYTES = 64 * 1024 * 1024;
+
+const SizeClass = struct {
+    size: usize,
+    /// As log2, like `Allocator` uses.
+    alignment: u8,
+
+    fn of(comptime T: type) SizeClass {
+        return SizeClass{ .size = @sizeOf(T), .alignment = std.math.log2_int(usize, @alignOf(T)) };
+    }
+};
+
+/// Allocations that the pool keeps free lists for.
+const SIZE_CLASSES = blk: {
+    var classes = [_]SizeClass{
+        SizeClass.of(FatTree.Layer),
+        SizeClass.of(FatTree.NoodleLayer),
+        SizeClass.of(Chunk.Inner),
+    } ++ [_]SizeClass{undefined} ** @typeInfo(IndexBitWidth).Enum.fields.len;
+
+    for (@typeInfo(IndexBitWidth).Enum.fields, 3..) |field, i| {
+        classes[i] = SizeClass{ .size = BlockStateIndices.allocationSize(@enumFromInt(field.value)), .alignment = std.math.log2_int(usize, @alignOf(usize)) };
+    }
+    for (classes) |class| {
+        assert(class.size >= @sizeOf(FreeBlock));
+    }
+    break :blk classes;
+};
+
+/// Stored within a freed allocation, linking it to the next one of the same size class.
+const FreeBlock = struct {
+    next: ?*FreeBlock,
+};
+
+backing: Allocator,
+mutex: Mutex = .{},
+freeLists: [SIZE_CLASSES.len]?*FreeBlock = .{null} ** SIZE_CLASSES.len,
+/// Blocks beyond this many bytes on the free lists are returned to the backing allocator instead.
+maxCachedBytes: usize,
+cachedBytes: usize = 0,
+/// Bytes allocated by every world.
+inUseBytes: usize = 0,
+/// Highest the bytes obtained from the backing allocator, used and cached, has reached.
+peakBackingBytes: usize = 0,
+worlds: ArrayListUnmanaged(*World) = .{},
+
+pub fn init(backing: Allocator, maxCachedBytes: usize) Self {
+    return Self{ .backing = backing, .maxCachedBytes = maxCachedBytes };
+}
+
+/// Every world must be destroyed beforehand.
+pub fn deinit(self: *Self) void {
+    if (self.worlds.items.len != 0) {
+        @panic("Cannot deinitialize a chunk memory pool that still has worlds");
+    }
+    self.trim();
+    self.worlds.deinit(self.backing);
+}
+
+/// Creates a world allocating through this pool. `quota` is the most bytes it can have allocated at once,
+/// or null for no limit. Destroy it with `destroyWorld()` after deinitializing everything allocated through it.
+pub fn createWorld(self: *Self, quota: ?usize) Allocator.Error!*World {
+    const world = try self.backing.create(World);
+    errdefer self.backing.destroy(world);
+    world.* = World{ .pool = self, .quota = quota };
+
+    self.mutex.lock();
+    defer self.mutex.unlock();
+    try self.worlds.append(self.backing, world);
+    return world;
+}
+
+/// Asserts that everything allocated through `world` has been freed.
+pub fn destroyWorld(self: *Self, world: *World) void {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    if (world.usedBytes != 0) {
+        @panic("Cannot destroy a world that still has memory allocated");
+    }
+    const index = std.mem.indexOfScalar(*World, self.worlds.items, world) orelse @panic("Cannot destroy a world from another chunk memory pool");
+    _ = self.worlds.swapRemove(index);
+    self.backing.destroy(world);
+}
+
+/// Returns every cached block to the backing allocator.
+pub fn trim(self: *Self) void {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    for (&self.freeLists, SIZE_CLASSES) |*list, class| {
+        while (list.*) |block| {
+            list.* = block.next;
+            const bytes: [*]u8 = @ptrCast(block);
+            self.backing.rawFree(bytes[0..class.size], class.alignment, @returnAddress());
+            self.cachedBytes -= class.size;
+        }
+    }
+}
+
+pub fn stats(self: *Self) PoolStats {
+    self.mutex.lock();
+    defer self.mutex.unlock();
+
+    return PoolStats{
+        .inUseBytes = self.inUseBytes,
+        .cachedBytes = self.cachedBytes,
+        .peakBackingBytes = self.peakBackingBytes,
+        .worlds = self.worlds.items.len,
+    };
+}
+
+/// Memory used by the whole pool.
+pub const PoolStats = struct {
+    inUseBytes: usize,
+    cachedBytes: usize,
+    peakBackingBytes: usize,
+    worlds: usize,
+
+    pub fn format(self: PoolStats, comptime _: []const u8, _: std.fmt.FormatOptions, writer: anytype) !void {
+        try writer.print("Chunk memory pool: {} worlds, {} bytes in use, {} bytes cached, peak {} bytes\n", .{
+            self.worlds,
+            self.inUseBytes,
+            self.cachedBytes,
+            self.peakBackingBytes,
+        });
+    }
+};
+
+/// Memory used by a single world.
+pub const WorldStats = struct {
+    usedBytes: usize,
+    peakBytes: usize,
+    quota: ?usize,
+    liveAllocations: usize,
+    /// Allocations that failed from exceeding the quota.
+    quotaFailures: usize,
+};
+
+/// One world's share of the pool. Allocations and frees are accounted to it.
+pub const World = struct {
+    pool: *Self,
+    quota: ?usize,
+    usedBytes: usize = 0,
+    peakBytes: usize = 0,
+    liveAllocations: usize = 0,
+    quotaFailures: usize = 0,
+
+    const VTABLE = Allocator.VTable{
+        .alloc = alloc,
+        .resize = resize,
+        .free = free,
+    };
+
+    /// Pass to `FatTree.init()`.
+    pub fn allocator(self: *World) Allocator {
+        return Allocator{ .ptr = self, .vtable = &VTABLE };
+    }
+
+    /// Allocations already made are kept, even if they exceed the new quota.
+    pub fn setQuota(self: *World, quota: ?usize) void {
+        self.pool.mutex.lock();
+        defer self.pool.mutex.unlock();
+        self.quota = quota;
+    }
+
+    pub fn stats(self: *World) WorldStats {
+        self.pool.mutex.lock();
+        defer self.pool.mutex.unlock();
+
+        return WorldStats{
+            .usedBytes = self.usedBytes,
+            .peakBytes = self.peakBytes,
+            .quota = self.quota,
+            .liveAllocations = self.liveAllocations,
+            .quotaFailures = self.quotaFailures,
+        };
+    }
+
+    fn alloc(ctx: *anyopaque, len: usize, ptrAlign: u8, retAddr: usize) ?[*]u8 {
+        const self: *World = @ptrCast(@alignCast(ctx));
+        const pool = self.pool;
+        const class = sizeClassIndex(len, ptrAlign);
+
+        {
+            pool.mutex.lock();
+            defer pool.mutex.unlock();
+
+            if (!self.reserveLocked(len)) {
+                return null;
+            }
+            self.liveAllocations += 1;
+            if (class) |c| {
+                if (pool.freeLists[c]) |block| {
+                    pool.freeLists[c] = block.next;
+                    pool.cachedBytes -= len;
+                    return @ptrCast(block);
+                }
+            }
+        }
+
+        // Cached blocks are freed with the alignment of their size class, so must be allocated with it.
+        const alignment = if (class) |c| SIZE_CLASSES[c].alignment else ptrAlign;
+        const result = pool.backing.rawAlloc(len, alignment, retAddr);
+
+        pool.mutex.lock();
+        defer pool.mutex.unlock();
+        if (result == null) {
+            self.unreserveLocked(len);
+            self.liveAllocations -= 1;
+        } else {
+            pool.peakBackingBytes = @max(pool.peakBackingBytes, pool.inUseBytes + pool.cachedBytes);
+        }
+        return result;
+    }
+
+    fn resize(ctx: *anyopaque, buf: []u8, bufAlign: u8, newLen: usize, retAddr: usize) bool {
+        const self: *World = @ptrCast(@alignCast(ctx));
+        const pool = self.pool;
+
+        // Resizing into or out of a size class would free the block to the wrong free list.
+        if (sizeClassIndex(buf.len, bufAlign) != null or sizeClassIndex(newLen, bufAlign) != null) {
+            return newLen == buf.len;
+        }
+
+        if (newLen > buf.len) {
+            {
+                pool.mutex.lock();
+                defer pool.mutex.unlock();
+                if (!self.reserveLocked(newLen - buf.len)) {
+                    return false;
+                }
+            }
+            if (pool.backing.rawResize(buf, bufAlign, newLen, retAddr)) {
+                pool.mutex.lock();
+                defer pool.mutex.unlock();
+                pool.peakBackingBytes = @max(pool.peakBackingBytes, pool.inUseBytes + pool.cachedBytes);
+                return true;
+            }
+
+            pool.mutex.lock();
+            defer pool.mutex.unlock();
+            self.unreserveLocked(newLen - buf.len);
+            return false;
+        }
+
+        if (!pool.backing.rawResize(buf, bufAlign, newLen, retAddr)) {
+            return false;
+        }
+        pool.mutex.lock();
+        defer pool.mutex.unlock();
+        self.unreserveLocked(buf.len - newLen);
+        return true;
+    }
+
+    fn free(ctx: *anyopaque, buf: []u8, bufAlign: u8, retAddr: usize) void {
+        const self: *World = @ptrCast(@alignCast(ctx));
+        const pool = self.pool;
+        const class = sizeClassIndex(buf.len, bufAlign);
+
+        {
+            pool.mutex.lock();
+            defer pool.mutex.unlock();
+
+            self.unreserveLocked(buf.len);
+            self.liveAllocations -= 1;
+            if (class) |c| {
+                if (pool.cachedBytes + buf.len <= pool.maxCachedBytes) {
+                    const block: *FreeBlock = @ptrCast(@alignCast(buf.ptr));
+                    block.next = pool.freeLists[c];
+                    pool.freeLists[c] = block;
+                    pool.cachedBytes += buf.len;
+                    return;
+                }
+            }
+        }
+
+        const alignment = if (class) |c| SIZE_CLASSES[c].alignment else bufAlign;
+        pool.backing.rawFree(buf, alignment, retAddr);
+    }
+
+    /// Accounts `bytes` to this world, unless it would exceed the quota.
+    fn reserveLocked(self: *World, bytes: usize) bool {
+        if (self.quota) |quota| {
+            if (self.usedBytes + bytes > quota) {
+                self.quotaFailures += 1;
+                return false;
+            }
+        }
+        self.usedBytes += bytes;
+        self.peakBytes = @max(self.peakBytes, self.usedBytes);
+        self.pool.inUseBytes += bytes;
+        return true;
+    }
+
+    fn unreserveLocked(self: *World, bytes: usize) void {
+        self.usedBytes -= bytes;
+        self.pool.inUseBytes -= bytes;
+    }
+};
+
+fn sizeClassIndex(len: usize, ptrAlign: u8) ?usize {
+    inline for (SIZE_CLASSES, 0..) |class, i| {
+        if (len == class.size and ptrAlign <= class.alignment) {
+            return i;
+        }
+    }
+    return null;
+}
+
+// Tests
+
+fn testFillWorld(tree: *FatTree) Allocator.Error!void {
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    for (0..8) |i| {
+        const position = (BlockPosition{ .x = @intCast(i * 32), .y = 0, .z = 0 }).asTreeIndices();
+        try inner.insertChunk(try Chunk.init(tree, position));
+    }
+}
+
+test "Memory freed by one world is reused by another" {
+    var pool = Self.init(std.testing.allocator, DEFAULT_MAX_CACHED_BYTES);
+    defer pool.deinit();
+
+    const overworld = try pool.createWorld(null);
+    defer pool.destroyWorld(overworld);
+    const nether = try pool.createWorld(null);
+    defer pool.destroyWorld(nether);
+
+    {
+        const tree = try FatTree.init(overworld.allocator());
+        defer tree.deinit();
+        try testFillWorld(tree);
+        try expect(overworld.stats().usedBytes > 0);
+    }
+    try expect(overworld.stats().usedBytes == 0);
+    try expect(overworld.stats().liveAllocations == 0);
+
+    const peak = pool.stats().peakBackingBytes;
+    try expect(pool.stats().cachedBytes > 0);
+    {
+        const tree = try FatTree.init(nether.allocator());
+        defer tree.deinit();
+        try testFillWorld(tree);
+        try expect(nether.stats().peakBytes == overworld.stats().peakBytes);
+    }
+
+    // The nether reused everything the overworld freed, so the pool never grew.
+    try expect(pool.stats().peakBackingBytes == peak);
+
+    pool.trim();
+    try expect(pool.stats().cachedBytes == 0);
+}
+
+test "World quota" {
+    var pool = Self.init(std.testing.allocator, DEFAULT_MAX_CACHED_BYTES);
+    defer pool.deinit();
+
+    const world = try pool.createWorld(null);
+    defer pool.destroyWorld(world);
+
+    const tree = try FatTree.init(world.allocator());
+    defer tree.deinit();
+
+    // Not enough room for another chunk.
+    world.setQuota(world.stats().usedBytes + @sizeOf(Chunk.Inner) - 1);
+    const origin = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    try std.testing.expectError(error.OutOfMemory, Chunk.init(tree, origin));
+    try expect(world.stats().quotaFailures == 1);
+
+    world.setQuota(null);
+    var chunk = try Chunk.init(tree, origin);
+    chunk.deinit();
+}
+
+test "Allocations outside of size classes" {
+    var pool = Self.init(std.testing.allocator, 0);
+    defer pool.deinit();
+
+    const world = try pool.createWorld(1000);
+    defer pool.destroyWorld(world);
+
+    const allocator = world.allocator();
+    var list = std.ArrayList(u8).init(allocator);
+    try list.appendNTimes(0, 500);
+    try expect(world.stats().usedBytes >= 500);
+    try std.testing.expectError(error.OutOfMemory, list.appendNTimes(0, 1000));
+    list.deinit();
+
+    try expect(world.stats().usedBytes == 0);
+    try expect(pool.stats().cachedBytes == 0);
+}
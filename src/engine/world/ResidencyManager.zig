@@ -0,0 +1,834 @@
+//! Decides which chunks of a `FatTree` should be loaded, and streams them in and out around observers,
+//! such as players. Every chunk within the view radius of any observer is wanted.
+//!
+//! When an observer moves, only the shell of chunks entering and leaving it's sphere is visited,
+//! one line of chunks at a time, rather than recomputing every chunk within it.
+//! Wanted chunks are loaded closest first, preferring chunks in front of the observers, and chunks
+//! no longer wanted are unloaded. Loading and unloading run as jobs on the `JobSystem`, through
+//! `FatTree.lockSubtreeModify()`, so streaming in different regions doesn't contend.
+//!
+//! Call `update()` once per frame. It applies finished jobs, and issues new ones within the frame's `Budget`.
+//!
+//! # Thread safety
+//!
+//! Every function must be called from the same thread, such as the game thread.
+//! The manager assumes it is the only thing inserting or removing chunks at the positions it manages.
+
+const std = @import("std");
+const assert = std.debug.assert;
+const expect = std.testing.expect;
+const Allocator = std.mem.Allocator;
+const Mutex = std.Thread.Mutex;
+const ArrayListUnmanaged = std.ArrayListUnmanaged;
+const AutoHashMapUnmanaged = std.AutoHashMapUnmanaged;
+const Atomic = std.atomic.Value;
+const AtomicOrder = std.builtin.AtomicOrder;
+const FatTree = @import("fat_tree/FatTree.zig");
+const Chunk = @import("chunk/Chunk.zig");
+const tree_layer_indices = @import("fat_tree/tree_layer_indices.zig");
+const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
+const world_transform = @import("world_transform.zig");
+const BlockPosition = world_transform.BlockPosition;
+const CHUNK_LENGTH = world_transform.CHUNK_LENGTH;
+const JobSystem = @import("../types/job_system.zig").JobSystem;
+const vec3 = @import("../math/vector.zig").vec3;
+
+const Self = @This();
+
+/// Lowest chunk coordinate along each axis.
+const MIN_CHUNK_COORD = @divFloor(world_transform.WORLD_MIN_BLOCK_POS, CHUNK_LENGTH);
+/// Highest chunk coordinate along each axis.
+const MAX_CHUNK_COORD = @divFloor(world_transform.WORLD_MAX_BLOCK_POS, CHUNK_LENGTH);
+/// Frames `update()` waits before loading a chunk again after it failed to load.
+const RETRY_DELAY_FRAMES: u64 = 4;
+/// The wait doubles with each failure in a row, up to this many times.
+const MAX_RETRY_DOUBLINGS = 8;
+
+/// Position of a chunk, in chunks rather than blocks.
+pub const ChunkCoord = struct {
+    x: i64,
+    y: i64,
+    z: i64,
+
+    /// The chunk holding `position`.
+    pub fn fromBlockPosition(position: BlockPosition) ChunkCoord {
+        return ChunkCoord{
+            .x = @divFloor(position.x, CHUNK_LENGTH),
+            .y = @divFloor(position.y, CHUNK_LENGTH),
+            .z = @divFloor(position.z, CHUNK_LENGTH),
+        };
+    }
+
+    pub fn treeIndices(self: ChunkCoord) TreeLayerIndices {
+        const position = BlockPosition{ .x = self.x * CHUNK_LENGTH, .y = self.y * CHUNK_LENGTH, .z = self.z * CHUNK_LENGTH };
+        return position.asTreeIndices();
+    }
+};
+
+/// Something that needs the chunks around it loaded, such as a player's camera.
+pub const Observer = struct {
+    position: BlockPosition,
+    /// Every chunk within this many chunks of the chunk holding `position` is wanted.
+    radius: u32,
+    /// Direction the observer is looking, which doesn't need to be normalized.
+    /// Chunks in front are loaded before chunks behind. Zero has no preference.
+    direction: vec3 = vec3{},
+};
+
+/// Index of an observer added through `addObserver()`.
+pub const ObserverId = usize;
+
+/// Creates and disposes of chunks for the manager. Called from `JobSystem` threads,
+/// so `context` must be thread safe.
+pub const Loader = struct {
+    context: *anyopaque = undefined,
+    /// Creates the chunk at `position`, such as by reading it from disk or generating it.
+    /// Creates an empty chunk if null.
+    load: ?*const fn (context: *anyopaque, tree: *FatTree, position: TreeLayerIndices) Allocator.Error!Chunk = null,
+    /// Called with a chunk just before it's removed from the tree, such as to save it.
+    unload: ?*const fn (context: *anyopaque, chunk: Chunk) void = null,
+};
+
+/// Limits on the work `update()` does within a single frame.
+pub const Budget = struct {
+    /// Most load jobs issued per frame.
+    maxLoadsPerFrame: usize = 64,
+    /// Most unload jobs issued per frame.
+    maxUnloadsPerFrame: usize = 64,
+    /// Most jobs that can be running at once.
+    maxJobsInFlight: usize = 256,
+    /// No loads are issued while `FatTree.bytesUsed()` reports the tree using at least this many bytes.
+    /// Unloads are still issued, freeing memory.
+    maxTreeBytes: ?usize = null,
+    /// Nanoseconds `update()` can spend issuing jobs.
+    frameTimeNs: u64 = 2 * std.time.ns_per_ms,
+};
+
+/// What `update()` did this frame.
+pub const FrameStats = struct {
+    loadsIssued: usize = 0,
+    unloadsIssued: usize = 0,
+    loadsFinished: usize = 0,
+    unloadsFinished: usize = 0,
+    failedJobs: usize = 0,
+    /// Loads were not issued as the tree is over `Budget.maxTreeBytes`.
+    overMemoryBudget: bool = false,
+};
+
+const ChunkState = enum {
+    unloaded,
+    /// Within `loadQueue`.
+    queued,
+    loading,
+    resident,
+    unloading,
+    /// Failed to load, and within `retryQueue` until `ChunkEntry.retryFrame`.
+    retrying,
+};
+
+const ChunkEntry = struct {
+    /// Number of observers wanting this chunk.
+    wanted: u32 = 0,
+    state: ChunkState = .unloaded,
+    /// Loads that have failed in a row.
+    failedLoads: u8 = 0,
+    /// The `update()` from which a chunk that failed to load is queued again.
+    retryFrame: u64 = 0,
+};
+
+const LoadRequest = struct {
+    coord: ChunkCoord,
+    /// Lower is loaded first.
+    priority: f32,
+};
+
+const JobKind = enum {
+    load,
+    unload,
+};
+
+const FinishedJob = struct {
+    coord: ChunkCoord,
+    kind: JobKind,
+    succeeded: bool,
+};
+
+/// The chunks along one line of a sphere, from `min` to `max` inclusive. Empty if `min > max`.
+const Span = struct {
+    min: i64,
+    max: i64,
+
+    const EMPTY = Span{ .min = 0, .max = -1 };
+
+    fn contains(self: Span, value: i64) bool {
+        return value >= self.min and value <= self.max;
+    }
+
+    /// The parts of `self` not within `other`, as at most two spans.
+    fn without(self: Span, other: Span) [2]Span {
+        if (other.min > other.max or other.max < self.min or other.min > self.max) {
+            return .{ self, EMPTY };
+        }
+        return .{
+            Span{ .min = self.min, .max = other.min - 1 },
+            Span{ .min = other.max + 1, .max = self.max },
+        };
+    }
+};
+
+/// The chunks wanted by one observer.
+const Sphere = struct {
+    center: ChunkCoord,
+    radius: i64,
+
+    fn of(observer: Observer) Sphere {
+        return Sphere{ .center = ChunkCoord.fromBlockPosition(observer.position), .radius = observer.radius };
+    }
+
+    /// The chunks along z within the sphere, at `x` and `y`.
+    fn span(self: Sphere, x: i64, y: i64) Span {
+        const dx = x - self.center.x;
+        const dy = y - self.center.y;
+        const remaining = self.radius * self.radius - dx * dx - dy * dy;
+        if (remaining < 0 or x < MIN_CHUNK_COORD or x > MAX_CHUNK_COORD or y < MIN_CHUNK_COORD or y > MAX_CHUNK_COORD) {
+            return Span.EMPTY;
+        }
+
+        const halfLength: i64 = std.math.sqrt(@as(u64, @intCast(remaining)));
+        return Span{
+            .min = @max(self.center.z - halfLength, MIN_CHUNK_COORD),
+            .max = @min(self.center.z + halfLength, MAX_CHUNK_COORD),
+        };
+    }
+};
+
+allocator: Allocator,
+tree: *FatTree,
+jobSystem: *JobSystem,
+loader: Loader,
+budget: Budget,
+/// Indexed by `ObserverId`. Removed observers are null, and their ids reused.
+observers: ArrayListUnmanaged(?Observer) = .{},
+/// Every chunk that is wanted, or not yet unloaded.
+chunks: AutoHashMapUnmanaged(ChunkCoord, ChunkEntry) = .{},
+/// Sorted so the next chunk to load is last. May hold chunks that are no longer queued, which are skipped.
+loadQueue: ArrayListUnmanaged(LoadRequest) = .{},
+/// Set when observers change, or chunks are queued, so the load queue is sorted again.
+prioritiesStale: bool = false,
+/// Resident chunks no longer wanted. May hold chunks that are wanted again, which are skipped.
+unloadQueue: ArrayListUnmanaged(ChunkCoord) = .{},
+/// Chunks that failed to load, waiting to be queued again. May hold chunks that are no longer retrying, which are dropped.
+retryQueue: ArrayListUnmanaged(ChunkCoord) = .{},
+/// Number of calls to `update()`.
+frameCount: u64 = 0,
+/// Jobs issued that have not yet finished.
+jobsInFlight: Atomic(usize) = Atomic(usize).init(0),
+/// Jobs that have finished, waiting for `update()`.
+finished: ArrayListUnmanaged(FinishedJob) = .{},
+finishedMutex: Mutex = .{},
+residentCount: usize = 0,
+
+/// Allocates a new manager for `tree`, running jobs on `jobSystem`. Both must outlive it.
+pub fn init(allocator: Allocator, tree: *FatTree, jobSystem: *JobSystem, loader: Loader, budget: Budget) Allocator.Error!*Self {
+    const newSelf = try allocator.create(Self);
+    newSelf.* = Self{
+        .allocator = allocator,
+        .tree = tree,
+        .jobSystem = jobSystem,
+        .loader = loader,
+        .budget = budget,
+    };
+    return newSelf;
+}
+
+/// Waits for every job in flight. Chunks already loaded stay in the tree.
+pub fn deinit(self: *Self) void {
+    while (self.jobsInFlight.load(AtomicOrder.Acquire) != 0) {
+        std.Thread.yield() catch {};
+    }
+
+    const allocator = self.allocator;
+    self.observers.deinit(allocator);
+    self.chunks.deinit(allocator);
+    self.loadQueue.deinit(allocator);
+    self.unloadQueue.deinit(allocator);
+    self.retryQueue.deinit(allocator);
+    self.finished.deinit(allocator);
+    allocator.destroy(self);
+}
+
+pub fn addObserver(self: *Self, observer: Observer) Allocator.Error!ObserverId {
+    const id = std.mem.indexOfScalar(?Observer, self.observers.items, null) orelse blk: {
+        try self.observers.append(self.allocator, null);
+        break :blk self.observers.items.len - 1;
+    };
+    try self.applySphereChange(null, Sphere.of(observer));
+    self.observers.items[id] = observer;
+    self.prioritiesStale = true;
+    return id;
+}
+
+/// Moves, resizes, or turns the observer `id`. Only the chunks entering and leaving it's sphere are visited.
+pub fn moveObserver(self: *Self, id: ObserverId, observer: Observer) Allocator.Error!void {
+    const old = self.observers.items[id] orelse @panic("Cannot move an observer that was removed");
+    try self.applySphereChange(Sphere.of(old), Sphere.of(observer));
+    self.observers.items[id] = observer;
+    self.prioritiesStale = true;
+}
+
+/// The chunks only `id` wanted will be unloaded.
+pub fn removeObserver(self: *Self, id: ObserverId) Allocator.Error!void {
+    const old = self.observers.items[id] orelse @panic("Cannot remove an observer that was already removed");
+    try self.applySphereChange(Sphere.of(old), null);
+    self.observers.items[id] = null;
+    self.prioritiesStale = true;
+}
+
+/// Applies every finished job, then issues unload and load jobs within the budget.
+/// Unloads are issued first, to free memory for the loads.
+/// If this fails, nothing is lost, and calling it again next frame carries on.
+pub fn update(self: *Self) Allocator.Error!FrameStats {
+    var frame = FrameStats{};
+    var timer = std.time.Timer.start() catch null;
+    self.frameCount += 1;
+    try self.applyFinishedJobs(&frame);
+    try self.queueRetries();
+
+    while (frame.unloadsIssued < self.budget.maxUnloadsPerFrame and self.canIssueJob(&timer)) {
+        const coord = self.unloadQueue.popOrNull() orelse break;
+        const entry = self.chunks.getPtr(coord) orelse continue;
+        if (entry.state != .resident or entry.wanted > 0) {
+            continue;
+        }
+        // Popping it left the room to put it back.
+        self.issueJob(coord, .unload) catch |err| {
+            self.unloadQueue.appendAssumeCapacity(coord);
+            return err;
+        };
+        entry.state = .unloading;
+        frame.unloadsIssued += 1;
+    }
+
+    if (self.budget.maxTreeBytes) |maxBytes| {
+        if (self.tree.bytesUsed() >= maxBytes) {
+            frame.overMemoryBudget = true;
+            return frame;
+        }
+    }
+
+    if (self.prioritiesStale) {
+        self.sortLoadQueue();
+    }
+    while (frame.loadsIssued < self.budget.maxLoadsPerFrame and self.canIssueJob(&timer)) {
+        const request = self.loadQueue.popOrNull() orelse break;
+        const entry = self.chunks.getPtr(request.coord) orelse continue;
+        if (entry.state != .queued) {
+            continue;
+        }
+        self.issueJob(request.coord, .load) catch |err| {
+            self.loadQueue.appendAssumeCapacity(request);
+            return err;
+        };
+        entry.state = .loading;
+        frame.loadsIssued += 1;
+    }
+    return frame;
+}
+
+/// Whether the chunk at `coord` has been loaded, and not yet unloaded.
+pub fn isResident(self: *const Self, coord: ChunkCoord) bool {
+    const entry = self.chunks.get(coord) orelse return false;
+    return entry.state == .resident or entry.state == .unloading;
+}
+
+/// Whether every wanted chunk is resident, and nothing else is.
+pub fn isSettled(self: *const Self) bool {
+    if (self.jobsInFlight.load(AtomicOrder.Acquire) != 0) {
+        return false;
+    }
+    var iter = self.chunks.iterator();
+    while (iter.next()) |entry| {
+        const state = entry.value_ptr.state;
+        if ((entry.value_ptr.wanted > 0) != (state == .resident)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Lower is loaded first. The distance to the closest observer, with chunks behind an observer
+/// treated as up to twice as far away as chunks in front of it.
+pub fn priority(self: *const Self, coord: ChunkCoord) f32 {
+    var best = std.math.inf(f32);
+    for (self.observers.items) |maybeObserver| {
+        const observer = maybeObserver orelse continue;
+        const center = ChunkCoord.fromBlockPosition(observer.position);
+        const offset = vec3{
+            .x = @floatFromInt(coord.x - center.x),
+            .y = @floatFromInt(coord.y - center.y),
+            .z = @floatFromInt(coord.z - center.z),
+        };
+        const distance = @sqrt(dot(offset, offset));
+        const directionLength = @sqrt(dot(observer.direction, observer.direction));
+
+        var facing: f32 = 0;
+        if (distance > 0 and directionLength > 0) {
+            facing = dot(offset, observer.direction) / (distance * directionLength);
+        }
+        best = @min(best, distance * (1.5 - 0.5 * facing));
+    }
+    return best;
+}
+
+fn dot(a: vec3, b: vec3) f32 {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+fn canIssueJob(self: *const Self, timer: *?std.time.Timer) bool {
+    if (self.jobsInFlight.load(AtomicOrder.Acquire) >= self.budget.maxJobsInFlight) {
+        return false;
+    }
+    if (timer.*) |*t| {
+        return t.read() < self.budget.frameTimeNs;
+    }
+    return true;
+}
+
+/// Adds and removes wanted chunks for an observer's sphere changing from `old` to `new`.
+/// Each sphere's own bounding box is walked, rather than the box around both, so an observer teleporting
+/// far away costs no more than two spheres. Only the spans along z that differ are walked.
+fn applySphereChange(self: *Self, old: ?Sphere, new: ?Sphere) Allocator.Error!void {
+    if (new) |sphere| {
+        try self.applySphereDifference(sphere, old, .want);
+    }
+    if (old) |sphere| {
+        try self.applySphereDifference(sphere, new, .unwant);
+    }
+}
+
+const WantChange = enum {
+    want,
+    unwant,
+};
+
+/// Wants or unwants every chunk within `sphere` that is not within `other`, one line of chunks along z at a time.
+fn applySphereDifference(self: *Self, sphere: Sphere, other: ?Sphere, comptime change: WantChange) Allocator.Error!void {
+    var x = sphere.center.x - sphere.radius;
+    while (x <= sphere.center.x + sphere.radius) : (x += 1) {
+        var y = sphere.center.y - sphere.radius;
+        while (y <= sphere.center.y + sphere.radius) : (y += 1) {
+            const otherSpan = if (other) |o| o.span(x, y) else Span.EMPTY;
+            for (sphere.span(x, y).without(otherSpan)) |part| {
+                var z = part.min;
+                while (z <= part.max) : (z += 1) {
+                    const coord = ChunkCoord{ .x = x, .y = y, .z = z };
+                    switch (change) {
+                        .want => try self.want(coord),
+                        .unwant => try self.unwant(coord),
+                    }
+                }
+            }
+        }
+    }
+}
+
+fn want(self: *Self, coord: ChunkCoord) Allocator.Error!void {
+    const result = try self.chunks.getOrPut(self.allocator, coord);
+    if (!result.found_existing) {
+        result.value_ptr.* = ChunkEntry{};
+    }
+    const entry = result.value_ptr;
+    entry.wanted += 1;
+    if (entry.wanted == 1 and entry.state == .unloaded) {
+        try self.queueLoad(coord, entry);
+    }
+    // Resident chunks left in the unload queue are skipped, and jobs in flight are handled once they finish.
+}
+
+fn unwant(self: *Self, coord: ChunkCoord) Allocator.Error!void {
+    const entry = self.chunks.getPtr(coord) orelse @panic("Cannot unwant a chunk that is not wanted");
+    assert(entry.wanted > 0);
+    entry.wanted -= 1;
+    if (entry.wanted > 0) {
+        return;
+    }
+
+    switch (entry.state) {
+        // Left in the load or retry queue, where it will be skipped.
+        .unloaded, .queued, .retrying => _ = self.chunks.remove(coord),
+        .resident => try self.unloadQueue.append(self.allocator, coord),
+        .loading, .unloading => {},
+    }
+}
+
+fn queueLoad(self: *Self, coord: ChunkCoord, entry: *ChunkEntry) Allocator.Error!void {
+    try self.loadQueue.ensureUnusedCapacity(self.allocator, 1);
+    self.queueLoadAssumeCapacity(coord, entry);
+}
+
+fn queueLoadAssumeCapacity(self: *Self, coord: ChunkCoord, entry: *ChunkEntry) void {
+    self.loadQueue.appendAssumeCapacity(LoadRequest{ .coord = coord, .priority = 0 });
+    entry.state = .queued;
+    self.prioritiesStale = true;
+}
+
+/// Waits to load `coord` again, doubling the wait with each failure in a row, so a loader that keeps failing,
+/// such as against a `ChunkMemoryPool` quota, isn't retried every frame.
+fn waitToRetry(self: *Self, coord: ChunkCoord, entry: *ChunkEntry) void {
+    const doublings: u6 = @intCast(@min(entry.failedLoads - 1, MAX_RETRY_DOUBLINGS));
+    entry.retryFrame = self.frameCount + (RETRY_DELAY_FRAMES << doublings);
+    entry.state = .retrying;
+    self.retryQueue.appendAssumeCapacity(coord);
+}
+
+/// Queues the chunks that have waited long enough since failing to load.
+fn queueRetries(self: *Self) Allocator.Error!void {
+    var i = self.retryQueue.items.len;
+    while (i > 0) {
+        i -= 1;
+        const coord = self.retryQueue.items[i];
+        if (self.chunks.getPtr(coord)) |entry| {
+            if (entry.state == .retrying) {
+                if (entry.retryFrame > self.frameCount) {
+                    continue;
+                }
+                // Only removed once queued, so it's retried next frame if this fails.
+                try self.queueLoad(coord, entry);
+            }
+        }
+        _ = self.retryQueue.swapRemove(i);
+    }
+}
+
+/// Sorts the load queue so the lowest priority is last, dropping anything no longer queued.
+fn sortLoadQueue(self: *Self) void {
+    var kept: usize = 0;
+    for (self.loadQueue.items) |request| {
+        const entry = self.chunks.get(request.coord) orelse continue;
+        if (entry.state != .queued) {
+            continue;
+        }
+        self.loadQueue.items[kept] = LoadRequest{ .coord = request.coord, .priority = self.priority(request.coord) };
+        kept += 1;
+    }
+    self.loadQueue.shrinkRetainingCapacity(kept);
+
+    const Compare = struct {
+        fn greaterThan(_: void, lhs: LoadRequest, rhs: LoadRequest) bool {
+            return lhs.priority > rhs.priority;
+        }
+    };
+    std.sort.pdq(LoadRequest, self.loadQueue.items, {}, Compare.greaterThan);
+    self.prioritiesStale = false;
+}
+
+fn applyFinishedJobs(self: *Self, frame: *FrameStats) Allocator.Error!void {
+    self.finishedMutex.lock();
+    defer self.finishedMutex.unlock();
+
+    while (self.finished.items.len > 0) {
+        // Reserved before popping, so a finished job is never lost.
+        try self.unloadQueue.ensureUnusedCapacity(self.allocator, 1);
+        try self.loadQueue.ensureUnusedCapacity(self.allocator, 1);
+        try self.retryQueue.ensureUnusedCapacity(self.allocator, 1);
+
+        const job = self.finished.pop();
+        const entry = self.chunks.getPtr(job.coord).?;
+        switch (job.kind) {
+            .load => {
+                frame.loadsFinished += 1;
+                if (job.succeeded) {
+                    entry.state = .resident;
+                    entry.failedLoads = 0;
+                    self.residentCount += 1;
+                } else {
+                    entry.state = .unloaded;
+                    entry.failedLoads +|= 1;
+                }
+            },
+            .unload => {
+                frame.unloadsFinished += 1;
+                if (job.succeeded) {
+                    entry.state = .unloaded;
+                    self.residentCount -= 1;
+                } else {
+                    entry.state = .resident;
+                }
+            },
+        }
+        if (!job.succeeded) {
+            frame.failedJobs += 1;
+        }
+
+        // Observers may have moved while the job was running.
+        switch (entry.state) {
+            .resident => if (entry.wanted == 0) self.unloadQueue.appendAssumeCapacity(job.coord),
+            .unloaded => if (entry.wanted == 0) {
+                _ = self.chunks.remove(job.coord);
+            } else if (entry.failedLoads > 0) {
+                self.waitToRetry(job.coord, entry);
+            } else {
+                self.queueLoadAssumeCapacity(job.coord, entry);
+            },
+            else => unreachable,
+        }
+    }
+}
+
+fn issueJob(self: *Self, coord: ChunkCoord, comptime kind: JobKind) Allocator.Error!void {
+    // Reserved up front, so the job can always report that it finished.
+    {
+        self.finishedMutex.lock();
+        defer self.finishedMutex.unlock();
+        try self.finished.ensureUnusedCapacity(self.allocator, self.jobsInFlight.load(AtomicOrder.Acquire) + 1);
+    }
+
+    _ = self.jobsInFlight.fetchAdd(1, AtomicOrder.AcqRel);
+    errdefer _ = self.jobsInFlight.fetchSub(1, AtomicOrder.AcqRel);
+    const job = switch (kind) {
+        .load => loadJob,
+        .unload => unloadJob,
+    };
+    const future = try self.jobSystem.runJob(job, .{ self, coord });
+    future.deinit();
+}
+
+fn loadJob(self: *Self, coord: ChunkCoord) void {
+    self.finishJob(coord, .load, self.loadChunk(coord.treeIndices()));
+}
+
+fn loadChunk(self: *Self, position: TreeLayerIndices) bool {
+    var chunk = if (self.loader.load) |load|
+        load(self.loader.context, self.tree, position) catch return false
+    else
+        Chunk.init(self.tree, position) catch return false;
+
+    const subtree = self.tree.lockSubtreeModify(position) catch {
+        chunk.deinit();
+        return false;
+    };
+    defer self.tree.unlockSubtreeModify(subtree);
+
+    subtree.insertChunk(chunk) catch {
+        chunk.deinit();
+        return false;
+    };
+    return true;
+}
+
+fn unloadJob(self: *Self, coord: ChunkCoord) void {
+    self.finishJob(coord, .unload, self.unloadChunk(coord.treeIndices()));
+}
+
+fn unloadChunk(self: *Self, position: TreeLayerIndices) bool {
+    const subtree = self.tree.lockSubtreeModify(position) catch return false;
+    defer self.tree.unlockSubtreeModify(subtree);
+
+    // The chunk may have been collected as garbage since it was loaded.
+    const chunk = subtree.chunkAt(position) orelse return true;
+    if (self.loader.unload) |unload| {
+        unload(self.loader.context, chunk);
+    }
+    subtree.removeChunk(position) catch return false;
+    return true;
+}
+
+fn finishJob(self: *Self, coord: ChunkCoord, kind: JobKind, succeeded: bool) void {
+    {
+        self.finishedMutex.lock();
+        defer self.finishedMutex.unlock();
+        self.finished.appendAssumeCapacity(FinishedJob{ .coord = coord, .kind = kind, .succeeded = succeeded });
+    }
+    _ = self.jobsInFlight.fetchSub(1, AtomicOrder.AcqRel);
+}
+
+// Tests
+
+/// Chunks within `radius` of `center`, counted one at a time.
+fn testSphereVolume(center: ChunkCoord, radius: i64) usize {
+    var count: usize = 0;
+    var x = center.x - radius;
+    while (x <= center.x + radius) : (x += 1) {
+        var y = center.y - radius;
+        while (y <= center.y + radius) : (y += 1) {
+            var z = center.z - radius;
+            while (z <= center.z + radius) : (z += 1) {
+                const dx = x - center.x;
+                const dy = y - center.y;
+                const dz = z - center.z;
+                if (dx * dx + dy * dy + dz * dz <= radius * radius) {
+                    count += 1;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+fn testUpdateUntilSettled(manager: *Self) !void {
+    for (0..10000) |_| {
+        _ = try manager.update();
+        if (manager.isSettled()) {
+            return;
+        }
+        std.Thread.yield() catch {};
+    }
+    return error.NotSettled;
+}
+
+/// Fails to load the first `failuresLeft` chunks.
+const TestFlakyLoader = struct {
+    failuresLeft: Atomic(usize),
+
+    fn load(context: *anyopaque, tree: *FatTree, position: TreeLayerIndices) Allocator.Error!Chunk {
+        const self: *TestFlakyLoader = @ptrCast(@alignCast(context));
+        if (self.failuresLeft.load(AtomicOrder.Acquire) > 0) {
+            _ = self.failuresLeft.fetchSub(1, AtomicOrder.AcqRel);
+            return error.OutOfMemory;
+        }
+        return Chunk.init(tree, position);
+    }
+};
+
+test "Span without" {
+    const outer = Span{ .min = 0, .max = 10 };
+    const inner = Span{ .min = 3, .max = 5 };
+    const parts = outer.without(inner);
+    try expect(parts[0].min == 0 and parts[0].max == 2);
+    try expect(parts[1].min == 6 and parts[1].max == 10);
+
+    const whole = inner.without(Span.EMPTY);
+    try expect(whole[0].min == 3 and whole[0].max == 5);
+    try expect(whole[1].min > whole[1].max);
+
+    const none = inner.without(outer);
+    try expect(none[0].min > none[0].max and none[1].min > none[1].max);
+}
+
+test "Observer sphere delta" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+    var jobs = try JobSystem.init(std.testing.allocator, 1);
+    defer jobs.deinit();
+
+    // Nothing is loaded, so only the wanted chunks are tracked.
+    const manager = try Self.init(std.testing.allocator, tree, &jobs, .{}, .{ .maxLoadsPerFrame = 0 });
+    defer manager.deinit();
+
+    const start = BlockPosition{ .x = 0, .y = 0, .z = 0 };
+    const id = try manager.addObserver(.{ .position = start, .radius = 4 });
+    try expect(manager.chunks.count() == testSphereVolume(ChunkCoord.fromBlockPosition(start), 4));
+
+    // Overlapping spheres only track each chunk once.
+    const moved = BlockPosition{ .x = 3 * CHUNK_LENGTH, .y = -CHUNK_LENGTH, .z = 0 };
+    try manager.moveObserver(id, .{ .position = moved, .radius = 4 });
+    try expect(manager.chunks.count() == testSphereVolume(ChunkCoord.fromBlockPosition(moved), 4));
+    try expect(manager.chunks.get(ChunkCoord{ .x = -4, .y = 0, .z = 0 }) == null);
+    try expect(manager.chunks.get(ChunkCoord{ .x = 7, .y = -1, .z = 0 }) != null);
+
+    // Teleporting across the world only walks the two spheres.
+    const far = BlockPosition{ .x = 1 << 33, .y = -(1 << 33), .z = 0 };
+    try manager.moveObserver(id, .{ .position = far, .radius = 4 });
+    try expect(manager.chunks.count() == testSphereVolume(ChunkCoord.fromBlockPosition(far), 4));
+    try expect(manager.chunks.get(ChunkCoord.fromBlockPosition(moved)) == null);
+
+    const other = try manager.addObserver(.{ .position = start, .radius = 2 });
+    try manager.removeObserver(id);
+    try expect(manager.chunks.count() == testSphereVolume(ChunkCoord.fromBlockPosition(start), 2));
+    try manager.removeObserver(other);
+    try expect(manager.chunks.count() == 0);
+}
+
+test "Load in front first" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+    var jobs = try JobSystem.init(std.testing.allocator, 1);
+    defer jobs.deinit();
+
+    const manager = try Self.init(std.testing.allocator, tree, &jobs, .{}, .{});
+    defer manager.deinit();
+
+    const start = BlockPosition{ .x = 0, .y = 0, .z = 0 };
+    _ = try manager.addObserver(.{ .position = start, .radius = 4, .direction = vec3{ .x = 1 } });
+    try expect(manager.priority(ChunkCoord{ .x = 2, .y = 0, .z = 0 }) < manager.priority(ChunkCoord{ .x = -2, .y = 0, .z = 0 }));
+    try expect(manager.priority(ChunkCoord{ .x = 1, .y = 0, .z = 0 }) < manager.priority(ChunkCoord{ .x = 3, .y = 0, .z = 0 }));
+
+    manager.sortLoadQueue();
+    const next = manager.loadQueue.items[manager.loadQueue.items.len - 1].coord;
+    try expect(next.x == 0 and next.y == 0 and next.z == 0);
+}
+
+test "Stream chunks around observer" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+    var jobs = try JobSystem.init(std.testing.allocator, 2);
+    defer jobs.deinit();
+
+    const manager = try Self.init(std.testing.allocator, tree, &jobs, .{}, .{ .maxLoadsPerFrame = 8, .maxUnloadsPerFrame = 8 });
+    defer manager.deinit();
+
+    const start = BlockPosition{ .x = 0, .y = 0, .z = 0 };
+    const id = try manager.addObserver(.{ .position = start, .radius = 2 });
+    try testUpdateUntilSettled(manager);
+
+    const volume = testSphereVolume(ChunkCoord.fromBlockPosition(start), 2);
+    try expect(manager.residentCount == volume);
+    {
+        const inner = tree.lockChunkModify();
+        defer tree.unlockChunkModify();
+        try expect(inner.chunkAt(ChunkCoord.fromBlockPosition(start).treeIndices()) != null);
+    }
+
+    // Far enough away that nothing is shared.
+    const far = BlockPosition{ .x = 100 * CHUNK_LENGTH, .y = 0, .z = 0 };
+    try manager.moveObserver(id, .{ .position = far, .radius = 2 });
+    try testUpdateUntilSettled(manager);
+
+    try expect(manager.residentCount == volume);
+    {
+        const inner = tree.lockChunkModify();
+        defer tree.unlockChunkModify();
+        try expect(inner.chunkAt(ChunkCoord.fromBlockPosition(start).treeIndices()) == null);
+        try expect(inner.chunkAt(ChunkCoord.fromBlockPosition(far).treeIndices()) != null);
+    }
+
+    try manager.removeObserver(id);
+    try testUpdateUntilSettled(manager);
+    try expect(manager.residentCount == 0);
+    tree.reclaimRetired();
+}
+
+test "Retry failed loads after a delay" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+    var jobs = try JobSystem.init(std.testing.allocator, 1);
+    defer jobs.deinit();
+
+    var flaky = TestFlakyLoader{ .failuresLeft = Atomic(usize).init(2) };
+    const loader = Loader{ .context = @ptrCast(&flaky), .load = TestFlakyLoader.load };
+    const manager = try Self.init(std.testing.allocator, tree, &jobs, loader, .{});
+    defer manager.deinit();
+
+    const coord = ChunkCoord{ .x = 0, .y = 0, .z = 0 };
+    _ = try manager.addObserver(.{ .position = BlockPosition{ .x = 0, .y = 0, .z = 0 }, .radius = 0 });
+
+    var failed = false;
+    for (0..10000) |_| {
+        if ((try manager.update()).failedJobs > 0) {
+            failed = true;
+            break;
+        }
+        std.Thread.yield() catch {};
+    }
+    try expect(failed);
+    try expect(manager.chunks.get(coord).?.state == .retrying);
+
+    // Not loaded again until the delay has passed, rather than every frame.
+    for (0..RETRY_DELAY_FRAMES - 1) |_| {
+        try expect((try manager.update()).loadsIssued == 0);
+    }
+
+    try testUpdateUntilSettled(manager);
+    try expect(manager.residentCount == 1);
+    try expect(manager.chunks.get(coord).?.failedLoads == 0);
+}
@@ -82,6 +82,29 @@ pub fn deinit(self: Self, allocator: Allocator) void {
     }
 }
 
+/// Allocates a copy of these indices, with the same bit width.
+/// Free the copy using `deinit()`, passing in the same `allocator`.
+pub fn clone(self: *const Self, allocator: Allocator) Allocator.Error!Self {
+    const e = self.getTag();
+    const ptr = self.getIndicesPtr();
+
+    const newPtr: *anyopaque = switch (e) {
+        .b1 => @ptrCast(try cloneIndices(BlockStateIndices1Bit, allocator, ptr)),
+        .b2 => @ptrCast(try cloneIndices(BlockStateIndices2Bit, allocator, ptr)),
+        .b4 => @ptrCast(try cloneIndices(BlockStateIndices4Bit, allocator, ptr)),
+        .b8 => @ptrCast(try cloneIndices(BlockStateIndices8Bit, allocator, ptr)),
+        .b16 => @ptrCast(try cloneIndices(BlockStateIndices16Bit, allocator, ptr)),
+    };
+    return Self{ .taggedPtr = @intFromPtr(newPtr) | (self.taggedPtr & ENUM_MASK) };
+}
+
+fn cloneIndices(comptime T: type, allocator: Allocator, ptr: *const anyopaque) Allocator.Error!*T {
+    const original: *const T = @ptrCast(@alignCast(ptr));
+    const copy = try allocator.create(T);
+    copy.* = original.*;
+    return copy;
+}
+
 /// Get the index of the block state referenced by the block at `position`.
 pub fn blockStateIndexAt(self: *const Self, position: BlockIndex) u16 {
     const e = self.getTag();
@@ -147,6 +170,95 @@ pub fn setBlockStateIndexAt(self: *Self, index: u16, position: BlockIndex) void
     }
 }
 
+/// Checks if every block references the block state at index 0.
+/// Is much faster than checking each index individually, as the raw memory is compared regardless of bit width.
+pub fn isAllZero(self: *const Self) bool {
+    const e = self.getTag();
+    const ptr = self.getIndicesPtr();
+
+    switch (e) {
+        .b1 => {
+            const as1Bit: *const BlockStateIndices1Bit = @ptrCast(@alignCast(ptr));
+            return std.mem.allEqual(usize, &as1Bit.indices, 0);
+        },
+        .b2 => {
+            const as2Bit: *const BlockStateIndices2Bit = @ptrCast(@alignCast(ptr));
+            return std.mem.allEqual(usize, &as2Bit.indices, 0);
+        },
+        .b4 => {
+            const as4Bit: *const BlockStateIndices4Bit = @ptrCast(@alignCast(ptr));
+            return std.mem.allEqual(usize, &as4Bit.indices, 0);
+        },
+        .b8 => {
+            const as8Bit: *const BlockStateIndices8Bit = @ptrCast(@alignCast(ptr));
+            return std.mem.allEqual(u8, &as8Bit.indices, 0);
+        },
+        .b16 => {
+            const as16Bit: *const BlockStateIndices16Bit = @ptrCast(@alignCast(ptr));
+            return std.mem.allEqual(u16, &as16Bit.indices, 0);
+        },
+    }
+}
+
+/// Get the index referenced by every block, or null if the blocks reference different indices.
+/// Like `isAllZero()`, the raw memory is compared regardless of bit width.
+pub fn uniformIndex(self: *const Self) ?u16 {
+    const first = self.blockStateIndexAt(BlockIndex{ .index = 0 });
+    const ptr = self.getIndicesPtr();
+
+    const allEqual = switch (self.getTag()) {
+        .b1 => std.mem.allEqual(usize, &@as(*const BlockStateIndices1Bit, @ptrCast(@alignCast(ptr))).indices, repeatedIndex(1, first)),
+        .b2 => std.mem.allEqual(usize, &@as(*const BlockStateIndices2Bit, @ptrCast(@alignCast(ptr))).indices, repeatedIndex(2, first)),
+        .b4 => std.mem.allEqual(usize, &@as(*const BlockStateIndices4Bit, @ptrCast(@alignCast(ptr))).indices, repeatedIndex(4, first)),
+        .b8 => std.mem.allEqual(u8, &@as(*const BlockStateIndices8Bit, @ptrCast(@alignCast(ptr))).indices, @intCast(first)),
+        .b16 => std.mem.allEqual(u16, &@as(*const BlockStateIndices16Bit, @ptrCast(@alignCast(ptr))).indices, first),
+    };
+    return if (allEqual) first else null;
+}
+
+/// Sets every block to reference the block state at `index`.
+/// Asserts that the current indices bit width can support `index`.
+pub fn fill(self: *Self, index: u16) void {
+    const ptr = self.getIndicesPtrMut();
+
+    switch (self.getTag()) {
+        .b1 => {
+            assert(index < 2);
+            const as1Bit: *BlockStateIndices1Bit = @ptrCast(@alignCast(ptr));
+            @memset(&as1Bit.indices, repeatedIndex(1, index));
+        },
+        .b2 => {
+            assert(index < 4);
+            const as2Bit: *BlockStateIndices2Bit = @ptrCast(@alignCast(ptr));
+            @memset(&as2Bit.indices, repeatedIndex(2, index));
+        },
+        .b4 => {
+            assert(index < 16);
+            const as4Bit: *BlockStateIndices4Bit = @ptrCast(@alignCast(ptr));
+            @memset(&as4Bit.indices, repeatedIndex(4, index));
+        },
+        .b8 => {
+            assert(index < 256);
+            const as8Bit: *BlockStateIndices8Bit = @ptrCast(@alignCast(ptr));
+            @memset(&as8Bit.indices, @intCast(index));
+        },
+        .b16 => {
+            assert(index < CHUNK_SIZE);
+            const as16Bit: *BlockStateIndices16Bit = @ptrCast(@alignCast(ptr));
+            @memset(&as16Bit.indices, index);
+        },
+    }
+}
+
+/// A `usize` of packed indices, each `bitWidth` bits wide, all set to `index`.
+fn repeatedIndex(comptime bitWidth: comptime_int, index: u16) usize {
+    var pattern: usize = 0;
+    inline for (0..(64 / bitWidth)) |i| {
+        pattern |= @as(usize, index) << (i * bitWidth);
+    }
+    return pattern;
+}
+
 /// Reserves this `BlockStateIndices` to use the smallest
 /// amount of memory required to fit up to `uniqueBlockStates` as a valid index.
 /// Will not shrink the memory usage. Will copy over the existing indices.
@@ -157,6 +269,22 @@ pub fn reserve(self: *Self, allocator: Allocator, uniqueBlockStates: u16) Alloca
     try self.reallocate(allocator, uniqueBlockStates);
 }
 
+/// Get the number of bits used per block to index into the block states.
+pub fn bitWidth(self: *const Self) IndexBitWidth {
+    return self.getTag();
+}
+
+/// Number of bytes allocated for indices of `width`.
+pub fn allocationSize(width: IndexBitWidth) usize {
+    return switch (width) {
+        .b1 => @sizeOf(BlockStateIndices1Bit),
+        .b2 => @sizeOf(BlockStateIndices2Bit),
+        .b4 => @sizeOf(BlockStateIndices4Bit),
+        .b8 => @sizeOf(BlockStateIndices8Bit),
+        .b16 => @sizeOf(BlockStateIndices16Bit),
+    };
+}
+
 fn getTag(self: *const Self) IndexBitWidth {
     const maskedEnum = self.taggedPtr & ENUM_MASK;
     const e: IndexBitWidth = @enumFromInt(@shrExact(maskedEnum, 56));
@@ -178,9 +306,9 @@ fn getRequiredBitWidth(uniqueBlockStates: u16) IndexBitWidth {
         return .b16;
     } else if (uniqueBlockStates > 16) {
         return .b8;
-    } else if (uniqueBlockStates > 8) {
-        return .b4;
     } else if (uniqueBlockStates > 4) {
+        return .b4;
+    } else if (uniqueBlockStates > 2) {
         return .b2;
     } else {
         return .b1;
@@ -292,7 +420,7 @@ fn reallocate(self: *Self, allocator: Allocator, uniqueBlockStates: u16) Allocat
     }
 }
 
-const IndexBitWidth = enum(u8) {
+pub const IndexBitWidth = enum(u8) {
     b1,
     b2,
     b4,
@@ -306,7 +434,7 @@ const BlockStateIndices1Bit = struct {
     indices: [ARRAY_SIZE]usize = .{0} ** ARRAY_SIZE,
 
     fn indexAt(self: BlockStateIndices1Bit, position: BlockIndex) u16 {
-        const arrayIndex = @mod(position.index, ARRAY_SIZE);
+        const arrayIndex = position.index / 64;
         const positionIndexCast: usize = @intCast(position.index);
         const bitIndex: u6 = @intCast(positionIndexCast & 63);
         const bitMask = @shlExact(@as(usize, 1), bitIndex);
@@ -316,13 +444,14 @@ const BlockStateIndices1Bit = struct {
     }
 
     fn setIndexAt(self: *BlockStateIndices1Bit, index: u1, position: BlockIndex) void {
-        const arrayIndex = @mod(position.index, ARRAY_SIZE);
+        const arrayIndex = position.index / 64;
         const positionIndexCast: usize = @intCast(position.index);
         const bitIndex: u6 = @intCast(positionIndexCast & 63);
         const indexAsUsize: usize = @intCast(index);
         const bitMask = @shlExact(indexAsUsize, bitIndex);
+        const clearMask = ~@shlExact(@as(usize, 1), bitIndex);
 
-        self.indices[arrayIndex] = self.indices[arrayIndex] | bitMask;
+        self.indices[arrayIndex] = (self.indices[arrayIndex] & clearMask) | bitMask;
     }
 };
 
@@ -334,7 +463,7 @@ const BlockStateIndices2Bit = struct {
     indices: [ARRAY_SIZE]usize = .{0} ** ARRAY_SIZE,
 
     fn indexAt(self: BlockStateIndices2Bit, position: BlockIndex) u16 {
-        const arrayIndex = @mod(position.index, ARRAY_SIZE);
+        const arrayIndex = position.index / (BIT_INDEX_MASK + 1);
         const positionIndexCast: usize = @intCast(position.index);
         const firstBitIndex: u6 = @intCast(positionIndexCast & BIT_INDEX_MASK);
         const bitMask = @shlExact(@as(usize, 0b11), BIT_INDEX_MULTIPLIER * firstBitIndex);
@@ -344,13 +473,14 @@ const BlockStateIndices2Bit = struct {
     }
 
     fn setIndexAt(self: *BlockStateIndices2Bit, index: u2, position: BlockIndex) void {
-        const arrayIndex = @mod(position.index, ARRAY_SIZE);
+        const arrayIndex = position.index / (BIT_INDEX_MASK + 1);
         const positionIndexCast: usize = @intCast(position.index);
         const firstBitIndex: u6 = @intCast(positionIndexCast & BIT_INDEX_MASK);
         const indexAsUsize: usize = @intCast(index);
         const bitMask = @shlExact(indexAsUsize, BIT_INDEX_MULTIPLIER * firstBitIndex);
+        const clearMask = ~@shlExact(@as(usize, 0b11), BIT_INDEX_MULTIPLIER * firstBitIndex);
 
-        self.indices[arrayIndex] = self.indices[arrayIndex] | bitMask;
+        self.indices[arrayIndex] = (self.indices[arrayIndex] & clearMask) | bitMask;
     }
 };
 
@@ -362,7 +492,7 @@ const BlockStateIndices4Bit = struct {
     indices: [ARRAY_SIZE]usize = .{0} ** ARRAY_SIZE,
 
     fn indexAt(self: BlockStateIndices4Bit, position: BlockIndex) u16 {
-        const arrayIndex = @mod(position.index, ARRAY_SIZE);
+        const arrayIndex = position.index / (BIT_INDEX_MASK + 1);
         const positionIndexCast: usize = @intCast(position.index);
         const firstBitIndex: u6 = @intCast(positionIndexCast & BIT_INDEX_MASK);
         const bitMask = @shlExact(@as(usize, 0b1111), BIT_INDEX_MULTIPLIER * firstBitIndex);
@@ -372,13 +502,14 @@ const BlockStateIndices4Bit = struct {
     }
 
     fn setIndexAt(self: *BlockStateIndices4Bit, index: u4, position: BlockIndex) void {
-        const arrayIndex = @mod(position.index, ARRAY_SIZE);
+        const arrayIndex = position.index / (BIT_INDEX_MASK + 1);
         const positionIndexCast: usize = @intCast(position.index);
         const firstBitIndex: u6 = @intCast(positionIndexCast & BIT_INDEX_MASK);
         const indexAsUsize: usize = @intCast(index);
         const bitMask = @shlExact(indexAsUsize, BIT_INDEX_MULTIPLIER * firstBitIndex);
+        const clearMask = ~@shlExact(@as(usize, 0b1111), BIT_INDEX_MULTIPLIER * firstBitIndex);
 
-        self.indices[arrayIndex] = self.indices[arrayIndex] | bitMask;
+        self.indices[arrayIndex] = (self.indices[arrayIndex] & clearMask) | bitMask;
     }
 };
 
@@ -512,6 +643,92 @@ test "Block index at" {
     try expect(indices.blockStateIndexAt(BlockIndex.init(12, 11, 13)) == 1);
 }
 
+test "Is all zero" {
+    const allocator = std.testing.allocator;
+
+    var indices = try Self.init(allocator);
+    defer indices.deinit(allocator);
+
+    try expect(indices.isAllZero());
+
+    try indices.reserve(allocator, 17);
+    try expect(indices.isAllZero());
+
+    indices.setBlockStateIndexAt(12, BlockIndex.init(31, 31, 31));
+    try expect(!indices.isAllZero());
+}
+
+test "Set index overwrites" {
+    const allocator = std.testing.allocator;
+
+    var indices = try Self.init(allocator);
+    defer indices.deinit(allocator);
+
+    const position = BlockIndex.init(5, 6, 7);
+    indices.setBlockStateIndexAt(1, position);
+    indices.setBlockStateIndexAt(0, position);
+    try expect(indices.blockStateIndexAt(position) == 0);
+
+    try indices.reserve(allocator, 16);
+    indices.setBlockStateIndexAt(15, position);
+    indices.setBlockStateIndexAt(6, position);
+    try expect(indices.blockStateIndexAt(position) == 6);
+}
+
+test "Positions do not alias" {
+    const allocator = std.testing.allocator;
+
+    var indices = try Self.init(allocator);
+    defer indices.deinit(allocator);
+
+    // Are a whole number of the 1 bit array length apart
+    indices.setBlockStateIndexAt(1, BlockIndex{ .index = 0 });
+    try expect(indices.blockStateIndexAt(BlockIndex{ .index = 512 }) == 0);
+    try expect(indices.blockStateIndexAt(BlockIndex{ .index = 64 }) == 0);
+}
+
+test "Uniform index and fill" {
+    const allocator = std.testing.allocator;
+
+    var indices = try Self.init(allocator);
+    defer indices.deinit(allocator);
+
+    try expect(indices.uniformIndex().? == 0);
+
+    indices.fill(1);
+    try expect(indices.uniformIndex().? == 1);
+    try expect(indices.blockStateIndexAt(BlockIndex.init(31, 31, 31)) == 1);
+
+    indices.setBlockStateIndexAt(0, BlockIndex.init(2, 3, 4));
+    try expect(indices.uniformIndex() == null);
+
+    try indices.reserve(allocator, 12);
+    indices.fill(11);
+    try expect(indices.uniformIndex().? == 11);
+}
+
+test "Clone" {
+    const allocator = std.testing.allocator;
+    var indices = try Self.init(allocator);
+    defer indices.deinit(allocator);
+
+    try indices.reserve(allocator, 3);
+    indices.setBlockStateIndexAt(2, BlockIndex.init(4, 5, 6));
+
+    var copy = try indices.clone(allocator);
+    defer copy.deinit(allocator);
+
+    try expect(copy.getTag() == indices.getTag());
+    try expect(copy.blockStateIndexAt(BlockIndex.init(4, 5, 6)) == 2);
+    copy.setBlockStateIndexAt(1, BlockIndex.init(4, 5, 6));
+    try expect(indices.blockStateIndexAt(BlockIndex.init(4, 5, 6)) == 2);
+}
+
+test "Allocation size" {
+    try expect(allocationSize(.b1) == CHUNK_SIZE / 8);
+    try expect(allocationSize(.b16) == CHUNK_SIZE * 2);
+}
+
 test "Reserve" {
     const allocator = std.testing.allocator;
 
@@ -61,7 +61,7 @@ pub fn tryRead(self: *const Self) !*const Inner {
     if (innerPtr._lock.tryLockShared()) {
         return innerPtr;
     }
-    return error{Locked};
+    return error.Locked;
 }
 
 /// Get read-write access to the chunk's inner data.
@@ -81,7 +81,7 @@ pub fn tryWrite(self: *Self) !*Inner {
     if (innerPtr._lock.tryLock()) {
         return innerPtr;
     }
-    return error{Locked};
+    return error.Locked;
 }
 
 /// Revoke shared access to this chunk's inner data.
@@ -121,7 +121,7 @@ fn getInnerPtr(self: *const Self) *const Inner {
 }
 
 /// Get the chunk's inner data mutably.
-fn getInnerPtrMut(self: *Self) *Inner {
+fn getInnerPtrMut(self: *const Self) *Inner {
     return @ptrCast(@alignCast(self.inner));
 }
 // Tests
@@ -6,7 +6,7 @@
 //!
 //! Size
 //!
-//! 104 bytes for the chunk itself, and then a varying size depending
+//! 152 bytes for the chunk itself, and then a varying size depending
 //! on the amount of unique `BlockState`'s in the chunk.
 //!
 //! - Up to 2 => 4096 bytes
@@ -18,7 +18,9 @@
 const std = @import("std");
 const world_transform = @import("../world_transform.zig");
 const BlockIndex = world_transform.BlockIndex;
+const BlockFacing = world_transform.BlockFacing;
 const RwLock = std.Thread.RwLock;
+const AtomicOrder = std.builtin.AtomicOrder;
 const ArrayList = std.ArrayList;
 const ArrayListUnmanaged = std.ArrayListUnmanaged;
 const TreeLayerIndices = @import("../fat_tree/tree_layer_indices.zig").TreeLayerIndices;
@@ -28,17 +30,20 @@ const assert = std.debug.assert;
 const expect = std.testing.expect;
 const BlockLight = @import("../../types/light.zig").BlockLight;
 const BlockStateIndices = @import("BlockStateIndices.zig");
+const TreeNodeColor = @import("../../types/color.zig").TreeNodeColor;
 
 const Chunk = @import("Chunk.zig");
 const CHUNK_LENGTH = world_transform.CHUNK_LENGTH;
 const CHUNK_SIZE = world_transform.CHUNK_SIZE;
 
 // TODO use actual future implementation of BlockState type. BlockState will also track the block's break state.
-const BlockState = usize;
+pub const BlockState = usize;
 
 const Self = @This();
 
 const DEFAULT_BLOCK_STATE_CAPACITY = 4;
+/// The state of an air block. Always the first of every chunk's block states.
+pub const AIR_BLOCK_STATE: BlockState = 0;
 
 /// Do not access directly
 _lock: RwLock = .{}, // TODO maybe srwlock?
@@ -50,6 +55,10 @@ tree: *FatTree,
 /// Position of this chunk within the FatTree.
 /// Should not be ever modified.
 treePos: TreeLayerIndices,
+/// DO NOT MODIFY, but can access directly.
+/// The generation of the tree when this chunk was inserted into it, allowing `FatTree.Inner.diff()`
+/// to tell added chunks from modified ones. Copies made by `clone()` keep it.
+insertedGeneration: u64 = 0,
 /// Do not access directly. Will always be a valid pointer of a length of 1 or more.
 /// The first entry is the state of an air block, meaning that initializing _blockStateIds to all 0's
 /// means the chunk is full of air.
@@ -59,8 +68,18 @@ _blockStatesData: [*]BlockState,
 _blockStatesLen: u16 = 1,
 /// Do not access directly. Will always be non-zero
 _blockStatesCapacity: u16 = DEFAULT_BLOCK_STATE_CAPACITY,
+/// Do not access directly. Number of blocks that are not air, kept up to date as blocks are set,
+/// so `lodSummary()` doesn't have to look at every block. Fits in what would otherwise be padding.
+_solidCount: u16 = 0,
+/// Do not access directly. References from `FatTree` nodes, including those of snapshots.
+/// A chunk with more than one is shared, and must be copied before being written to.
+/// Fits in what would otherwise be padding.
+_refCount: std.atomic.Value(u32) = std.atomic.Value(u32).init(1),
 
-// NOTE there is space for 4 bytes due to padding
+/// Do not access directly. The loaded chunks sharing each face with this one, indexed by `faceIndex()`.
+/// Maintained by the `FatTree` as chunks are inserted and removed, through `TreeModify` access.
+/// Always accessed atomically, as `FatTree.ReadGuard` readers hold no lock.
+_neighbors: [6]?*Self = .{null} ** 6,
 
 /// Holds which index each block in the chunk is using as a reference to it's block state.
 /// This allows multiple blocks to reference the same block state.
@@ -75,6 +94,7 @@ pub fn init(tree: *FatTree, treePos: TreeLayerIndices) Allocator.Error!*Self {
     const newSelf = try tree.allocator.create(Self);
 
     const blockStatesSlice = try tree.allocator.alloc(BlockState, DEFAULT_BLOCK_STATE_CAPACITY);
+    blockStatesSlice[0] = AIR_BLOCK_STATE;
     const indicesPtr = try BlockStateIndices.init(tree.allocator);
 
     newSelf.* = Self{
@@ -84,6 +104,23 @@ pub fn init(tree: *FatTree, treePos: TreeLayerIndices) Allocator.Error!*Self {
         ._blockStateIndices = indicesPtr,
     };
 
+    tree.chunkCounters().chunkAllocated(indicesPtr.bitWidth(), 1, DEFAULT_BLOCK_STATE_CAPACITY);
+    return newSelf;
+}
+
+/// Creates a chunk with every block set to `state`, such as when a uniform `FatTree` node
+/// is promoted to a real chunk.
+pub fn initFilled(tree: *FatTree, treePos: TreeLayerIndices, state: BlockState) Allocator.Error!*Self {
+    const newSelf = try Self.init(tree, treePos);
+    if (state == AIR_BLOCK_STATE) {
+        return newSelf;
+    }
+
+    newSelf._blockStatesData[1] = state;
+    newSelf._blockStatesLen = 2;
+    newSelf._blockStateIndices.fill(1);
+    newSelf._solidCount = CHUNK_SIZE;
+    tree.chunkCounters().paletteEntryAdded(DEFAULT_BLOCK_STATE_CAPACITY, DEFAULT_BLOCK_STATE_CAPACITY);
     return newSelf;
 }
 
@@ -93,19 +130,188 @@ pub fn deinit(self: *Self) void {
     }
 
     const allocator = self.tree.allocator;
+    self.tree.chunkCounters().chunkFreed(self._blockStateIndices.bitWidth(), self._blockStatesLen, self._blockStatesCapacity);
 
     var blockStatesSlice: []BlockState = undefined;
     blockStatesSlice.ptr = self._blockStatesData;
     blockStatesSlice.len = self._blockStatesCapacity;
     allocator.free(blockStatesSlice);
     self._blockStateIndices.deinit(allocator);
+    if (self._breakingProgress) |progress| {
+        progress.deinit(allocator);
+        allocator.destroy(progress);
+    }
     self._lock.unlock();
 
     allocator.destroy(self);
 }
 
+/// Adds a reference to this chunk, so that another `FatTree` node can share it.
+pub fn acquire(self: *Self) void {
+    _ = self._refCount.fetchAdd(1, AtomicOrder.Monotonic);
+}
+
+/// Removes a reference to this chunk, calling `deinit()` once there are none left.
+pub fn release(self: *Self) void {
+    if (self._refCount.fetchSub(1, AtomicOrder.AcqRel) == 1) {
+        self.deinit();
+    }
+}
+
+/// Checks if more than one `FatTree` node references this chunk.
+pub fn isShared(self: *const Self) bool {
+    return self._refCount.load(AtomicOrder.Acquire) > 1;
+}
+
+/// Creates an unshared copy of this chunk's blocks, at the same position within the same tree.
+/// The copy has no neighbor links, as it is not yet in the tree.
+pub fn clone(self: *const Self) Allocator.Error!*Self {
+    const allocator = self.tree.allocator;
+
+    const blockStates = try allocator.dupe(BlockState, self._blockStatesData[0..self._blockStatesCapacity]);
+    errdefer allocator.free(blockStates);
+    var indices = try self._blockStateIndices.clone(allocator);
+    errdefer indices.deinit(allocator);
+
+    var breakingProgress: ?*ArrayListUnmanaged(BlockBreakingProgress) = null;
+    if (self._breakingProgress) |progress| {
+        const list = try allocator.create(ArrayListUnmanaged(BlockBreakingProgress));
+        errdefer allocator.destroy(list);
+        list.* = try progress.clone(allocator);
+        breakingProgress = list;
+    }
+    errdefer if (breakingProgress) |list| {
+        list.deinit(allocator);
+        allocator.destroy(list);
+    };
+
+    const newSelf = try allocator.create(Self);
+    newSelf.* = Self{
+        .tree = self.tree,
+        .treePos = self.treePos,
+        .insertedGeneration = self.insertedGeneration,
+        ._blockStatesData = blockStates.ptr,
+        ._blockStatesLen = self._blockStatesLen,
+        ._blockStatesCapacity = self._blockStatesCapacity,
+        ._solidCount = self._solidCount,
+        ._blockStateIndices = indices,
+        ._breakingProgress = breakingProgress,
+    };
+    self.tree.chunkCounters().chunkAllocated(indices.bitWidth(), self._blockStatesLen, self._blockStatesCapacity);
+    return newSelf;
+}
+
+/// Get the loaded chunk sharing the face in the direction of `facing` with this chunk, if there is one.
+/// This is just a pointer load, rather than a trip through the `FatTree`.
+/// Asserts that `facing` has exactly one direction.
+pub fn neighbor(self: *const Self, facing: BlockFacing) ?Chunk {
+    const found = @atomicLoad(?*Self, &self._neighbors[faceIndex(facing)], AtomicOrder.Acquire) orelse return null;
+    return Chunk{ .inner = @ptrCast(found) };
+}
+
+/// Links `self` and `other` as neighbors, with `other` being in the direction of `facing`.
+/// Only call through the owning `FatTree`'s `TreeModify` access.
+pub fn linkNeighbor(self: *Self, other: *Self, facing: BlockFacing) void {
+    const index = faceIndex(facing);
+    @atomicStore(?*Self, &self._neighbors[index], other, AtomicOrder.Release);
+    @atomicStore(?*Self, &other._neighbors[oppositeFaceIndex(index)], self, AtomicOrder.Release);
+}
+
+/// Removes every neighbor's link to `self`, and `self`'s links to them.
+/// Only call through the owning `FatTree`'s `TreeModify` access.
+pub fn unlinkNeighbors(self: *Self) void {
+    for (0..6) |i| {
+        const other = self._neighbors[i] orelse continue;
+        @atomicStore(?*Self, &other._neighbors[oppositeFaceIndex(i)], null, AtomicOrder.Release);
+        @atomicStore(?*Self, &self._neighbors[i], null, AtomicOrder.Release);
+    }
+}
+
+/// Index of a single direction `facing` within the neighbor links.
+/// Follows the field order of `BlockFacing`, so opposite faces differ only in the lowest bit.
+pub fn faceIndex(facing: BlockFacing) usize {
+    const bits: u6 = @bitCast(facing);
+    assert(@popCount(bits) == 1);
+    return @ctz(bits);
+}
+
+/// The single direction `BlockFacing` for the neighbor link at `index`.
+pub fn faceFromIndex(index: usize) BlockFacing {
+    assert(index < 6);
+    return @bitCast(@shlExact(@as(u6, 1), @intCast(index)));
+}
+
+fn oppositeFaceIndex(index: usize) usize {
+    return index ^ 1;
+}
+
+/// The level of detail summary of this chunk for the `FatTree`, being how much of the chunk is not air.
+/// Doesn't look at any block, so is cheap enough to refresh after every write.
+pub fn lodSummary(self: *const Self) FatTree.Lod {
+    const solidCount: u32 = self._solidCount;
+    return FatTree.Lod{ .occupancy = @intCast((solidCount * 255 + CHUNK_SIZE - 1) / CHUNK_SIZE) };
+}
+
+/// Get the block state of the block at `position`.
+pub fn blockStateAt(self: *const Self, position: BlockIndex) BlockState {
+    return self._blockStatesData[self.blockStateIndexAt(position)];
+}
+
+/// Sets the block at `position` to `state`, adding `state` to this chunk's
+/// block states if no block is using it yet.
+pub fn setBlockStateAt(self: *Self, state: BlockState, position: BlockIndex) Allocator.Error!void {
+    const index = try self.findOrAddBlockState(state);
+    self.setBlockStateIndexAt(index, position);
+}
+
+/// Get the block state of every block in this chunk, or null if the chunk holds more than one.
+/// A chunk holding a single block state can be replaced with a uniform `FatTree` node.
+pub fn uniformBlockState(self: *const Self) ?BlockState {
+    if (self._blockStatesLen == 1) { // Palette holds only air
+        return AIR_BLOCK_STATE;
+    }
+    const index = self._blockStateIndices.uniformIndex() orelse return null;
+    return self._blockStatesData[index];
+}
+
+/// Checks if every block in this chunk is air, meaning the chunk
+/// can be cleaned up and replaced with an empty `FatTree` node.
+pub fn isAllAir(self: *const Self) bool {
+    if (self._blockStatesLen == 1) { // Palette holds only air
+        return true;
+    }
+    return self._blockStateIndices.isAllZero();
+}
+
 fn blockStateIndexAt(self: *const Self, position: BlockIndex) u16 {
-    self._blockStateIndices.blockStateIndexAt(position);
+    return self._blockStateIndices.blockStateIndexAt(position);
+}
+
+fn findOrAddBlockState(self: *Self, state: BlockState) Allocator.Error!u16 {
+    const states = self._blockStatesData[0..self._blockStatesLen];
+    if (std.mem.indexOfScalar(BlockState, states, state)) |found| {
+        return @intCast(found);
+    }
+
+    const allocator = self.tree.allocator;
+    const counters = self.tree.chunkCounters();
+
+    const oldBitWidth = self._blockStateIndices.bitWidth();
+    try self._blockStateIndices.reserve(allocator, self._blockStatesLen + 1);
+    counters.chunkBitWidthChanged(oldBitWidth, self._blockStateIndices.bitWidth());
+
+    const oldCapacity = self._blockStatesCapacity;
+    if (self._blockStatesLen == self._blockStatesCapacity) {
+        const newCapacity: u16 = @intCast(@min(@as(u32, self._blockStatesCapacity) * 2, CHUNK_SIZE + 1));
+        const newStates = try allocator.realloc(self._blockStatesData[0..self._blockStatesCapacity], newCapacity);
+        self._blockStatesData = newStates.ptr;
+        self._blockStatesCapacity = newCapacity;
+    }
+
+    self._blockStatesData[self._blockStatesLen] = state;
+    self._blockStatesLen += 1;
+    counters.paletteEntryAdded(oldCapacity, self._blockStatesCapacity);
+    return self._blockStatesLen - 1;
 }
 
 fn setBlockStateIndexAt(self: *Self, index: u16, position: BlockIndex) void {
@@ -113,7 +319,14 @@ fn setBlockStateIndexAt(self: *Self, index: u16, position: BlockIndex) void {
         @panic("Index of chunk block states out of range.");
     }
 
+    const old = self._blockStateIndices.blockStateIndexAt(position);
     self._blockStateIndices.setBlockStateIndexAt(index, position);
+    // Index 0 is always air.
+    if (old == 0 and index != 0) {
+        self._solidCount += 1;
+    } else if (old != 0 and index == 0) {
+        self._solidCount -= 1;
+    }
 }
 
 const BlockBreakingProgress = struct {
@@ -131,7 +344,7 @@ test "Size and Align" {
 
     // const sizeOfBlockStateIds = @sizeOf(u16) * CHUNK_SIZE;
     // const sizeOfLights = @sizeOf(BlockLight) * CHUNK_SIZE;
-    try expect(@sizeOf(Self) == 104);
+    try expect(@sizeOf(Self) == 152);
 }
 
 test "Init deinit" {
@@ -141,3 +354,93 @@ test "Init deinit" {
     const inner = try Self.init(tree, TreeLayerIndices{});
     inner.deinit();
 }
+
+test "Face index" {
+    for (0..6) |i| {
+        try expect(faceIndex(faceFromIndex(i)) == i);
+    }
+    try expect(oppositeFaceIndex(faceIndex(BlockFacing{ .down = true, .up = false, .north = false, .south = false, .east = false, .west = false })) ==
+        faceIndex(BlockFacing{ .down = false, .up = true, .north = false, .south = false, .east = false, .west = false }));
+    try expect(oppositeFaceIndex(faceIndex(BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = true, .west = false })) ==
+        faceIndex(BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = false, .west = true }));
+}
+
+test "Is all air" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = try Self.init(tree, TreeLayerIndices{});
+    defer inner.deinit();
+
+    try expect(inner.isAllAir());
+
+    inner._blockStatesData[1] = 1;
+    inner._blockStatesLen = 2;
+    try expect(inner.isAllAir()); // nothing references the new state yet
+
+    inner.setBlockStateIndexAt(1, BlockIndex.init(4, 5, 6));
+    try expect(!inner.isAllAir());
+}
+
+test "Set block state" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = try Self.init(tree, TreeLayerIndices{});
+    defer inner.deinit();
+
+    // Enough unique states to grow both the palette and the indices bit width
+    for (1..20) |state| {
+        try inner.setBlockStateAt(state, BlockIndex{ .index = @intCast(state) });
+    }
+    for (1..20) |state| {
+        try expect(inner.blockStateAt(BlockIndex{ .index = @intCast(state) }) == state);
+    }
+    try expect(inner.blockStateAt(BlockIndex{ .index = 0 }) == AIR_BLOCK_STATE);
+    try expect(inner._blockStatesLen == 20);
+
+    try inner.setBlockStateAt(AIR_BLOCK_STATE, BlockIndex{ .index = 5 });
+    try expect(inner.blockStateAt(BlockIndex{ .index = 5 }) == AIR_BLOCK_STATE);
+    try expect(inner._blockStatesLen == 20); // reused
+}
+
+test "Uniform block state" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const empty = try Self.init(tree, TreeLayerIndices{});
+    defer empty.deinit();
+    try expect(empty.uniformBlockState().? == AIR_BLOCK_STATE);
+
+    const filled = try Self.initFilled(tree, TreeLayerIndices{}, 3);
+    defer filled.deinit();
+    try expect(filled.uniformBlockState().? == 3);
+    try expect(filled.blockStateAt(BlockIndex.init(31, 0, 17)) == 3);
+
+    try filled.setBlockStateAt(4, BlockIndex.init(1, 2, 3));
+    try expect(filled.uniformBlockState() == null);
+}
+
+test "Lod summary" {
+    const tree = try FatTree.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = try Self.init(tree, TreeLayerIndices{});
+    defer inner.deinit();
+
+    try expect(inner.lodSummary().occupancy == 0);
+
+    inner._blockStatesData[1] = 1;
+    inner._blockStatesLen = 2;
+    inner.setBlockStateIndexAt(1, BlockIndex.init(0, 0, 0));
+    inner.setBlockStateIndexAt(1, BlockIndex.init(0, 0, 0));
+    try expect(inner._solidCount == 1);
+    try expect(inner.lodSummary().occupancy == 1);
+
+    inner.setBlockStateIndexAt(0, BlockIndex.init(0, 0, 0));
+    try expect(inner.lodSummary().occupancy == 0);
+
+    const filled = try Self.initFilled(tree, TreeLayerIndices{}, 3);
+    defer filled.deinit();
+    try expect(filled.lodSummary().occupancy == 255);
+}
@@ -0,0 +1,636 @@
+//! Concurrent variant of `LoadedChunksHashMap`, mapping chunk positions to chunks.
+//! Chunks can be found from any number of threads at once without acquiring any lock,
+//! while other threads insert, replace, and erase chunks.
+//!
+//! # Thread safety
+//!
+//! Every function is thread safe, besides `deinit()`.
+//!
+//! Each group has it's own version, which is odd while a writer holds the group. Writers acquire a group
+//! by swapping it's version from even to odd, so writers only ever wait on other writers to the same group.
+//! Readers never write to the map, besides pinning an epoch. Like a seqlock, they read the version before and
+//! after probing a group, and probe again if it changed, so lookups from many threads scale without any
+//! cache line bouncing between them. Group memory replaced while growing is retired through epoch based reclamation,
+//! so a reader probing it at the same time never reads freed memory.
+//!
+//! # Resizing
+//!
+//! The map grows through linear hashing. Rather than rehashing every group at once, groups are split one at a time
+//! in order, with each insert splitting at most `SPLITS_PER_INSERT` groups while the load factor is exceeded.
+//! Groups are held in segments that are never moved, so a split only touches the group being split,
+//! and the empty group it's entries move to.
+
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const Mutex = std.Thread.Mutex;
+const Atomic = std.atomic.Value;
+const AtomicOrder = std.builtin.AtomicOrder;
+const Chunk = @import("../chunk/Chunk.zig");
+const tree_layer_indices = @import("tree_layer_indices.zig");
+const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
+const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
+const LoadedChunksHashMap = @import("LoadedChunksHashMap.zig");
+const Entry = LoadedChunksHashMap.Group.Entry;
+const HashGroupBitmask = LoadedChunksHashMap.HashGroupBitmask;
+const HashPairBitmask = LoadedChunksHashMap.HashPairBitmask;
+const PROBE_WIDTH = LoadedChunksHashMap.PROBE_WIDTH;
+const GROUP_ALLOC_SIZE = LoadedChunksHashMap.Group.GROUP_ALLOC_SIZE;
+const matchControlBytes = LoadedChunksHashMap.matchControlBytes;
+const calculateChunksHashGroupAllocationSize = LoadedChunksHashMap.calculateChunksHashGroupAllocationSize;
+const MapStats = @import("tree_stats.zig").MapStats;
+const epoch = @import("../../types/epoch.zig");
+const assert = std.debug.assert;
+const expect = std.testing.expect;
+
+const Self = @This();
+
+/// Number of groups before any have been split. Must be a power of 2.
+const BASE_GROUPS: usize = 16;
+/// Segment 0 holds `BASE_GROUPS` groups, and every other segment doubles the number of groups.
+const MAX_SEGMENTS = 40;
+/// Average entries per group past which groups are split, as 75% of a group's initial capacity.
+const MAX_GROUP_LOAD = GROUP_ALLOC_SIZE / 4 * 3;
+/// Upper bound on the groups split by a single insert, keeping the latency of every insert flat as the map grows.
+const SPLITS_PER_INSERT = 2;
+/// Low bits of a group's storage holding `log2(capacity / GROUP_ALLOC_SIZE)`.
+const STORAGE_TAG_MASK: usize = GROUP_ALLOC_SIZE - 1;
+
+/// Groups by segment. Published with atomic stores before any reader can index into them.
+_segments: [MAX_SEGMENTS]Atomic(?[*]Group),
+/// Linear hashing state, as the level in the upper 32 bits, and the next group to split in the lower 32 bits.
+_state: Atomic(u64),
+/// On it's own cache line, as every insert and erase modifies it, while readers only load `_state`.
+_chunkCount: Atomic(usize) align(64),
+/// Total entries every group has memory for, for `stats()`.
+_slotCount: Atomic(usize),
+/// Held while splitting a group, so only one thread splits at a time.
+_splitMutex: Mutex,
+/// Defers freeing replaced group memory while readers may still be probing it.
+epoch: epoch.EpochManager,
+allocator: *Allocator,
+
+pub fn init(allocator: *Allocator) Allocator.Error!Self {
+    const first = try allocator.alloc(Group, BASE_GROUPS);
+    @memset(first, Group{});
+
+    var self = Self{
+        ._segments = .{Atomic(?[*]Group).init(null)} ** MAX_SEGMENTS,
+        ._state = Atomic(u64).init(0),
+        ._chunkCount = Atomic(usize).init(0),
+        ._slotCount = Atomic(usize).init(0),
+        ._splitMutex = .{},
+        .epoch = epoch.EpochManager.init(allocator),
+        .allocator = allocator,
+    };
+    self._segments[0].store(first.ptr, AtomicOrder.Release);
+    return self;
+}
+
+/// Does not call deinit on the chunks, since this map only stores references to them.
+/// No other thread may be accessing the map.
+pub fn deinit(self: *Self) void {
+    // Retired storage is freed through this map's allocator.
+    self.epoch.deinit();
+
+    for (0..MAX_SEGMENTS) |segmentIndex| {
+        const segment = self._segments[segmentIndex].load(AtomicOrder.Acquire) orelse break;
+        const groups = segment[0..segmentLength(segmentIndex)];
+        for (groups) |group| {
+            self.freeStorage(group.storage.load(AtomicOrder.Monotonic));
+        }
+        self.allocator.free(groups);
+    }
+}
+
+/// Pins the current epoch of the map, allowing many chunks to be found without pinning for each of them.
+/// Call `unpin()` on the returned guard when done.
+pub fn pinRead(self: *Self) ReadGuard {
+    return ReadGuard{ .map = self, .guard = self.epoch.pin() };
+}
+
+/// Lock-free read access to the map. See `pinRead()`.
+pub const ReadGuard = struct {
+    map: *const Self,
+    guard: epoch.Guard,
+
+    pub fn unpin(self: ReadGuard) void {
+        self.guard.unpin();
+    }
+
+    pub fn find(self: ReadGuard, key: TreeLayerIndices) ?Chunk {
+        return self.map.findPinned(key);
+    }
+};
+
+/// Finds the chunk mapped to `key` without acquiring any lock.
+/// Pins an epoch for the duration of the lookup. Use `pinRead()` to find many chunks at once.
+pub fn find(self: *Self, key: TreeLayerIndices) ?Chunk {
+    const guard = self.epoch.pin();
+    defer guard.unpin();
+    return self.findPinned(key);
+}
+
+fn findPinned(self: *const Self, key: TreeLayerIndices) ?Chunk {
+    const hashCode = key.hash();
+    const mask = HashPairBitmask.init(hashCode);
+
+    while (true) {
+        const state = self._state.load(AtomicOrder.Acquire);
+        const group = self.groupAt(groupIndex(hashCode, state));
+
+        const before = group.version.load(AtomicOrder.Acquire);
+        if (before & 1 == 1) {
+            std.atomic.spinLoopHint();
+            continue;
+        }
+
+        // May observe a writer part way through, in which case the version will have changed.
+        var found: ?Chunk = null;
+        const storage = Storage.fromTagged(group.storage.load(AtomicOrder.Acquire));
+        if (storage.find(key, mask.value)) |i| {
+            found = storage.entries[i].value;
+        }
+
+        @fence(AtomicOrder.Acquire);
+        if (group.version.load(AtomicOrder.Monotonic) == before and self._state.load(AtomicOrder.Monotonic) == state) {
+            return found;
+        }
+    }
+}
+
+/// Trying to add a duplicate entry is strictly not allowed, because it is not allowed by the FatTree.
+/// Asserts the entry doesn't already exist. May split groups to keep the load factor down.
+pub fn insert(self: *Self, key: TreeLayerIndices, value: Chunk) Allocator.Error!void {
+    const hashCode = key.hash();
+    {
+        const guard = self.epoch.pin();
+        defer guard.unpin();
+
+        const replaced = blk: {
+            const group = self.lockGroupOf(hashCode);
+            defer group.unlock();
+            break :blk try group.insert(self, key, value, hashCode);
+        };
+        // Retired once the group is released, as retiring may wait on readers spinning on it.
+        if (replaced) |retired| {
+            guard.retireObject(RetiredStorage, retired, RetiredStorage.destroy);
+        }
+    }
+
+    const chunkCount = self._chunkCount.fetchAdd(1, AtomicOrder.Monotonic) + 1;
+    self.splitGroups(chunkCount);
+}
+
+/// Replaces the chunk mapped to `key` with `value`.
+/// Asserts that the entry exists.
+pub fn replace(self: *Self, key: TreeLayerIndices, value: Chunk) void {
+    const hashCode = key.hash();
+    const group = self.lockGroupOf(hashCode);
+    defer group.unlock();
+
+    const storage = Storage.fromTagged(group.storage.load(AtomicOrder.Monotonic));
+    const found = storage.find(key, HashPairBitmask.init(hashCode).value) orelse @panic("Cannot replace chunk entry that is not mapped");
+    storage.entries[found].value = value;
+}
+
+/// Erase a chunk reference entry from the map.
+/// Asserts that the entry exists.
+pub fn erase(self: *Self, key: TreeLayerIndices) void {
+    const hashCode = key.hash();
+    {
+        const group = self.lockGroupOf(hashCode);
+        defer group.unlock();
+
+        const storage = Storage.fromTagged(group.storage.load(AtomicOrder.Monotonic));
+        const found = storage.find(key, HashPairBitmask.init(hashCode).value) orelse @panic("Cannot erase chunk entry that is not mapped");
+        storage.hashMasks[found] = 0;
+        group.pairCount -= 1;
+    }
+    _ = self._chunkCount.fetchSub(1, AtomicOrder.Monotonic);
+}
+
+pub fn count(self: *const Self) usize {
+    return self._chunkCount.load(AtomicOrder.Monotonic);
+}
+
+/// Occupancy and memory usage of this map, from counters rather than walking every group.
+/// May be slightly out of date if other threads are modifying the map.
+pub fn stats(self: *const Self) MapStats {
+    const groupCount = groupCountOf(self._state.load(AtomicOrder.Acquire));
+    var segmentBytes: usize = 0;
+    for (0..MAX_SEGMENTS) |segmentIndex| {
+        if (self._segments[segmentIndex].load(AtomicOrder.Acquire) == null) break;
+        segmentBytes += segmentLength(segmentIndex) * @sizeOf(Group);
+    }
+
+    const slotCount = self._slotCount.load(AtomicOrder.Monotonic);
+    return MapStats{
+        .chunks = self.count(),
+        .groups = groupCount,
+        .slots = slotCount,
+        .bytes = segmentBytes + calculateChunksHashGroupAllocationSize(slotCount),
+    };
+}
+
+/// Locks the group `hashCode` currently belongs to. Retries if the group was split before it could be locked.
+fn lockGroupOf(self: *Self, hashCode: usize) *Group {
+    while (true) {
+        const state = self._state.load(AtomicOrder.Acquire);
+        const group = self.groupAt(groupIndex(hashCode, state));
+        group.lock();
+        // Splitting a group requires it's lock, so once locked, it can't stop being the group for `hashCode`.
+        if (self._state.load(AtomicOrder.Acquire) == state) {
+            return group;
+        }
+        group.unlock();
+    }
+}
+
+/// Splits up to `SPLITS_PER_INSERT` groups while there are more than `MAX_GROUP_LOAD` chunks per group on average.
+/// Skipped if another thread is already splitting.
+fn splitGroups(self: *Self, chunkCount: usize) void {
+    if (chunkCount <= groupCountOf(self._state.load(AtomicOrder.Monotonic)) * MAX_GROUP_LOAD) {
+        return;
+    }
+    if (!self._splitMutex.tryLock()) {
+        return;
+    }
+    defer self._splitMutex.unlock();
+
+    for (0..SPLITS_PER_INSERT) |_| {
+        if (chunkCount <= groupCountOf(self._state.load(AtomicOrder.Monotonic)) * MAX_GROUP_LOAD) {
+            return;
+        }
+        // Out of memory. The next insert will try again.
+        self.splitNext() catch return;
+    }
+}
+
+/// Splits the next group in order, moving every entry that belongs to it's new sibling group.
+/// `_splitMutex` must be held.
+fn splitNext(self: *Self) Allocator.Error!void {
+    const state = self._state.load(AtomicOrder.Monotonic);
+    const level = levelOf(state);
+    const split = splitOf(state);
+    const roundGroups = BASE_GROUPS << level;
+
+    if (level + 1 >= MAX_SEGMENTS) {
+        return;
+    }
+    if (split == 0 and self._segments[level + 1].load(AtomicOrder.Monotonic) == null) {
+        const segment = try self.allocator.alloc(Group, segmentLength(level + 1));
+        @memset(segment, Group{});
+        self._segments[level + 1].store(segment.ptr, AtomicOrder.Release);
+    }
+
+    const source = self.groupAt(split);
+    // Can't be reached by any other thread until `_state` is advanced.
+    const target = self.groupAt(roundGroups + split);
+
+    source.lock();
+    defer source.unlock();
+
+    const sourceStorage = Storage.fromTagged(source.storage.load(AtomicOrder.Monotonic));
+    if (sourceStorage.capacity > 0) {
+        // Every entry could move, so the target gets the same capacity up front.
+        const targetTagged = try self.allocStorage(sourceStorage.capacity);
+        const targetStorage = Storage.fromTagged(targetTagged);
+
+        var moved: usize = 0;
+        for (0..sourceStorage.capacity) |i| {
+            if (sourceStorage.hashMasks[i] == 0) {
+                continue;
+            }
+            const entry = sourceStorage.entries[i];
+            if (groupIndex(entry.key.hash(), nextState(state)) == split) {
+                continue;
+            }
+            targetStorage.hashMasks[moved] = sourceStorage.hashMasks[i];
+            targetStorage.entries[moved] = entry;
+            sourceStorage.hashMasks[i] = 0;
+            moved += 1;
+        }
+
+        if (moved == 0) {
+            self.freeStorage(targetTagged);
+        } else {
+            target.pairCount = moved;
+            target.storage.store(targetTagged, AtomicOrder.Release);
+            source.pairCount -= moved;
+        }
+    }
+
+    self._state.store(nextState(state), AtomicOrder.Release);
+}
+
+fn groupAt(self: *const Self, index: usize) *Group {
+    if (index < BASE_GROUPS) {
+        return &self._segments[0].load(AtomicOrder.Acquire).?[index];
+    }
+    const segmentIndex = std.math.log2_int(usize, index / BASE_GROUPS) + 1;
+    const offset = index - (BASE_GROUPS << @intCast(segmentIndex - 1));
+    return &self._segments[segmentIndex].load(AtomicOrder.Acquire).?[offset];
+}
+
+/// Returns the storage tagged with it's capacity, with every control byte cleared.
+fn allocStorage(self: *Self, capacity: usize) Allocator.Error!usize {
+    assert(std.math.isPowerOfTwo(capacity / GROUP_ALLOC_SIZE));
+
+    const memory = try self.allocator.alignedAlloc(u8, Group.ALIGNMENT, calculateChunksHashGroupAllocationSize(capacity));
+    @memset(memory[0..capacity], 0);
+    _ = self._slotCount.fetchAdd(capacity, AtomicOrder.Monotonic);
+    return @intFromPtr(memory.ptr) | std.math.log2_int(usize, capacity / GROUP_ALLOC_SIZE);
+}
+
+fn freeStorage(self: *Self, tagged: usize) void {
+    if (tagged == 0) {
+        return;
+    }
+    const storage = Storage.fromTagged(tagged);
+    _ = self._slotCount.fetchSub(storage.capacity, AtomicOrder.Monotonic);
+
+    var allocSlice: []align(64) u8 = undefined;
+    allocSlice.ptr = storage.hashMasks;
+    allocSlice.len = calculateChunksHashGroupAllocationSize(storage.capacity);
+    self.allocator.free(allocSlice);
+}
+
+/// Group storage replaced while growing, freed once no reader can still be probing it.
+const RetiredStorage = struct {
+    map: *Self,
+    tagged: usize,
+
+    fn destroy(self: *RetiredStorage) void {
+        const map = self.map;
+        map.freeStorage(self.tagged);
+        map.allocator.destroy(self);
+    }
+};
+
+const Group = struct {
+    const ALIGNMENT = 64;
+
+    /// Odd while a writer holds the group. Aligned so writers to one group don't stall readers of another.
+    version: Atomic(u64) align(64) = Atomic(u64).init(0),
+    /// See `Storage`. 0 until anything is inserted into the group.
+    storage: Atomic(usize) = Atomic(usize).init(0),
+    /// Only accessed while holding the group.
+    pairCount: usize = 0,
+
+    fn lock(self: *Group) void {
+        while (true) {
+            const version = self.version.load(AtomicOrder.Monotonic);
+            if (version & 1 == 0 and self.version.cmpxchgWeak(version, version + 1, AtomicOrder.Acquire, AtomicOrder.Monotonic) == null) {
+                return;
+            }
+            std.atomic.spinLoopHint();
+        }
+    }
+
+    fn unlock(self: *Group) void {
+        _ = self.version.fetchAdd(1, AtomicOrder.Release);
+    }
+
+    /// Must be holding the group. Only allocates if the group is full.
+    /// Returns the storage replaced while growing, if any, which must be retired.
+    fn insert(self: *Group, map: *Self, key: TreeLayerIndices, value: Chunk, hashCode: usize) Allocator.Error!?*RetiredStorage {
+        const mask = HashPairBitmask.init(hashCode);
+        var tagged = self.storage.load(AtomicOrder.Monotonic);
+
+        if (comptime std.debug.runtime_safety) {
+            if (Storage.fromTagged(tagged).find(key, mask.value) != null) {
+                @panic("Cannot add duplicate chunk entries");
+            }
+        }
+
+        var retired: ?*RetiredStorage = null;
+        if (tagged == 0) {
+            tagged = try map.allocStorage(GROUP_ALLOC_SIZE);
+            self.storage.store(tagged, AtomicOrder.Release);
+        } else if (self.pairCount == Storage.fromTagged(tagged).capacity) {
+            retired = try self.grow(map, tagged);
+            tagged = self.storage.load(AtomicOrder.Monotonic);
+        }
+
+        const storage = Storage.fromTagged(tagged);
+        var offset: usize = 0;
+        while (offset < storage.capacity) : (offset += PROBE_WIDTH) {
+            const empty = matchControlBytes(storage.hashMasks, offset, 0);
+            if (empty == 0) {
+                continue;
+            }
+
+            const i = offset + @ctz(empty);
+            storage.entries[i] = Entry{ .key = key, .value = value };
+            storage.hashMasks[i] = mask.value;
+            self.pairCount += 1;
+            return retired;
+        }
+
+        @panic("Unreachable. Insert a mapped FatTree chunk failed.");
+    }
+
+    /// Replaces the storage with one of double the capacity. Returns the old storage to be retired.
+    fn grow(self: *Group, map: *Self, tagged: usize) Allocator.Error!*RetiredStorage {
+        const old = Storage.fromTagged(tagged);
+
+        const retired = try map.allocator.create(RetiredStorage);
+        errdefer map.allocator.destroy(retired);
+        const newTagged = try map.allocStorage(old.capacity * 2);
+        const new = Storage.fromTagged(newTagged);
+
+        @memcpy(new.hashMasks[0..old.capacity], old.hashMasks[0..old.capacity]);
+        @memcpy(new.entries[0..old.capacity], old.entries[0..old.capacity]);
+        self.storage.store(newTagged, AtomicOrder.Release);
+
+        retired.* = RetiredStorage{ .map = map, .tagged = tagged };
+        return retired;
+    }
+};
+
+/// The control bytes of a group, followed by it's entries, in one allocation.
+/// Referenced by a single word, tagged with `log2(capacity / GROUP_ALLOC_SIZE)` in the low bits,
+/// so readers always see a capacity matching the memory they probe.
+const Storage = struct {
+    hashMasks: [*]align(64) u8,
+    entries: [*]Entry,
+    capacity: usize,
+
+    fn fromTagged(tagged: usize) Storage {
+        if (tagged == 0) {
+            return Storage{ .hashMasks = undefined, .entries = undefined, .capacity = 0 };
+        }
+        const capacity = @as(usize, GROUP_ALLOC_SIZE) << @intCast(tagged & STORAGE_TAG_MASK);
+        const hashMasks: [*]align(64) u8 = @ptrFromInt(tagged & ~STORAGE_TAG_MASK);
+        return Storage{
+            .hashMasks = hashMasks,
+            .entries = @ptrCast(@alignCast(hashMasks + capacity)),
+            .capacity = capacity,
+        };
+    }
+
+    fn find(self: Storage, key: TreeLayerIndices, controlByte: u8) ?usize {
+        var offset: usize = 0;
+        while (offset < self.capacity) : (offset += PROBE_WIDTH) {
+            var matches = matchControlBytes(self.hashMasks, offset, controlByte);
+            while (matches != 0) : (matches &= matches - 1) {
+                const i = offset + @ctz(matches);
+                if (self.entries[i].key.equal(key)) {
+                    return i;
+                }
+            }
+        }
+        return null;
+    }
+};
+
+fn levelOf(state: u64) u6 {
+    return @intCast(state >> 32);
+}
+
+fn splitOf(state: u64) usize {
+    return @as(u32, @truncate(state));
+}
+
+/// Number of groups in use.
+fn groupCountOf(state: u64) usize {
+    return (BASE_GROUPS << levelOf(state)) + splitOf(state);
+}
+
+/// The state once the next group is split, starting the next level once every group of this one has been.
+fn nextState(state: u64) u64 {
+    const split = splitOf(state) + 1;
+    if (split == BASE_GROUPS << levelOf(state)) {
+        return (@as(u64, levelOf(state)) + 1) << 32;
+    }
+    return state + 1;
+}
+
+fn groupIndex(hashCode: usize, state: u64) usize {
+    const bits = HashGroupBitmask.init(hashCode).value;
+    const roundGroups = BASE_GROUPS << levelOf(state);
+    const index = bits & (roundGroups - 1);
+    if (index < splitOf(state)) {
+        return bits & (roundGroups * 2 - 1);
+    }
+    return index;
+}
+
+fn segmentLength(segmentIndex: usize) usize {
+    if (segmentIndex == 0) {
+        return BASE_GROUPS;
+    }
+    return BASE_GROUPS << @intCast(segmentIndex - 1);
+}
+
+// Tests
+
+fn testKey(i: usize) TreeLayerIndices {
+    var key = TreeLayerIndices{};
+    key.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i % 64) });
+    key.setIndexAtLayer(TREE_LAYERS - 2, .{ .index = @intCast(i / 64 % 64) });
+    key.setIndexAtLayer(TREE_LAYERS - 3, .{ .index = @intCast(i / 4096 % 64) });
+    return key;
+}
+
+/// The map only holds references to chunks, so they never need to be allocated.
+fn testChunk(i: usize) Chunk {
+    return Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) };
+}
+
+test "Group size and align" {
+    try expect(@sizeOf(Group) == 64);
+    try expect(@alignOf(Group) == 64);
+}
+
+test "Insert find replace erase" {
+    var allocator = std.testing.allocator;
+    var map = try Self.init(&allocator);
+    defer map.deinit();
+
+    try map.insert(testKey(1), testChunk(1));
+    try map.insert(testKey(2), testChunk(2));
+    try expect(map.find(testKey(1)).?.inner == testChunk(1).inner);
+    try expect(map.find(testKey(3)) == null);
+
+    map.replace(testKey(1), testChunk(3));
+    try expect(map.find(testKey(1)).?.inner == testChunk(3).inner);
+
+    map.erase(testKey(1));
+    try expect(map.find(testKey(1)) == null);
+    try expect(map.find(testKey(2)).?.inner == testChunk(2).inner);
+    try expect(map.count() == 1);
+}
+
+test "Split groups keep every chunk" {
+    var allocator = std.testing.allocator;
+    var map = try Self.init(&allocator);
+    defer map.deinit();
+
+    const chunkCount = BASE_GROUPS * MAX_GROUP_LOAD * 5;
+    for (0..chunkCount) |i| {
+        try map.insert(testKey(i), testChunk(i));
+    }
+    try expect(levelOf(map._state.load(AtomicOrder.Monotonic)) >= 2);
+
+    const reader = map.pinRead();
+    defer reader.unpin();
+    for (0..chunkCount) |i| {
+        try expect(reader.find(testKey(i)).?.inner == testChunk(i).inner);
+    }
+
+    const mapStats = map.stats();
+    try expect(mapStats.chunks == chunkCount);
+    try expect(mapStats.averageGroupOccupancy() <= MAX_GROUP_LOAD);
+}
+
+const TEST_PRESENT_CHUNKS = 2000;
+const TEST_WRITTEN_CHUNKS = 4000;
+
+fn testWriteChunks(map: *Self, first: usize) void {
+    for (first..first + TEST_WRITTEN_CHUNKS) |i| {
+        map.insert(testKey(i), testChunk(i)) catch @panic("Out of memory");
+    }
+    for (first..first + TEST_WRITTEN_CHUNKS) |i| {
+        map.erase(testKey(i));
+    }
+}
+
+fn testReadChunks(map: *Self, missing: *Atomic(usize)) void {
+    for (0..4) |_| {
+        const reader = map.pinRead();
+        defer reader.unpin();
+        for (0..TEST_PRESENT_CHUNKS) |i| {
+            const found = reader.find(testKey(i)) orelse {
+                _ = missing.fetchAdd(1, AtomicOrder.Monotonic);
+                continue;
+            };
+            if (found.inner != testChunk(i).inner) {
+                _ = missing.fetchAdd(1, AtomicOrder.Monotonic);
+            }
+        }
+    }
+}
+
+test "Readers see every chunk while writers grow the map" {
+    var allocator = std.testing.allocator;
+    var map = try Self.init(&allocator);
+    defer map.deinit();
+
+    for (0..TEST_PRESENT_CHUNKS) |i| {
+        try map.insert(testKey(i), testChunk(i));
+    }
+
+    var missing = Atomic(usize).init(0);
+    var threads: [4]std.Thread = undefined;
+    threads[0] = try std.Thread.spawn(.{}, testWriteChunks, .{ &map, TEST_PRESENT_CHUNKS });
+    threads[1] = try std.Thread.spawn(.{}, testWriteChunks, .{ &map, TEST_PRESENT_CHUNKS + TEST_WRITTEN_CHUNKS });
+    threads[2] = try std.Thread.spawn(.{}, testReadChunks, .{ &map, &missing });
+    threads[3] = try std.Thread.spawn(.{}, testReadChunks, .{ &map, &missing });
+    for (threads) |thread| {
+        thread.join();
+    }
+
+    try expect(missing.load(AtomicOrder.Monotonic) == 0);
+    try expect(map.count() == TEST_PRESENT_CHUNKS);
+}
@@ -19,22 +19,83 @@
 //!
 //! With full tree modification, the entire tree can be modified freely through
 //! the use of exclusive locking.
+//!
+//! Between the two, `lockSubtreeModify()` gives structural access to only one of the
+//! `TREE_NODES_PER_LAYER` subtrees below the top layer. Any number of threads can insert and remove
+//! chunks in different subtrees at once, such as when streaming chunks in far apart regions,
+//! while threads in the same subtree wait on each other. It excludes chunk and full tree modification.
+//!
+//! Regions filled entirely with a single block state, such as underground stone, can be stored
+//! as uniform nodes through `Inner.fillUniform()`, at the granularity of a chunk or any layer.
+//! Uniform nodes hold the block state inline, so no chunk is allocated for them until
+//! `Inner.setBlockState()` writes a different block state within them.
+//!
+//! Additionally, chunks can be found without any lock through `pinRead()`.
+//! Nodes are published with atomic stores, and anything removed from the tree is
+//! retired through epoch based reclamation rather than freed immediately, so
+//! inserting and removing chunks does not stop those readers.
+//!
+//! # Snapshots
+//!
+//! `snapshot()` creates an immutable view of the whole tree in O(1), by sharing the top layer.
+//! Layers and chunks are reference counted. Any operation through `TreeModify` access that would modify
+//! a shared layer or chunk first replaces it with a private copy along the path it touches, so the rest
+//! of the tree stays shared. While a snapshot is alive, chunks must only be written to through
+//! `Inner.setBlockState()` or `Inner.writableChunk()`, rather than writing to a chunk found through `ChunkModify`.
+//!
+//! # Memory accounting
+//!
+//! `stats()` reports the nodes of each layer, the chunks by palette size, the hash map occupancy,
+//! and the bytes used by each of them. It's computed from counters kept up to date as the tree changes.
+//!
+//! # Change tracking
+//!
+//! Every node holds the generation of the last change within it, raised along the whole path to anything
+//! that changes. `Inner.diff()` yields the chunks added, modified, and removed since a past `Inner.generation()`,
+//! only descending into nodes with newer generations, so it takes time proportional to the number of changes
+//! rather than the size of the world. Useful for incremental saves, and replication.
 
 const std = @import("std");
 const assert = std.debug.assert;
 const expect = std.testing.expect;
 const Allocator = std.mem.Allocator;
-const RwLock = std.Thread.RwLock;
+const Mutex = std.Thread.Mutex;
+const Condition = std.Thread.Condition;
+const ArrayListUnmanaged = std.ArrayListUnmanaged;
 const tree_layer_indices = @import("tree_layer_indices.zig");
 const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
 const Chunk = @import("../chunk/Chunk.zig");
+const BlockState = Chunk.Inner.BlockState;
+const AIR_BLOCK_STATE = Chunk.Inner.AIR_BLOCK_STATE;
 const Atomic = std.atomic.Value;
 const AtomicOrder = std.builtin.AtomicOrder;
-const TreeNodeColor = @import("../../types/color.zig").TreeNodeColor;
 const LoadedChunksHashMap = @import("LoadedChunksHashMap.zig");
+const epoch = @import("../../types/epoch.zig");
+const job_system = @import("../../types/job_system.zig");
+const JobSystem = job_system.JobSystem;
+const Future = job_system.Future;
+const world_transform = @import("../world_transform.zig");
+const BlockPosition = world_transform.BlockPosition;
+const BlockFacing = world_transform.BlockFacing;
+const BlockIndex = world_transform.BlockIndex;
+const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
+const TREE_NODES_PER_LAYER = tree_layer_indices.TREE_NODES_PER_LAYER;
+const BlockStateIndices = @import("../chunk/BlockStateIndices.zig");
+const tree_stats = @import("tree_stats.zig");
+const TreeCounters = tree_stats.TreeCounters;
+const CountChange = tree_stats.CountChange;
+pub const TreeStats = tree_stats.TreeStats;
 
 const Self = @This();
 
+/// Number of jobs each `JobSystem` thread is given when fanning out over the tree.
+/// More than one evens out subtrees holding very different numbers of chunks.
+const JOBS_PER_THREAD = 4;
+/// Upper bound on the number of jobs a single fan out over the tree can use.
+const MAX_FAN_OUT_JOBS = 256;
+/// Groups of the hash map of loaded chunks moved by each `collectGarbage()` call, while it's resizing.
+const REHASH_GROUPS_PER_COLLECT = 64;
+
 /// Has a consistent memory address, so as long as the lifetime of the reference does not live
 /// past the lifetime of the FatTree, storing a reference to this allocator is safe.
 allocator: Allocator,
@@ -43,13 +104,15 @@ _inner: Inner,
 /// Allocates a new FatTree object, initializing it, and taking ownership of `allocator`.
 pub fn init(allocator: Allocator) Allocator.Error!*Self {
     const newSelf = try allocator.create(Self);
+    errdefer allocator.destroy(newSelf);
     newSelf.allocator = allocator;
-    newSelf._inner = Inner.init(&newSelf.allocator);
+    newSelf._inner = try Inner.init(&newSelf.allocator);
     return newSelf;
 }
 
 /// Calls deinit on all child nodes, and their children,
 /// freeing the memory for all chunks, invalidating everything.
+/// Every `Snapshot` must be released beforehand.
 ///
 /// # Thread safety
 ///
@@ -62,11 +125,41 @@ pub fn deinit(self: *Self) void {
     allocator.destroy(self);
 }
 
+/// Same as `deinit()`, but tears down disjoint subtrees concurrently across the threads of `jobSystem`.
+/// Only the few layers above those subtrees are freed by the calling thread.
+/// Falls back to `deinit()` if the subtrees cannot be partitioned.
+///
+/// # Thread safety
+///
+/// The same as `deinit()`. Additionally, the tree's allocator must be thread safe,
+/// as chunks and layers are freed from multiple threads at once.
+pub fn deinitParallel(self: *Self, jobSystem: *JobSystem) void {
+    {
+        const inner = self.lockTreeModify();
+        defer self.unlockTreeModify();
+
+        var subtrees = ArrayListUnmanaged(*const Node){};
+        defer subtrees.deinit(self.allocator);
+
+        if (inner.partitionSubtrees(jobSystem.threadCount() * JOBS_PER_THREAD, &subtrees)) {
+            const Visitor = struct {
+                fn visit(_: void, node: *const Node) void {
+                    // Holding `TreeModify` access, and each subtree is only visited by one job.
+                    @constCast(node).setEmpty();
+                }
+            };
+            fanOut(subtrees.items, jobSystem, {}, Visitor.visit);
+        } else |_| {}
+    }
+
+    self.deinit();
+}
+
 /// Acquires a shared lock to the `FatTree`'s data, returning a `ChunkModify`.
 /// Through `ChunkModify`, thread safe access to the chunks within this FatTree is guaranteed.
 /// Naturally, the chunks themselves still need to be locked appropriately.
 pub fn lockChunkModify(self: *Self) *const Inner {
-    self._inner._rwLock.lockShared();
+    self._inner._treeLock.lock(.chunkModify);
     return &self._inner;
 }
 
@@ -75,7 +168,7 @@ pub fn lockChunkModify(self: *Self) *const Inner {
 /// Through `ChunkModify`, thread safe access to the chunks within this FatTree is guaranteed.
 /// Naturally, the chunks themselves still need to be locked appropriately.
 pub fn tryLockChunkModify(self: *Self) ?*const Inner {
-    if (self._inner._rwLock.tryLockShared()) {
+    if (self._inner._treeLock.tryLock(.chunkModify)) {
         return &self._inner;
     } else {
         return null;
@@ -84,13 +177,13 @@ pub fn tryLockChunkModify(self: *Self) ?*const Inner {
 
 /// Unlocks the shared lock to the `FatTree`'s data.
 pub fn unlockChunkModify(self: *Self) void {
-    self._inner._rwLock.unlockShared();
+    self._inner._treeLock.unlock(.chunkModify);
 }
 
 /// Acquires an exclusive lock to the `FatTree`'s data, returning a `TreeModify`.
 /// Through `TreeModify`, thread safe access to mutate the entire tree's data is guaranteed.
 pub fn lockTreeModify(self: *Self) *Inner {
-    self._inner._rwLock.lock();
+    self._inner._treeLock.lock(.treeModify);
     return &self._inner;
 }
 
@@ -98,7 +191,7 @@ pub fn lockTreeModify(self: *Self) *Inner {
 /// or an error if the `FatTree` is already shared locked through `ChunkModify`.
 /// Through `TreeModify`, thread safe access to mutate the entire tree's data is guaranteed.
 pub fn tryLockTreeModify(self: *Self) ?*Inner {
-    if (self._inner._rwLock.tryLock()) {
+    if (self._inner._treeLock.tryLock(.treeModify)) {
         return &self._inner;
     } else {
         return null;
@@ -107,46 +200,1426 @@ pub fn tryLockTreeModify(self: *Self) ?*Inner {
 
 /// Unlocks the exclusive lock to the `FatTree`'s data.
 pub fn unlockTreeModify(self: *Self) void {
-    self._inner._rwLock.unlock();
+    self._inner._treeLock.unlock(.treeModify);
+}
+
+/// Acquires structural access to the subtree below the top layer holding `position`, returning a `SubtreeModify`.
+/// Other threads can hold `SubtreeModify` access to other subtrees at the same time, but not `ChunkModify`
+/// or `TreeModify` access. Briefly acquires `TreeModify` access first if the top layer needs to be created,
+/// or copied from a `Snapshot`, which is the only way this can fail.
+/// The tree's allocator must be thread safe.
+pub fn lockSubtreeModify(self: *Self, position: TreeLayerIndices) Allocator.Error!SubtreeModify {
+    const inner = &self._inner;
+    while (true) {
+        inner._treeLock.lock(.subtreeModify);
+        if (inner.topNode.nodeType() == .childLayer and !inner.topNode.childLayer().isShared()) {
+            break;
+        }
+        inner._treeLock.unlock(.subtreeModify);
+
+        // Every subtree shares the top layer, so only `TreeModify` access can replace it.
+        const treeModify = self.lockTreeModify();
+        defer self.unlockTreeModify();
+        var path = Path{};
+        try treeModify.createPath(position, 0, &path);
+    }
+
+    const index = position.indexAtLayer(0);
+    inner._subtreeLocks[index.index].lock();
+    return SubtreeModify{ .inner = inner, .index = index };
+}
+
+/// Unlocks the subtree locked by `lockSubtreeModify()`.
+pub fn unlockSubtreeModify(self: *Self, subtree: SubtreeModify) void {
+    assert(subtree.inner == &self._inner);
+    self._inner._subtreeLocks[subtree.index.index].unlock();
+    self._inner._treeLock.unlock(.subtreeModify);
+}
+
+/// Structural access to one of the subtrees below the top layer, from `lockSubtreeModify()`.
+/// Only positions within the subtree can be used.
+pub const SubtreeModify = struct {
+    inner: *Inner,
+    /// Index of the subtree within the top layer.
+    index: TreeLayerIndices.Index,
+
+    /// Whether `position` is within this subtree.
+    pub fn contains(self: SubtreeModify, position: TreeLayerIndices) bool {
+        return position.indexAtLayer(0).index == self.index.index;
+    }
+
+    pub fn chunkAt(self: SubtreeModify, position: TreeLayerIndices) ?Chunk {
+        assert(self.contains(position));
+        // Other subtrees may be growing the hash map, so the tree is walked instead.
+        return findChunk(&self.inner.topNode, position);
+    }
+
+    /// Same as `Inner.insertChunk()`. Asserts that `chunk` is within this subtree.
+    pub fn insertChunk(self: SubtreeModify, chunk: Chunk) Allocator.Error!void {
+        assert(self.contains(chunk.unsafeRead().treePos));
+        var path = self.pathFromTop();
+        try self.inner.insertChunkAlong(&path, chunk);
+    }
+
+    /// Same as `Inner.removeChunk()`, except the top layer is kept even if left empty.
+    /// Asserts that `position` is within this subtree.
+    pub fn removeChunk(self: SubtreeModify, position: TreeLayerIndices) Allocator.Error!void {
+        assert(self.contains(position));
+        var path = self.pathFromTop();
+        try self.inner.removeChunkAlong(&path, position);
+    }
+
+    fn pathFromTop(self: SubtreeModify) Path {
+        var path = Path{ .sharedTop = 1 };
+        path.push(self.inner.topNode.childLayerMut());
+        return path;
+    }
+};
+
+/// Reports where the memory of this tree is going, from counters kept up to date as the tree changes,
+/// rather than by walking the tree. Acquires `ChunkModify` access.
+/// Node counts describe the live tree. Chunk counts include chunks only kept alive by a `Snapshot`,
+/// or waiting to be reclaimed, as they still use memory.
+pub fn stats(self: *Self) TreeStats {
+    const inner = self.lockChunkModify();
+    defer self.unlockChunkModify();
+
+    var result = TreeStats.fromCounters(&inner.counters);
+    result.map = inner.chunks.stats();
+    result.bytes = bytesOf(&result, result.map.bytes);
+    return result;
+}
+
+/// Same as `stats().bytes.total()`, but only reads the counters, without acquiring any lock,
+/// so it's cheap enough to check every frame. May be momentarily stale while other threads change the tree.
+pub fn bytesUsed(self: *Self) usize {
+    const counters = &self._inner.counters;
+    const result = TreeStats.fromCounters(counters);
+    return bytesOf(&result, counters.mapBytes.load(AtomicOrder.Monotonic)).total();
+}
+
+fn bytesOf(result: *const TreeStats, mapBytes: usize) tree_stats.Bytes {
+    var layers: usize = 0;
+    for (result.layers) |count| {
+        layers += count;
+    }
+    var noodles: usize = 0;
+    for (result.noodleLengths) |count| {
+        noodles += count;
+    }
+    var indicesBytes: usize = 0;
+    inline for (@typeInfo(BlockStateIndices.IndexBitWidth).Enum.fields) |field| {
+        indicesBytes += result.chunksByBitWidth[field.value] * BlockStateIndices.allocationSize(@enumFromInt(field.value));
+    }
+
+    return tree_stats.Bytes{
+        .layers = (layers - noodles) * @sizeOf(Layer),
+        .noodleLayers = noodles * @sizeOf(NoodleLayer),
+        .chunks = result.allocatedChunks() * @sizeOf(Chunk.Inner),
+        .blockStateIndices = indicesBytes,
+        .palettes = result.paletteCapacity * @sizeOf(BlockState),
+        .map = mapBytes,
+    };
+}
+
+/// Counters the chunks of this tree keep up to date, through `ChunkModify` access. See `stats()`.
+pub fn chunkCounters(self: *Self) *TreeCounters {
+    return &self._inner.counters;
+}
+
+/// Pins the current epoch of the tree, allowing chunks to be found without acquiring any lock,
+/// even while other threads insert or remove chunks through `TreeModify`.
+/// Nothing found through the returned `ReadGuard` will be freed until `unpin()` is called.
+/// Naturally, the chunks themselves still need to be locked appropriately.
+pub fn pinRead(self: *Self) ReadGuard {
+    return ReadGuard{ .inner = &self._inner, .guard = self._inner.epoch.pin() };
+}
+
+/// Lock-free read access to the tree structure. See `pinRead()`.
+pub const ReadGuard = struct {
+    inner: *const Inner,
+    guard: epoch.Guard,
+
+    /// Every chunk found through this guard is invalid afterwards.
+    pub fn unpin(self: ReadGuard) void {
+        self.guard.unpin();
+    }
+
+    /// Walks the tree to find the chunk at `position`, without using the hash map.
+    /// The chunk remains valid until `unpin()`.
+    pub fn chunkAt(self: ReadGuard, position: TreeLayerIndices) ?Chunk {
+        return findChunk(&self.inner.topNode, position);
+    }
+};
+
+/// Creates an immutable view of the entire tree as it is right now, in O(1).
+/// Acquires `TreeModify` access only long enough to share the top layer.
+/// Call `release()` on the returned snapshot when done, before the tree is deinitialized.
+pub fn snapshot(self: *Self) Snapshot {
+    const inner = self.lockTreeModify();
+    defer self.unlockTreeModify();
+
+    const top = inner.topNode;
+    top.acquire();
+    _ = inner._liveSnapshots.fetchAdd(1, AtomicOrder.Monotonic);
+    return Snapshot{ .tree = self, .topNode = top };
+}
+
+/// An immutable view of the entire tree at the moment `snapshot()` was called, sharing all of it's
+/// layers and chunks with the tree until they are modified. Can be read from without any `FatTree` lock,
+/// such as while saving, as nothing reachable through it will change. Chunk neighbor links reflect the
+/// live tree, so should not be followed from chunks found through a snapshot.
+pub const Snapshot = struct {
+    tree: *Self,
+    topNode: Node,
+
+    /// Walks the snapshot to find the chunk at `position`.
+    pub fn chunkAt(self: *const Snapshot, position: TreeLayerIndices) ?Chunk {
+        return findChunk(&self.topNode, position);
+    }
+
+    /// Get the block state of the block at `block` within the chunk at `position`, as of when the snapshot was taken.
+    pub fn blockStateAt(self: *const Snapshot, position: TreeLayerIndices, block: BlockIndex) BlockState {
+        return findBlockState(&self.topNode, position, block);
+    }
+
+    /// Calls `function` with `context` for every chunk in the snapshot.
+    pub fn forEachChunk(self: *const Snapshot, context: anytype, comptime function: fn (@TypeOf(context), Chunk) void) void {
+        self.topNode.forEachChunk(context, function);
+    }
+
+    /// Releases everything this snapshot shares, freeing whatever the tree no longer uses.
+    /// The snapshot, and every chunk found through it, is invalid afterwards.
+    pub fn release(self: *Snapshot) void {
+        self.topNode.deinit();
+        _ = self.tree._inner._liveSnapshots.fetchSub(1, AtomicOrder.Release);
+        self.* = undefined;
+    }
+};
+
+/// Reclaims anything retired from the tree that no pinned reader can still observe.
+/// Happens automatically as objects are retired, but can also be called explicitly, such as once per frame.
+pub fn reclaimRetired(self: *Self) void {
+    _ = self._inner.epoch.tryAdvance();
+}
+
+/// Incrementally cleans up chunks that have become entirely air, replacing them with empty nodes,
+/// and pruning any layers left empty. Chunks filled entirely with a single other block state are
+/// replaced with uniform nodes, merging any layers left holding only that block state.
+/// Only chunks marked through `Inner.markChunkDirty()` are checked.
+/// Stops once `budgetMicroseconds` have elapsed, leaving the remaining dirty chunks for the next call,
+/// allowing it to be run once per frame. Returns the number of chunks collected.
+/// Also moves some of the hash map's old groups if it's resizing, so a resize still finishes
+/// once chunks stop being inserted or removed, rather than every lookup probing both sets of groups.
+///
+/// # Thread safety
+///
+/// The calling thread must not hold either lock. Dirty chunks are checked through `ChunkModify` access,
+/// and `TreeModify` access is only acquired for the short window of removing each collected chunk,
+/// or of moving hash map groups.
+pub fn collectGarbage(self: *Self, budgetMicroseconds: u64) usize {
+    defer self.stepRehash();
+
+    const start = std.time.Instant.now() catch unreachable;
+    const budget = budgetMicroseconds * std.time.ns_per_us;
+    var collected: usize = 0;
+
+    while (true) {
+        const now = std.time.Instant.now() catch unreachable;
+        if (now.since(start) >= budget) {
+            break;
+        }
+
+        const position = self._inner.popDirtyChunk() orelse break;
+        var requeue = false;
+        defer if (requeue) self._inner.queueReservedDirtyChunk(position) else self._inner.releaseDirtyChunks(1);
+
+        const isCandidate = blk: {
+            const inner = self.lockChunkModify();
+            defer self.unlockChunkModify();
+
+            const chunk = inner.chunkAt(position) orelse break :blk false;
+            const data = chunk.read();
+            defer chunk.unlockRead();
+            break :blk data.uniformBlockState() != null;
+        };
+        if (!isCandidate) {
+            continue;
+        }
+
+        const inner = self.lockTreeModify();
+        defer self.unlockTreeModify();
+
+        // The chunk may have been written to, or removed, between releasing the shared lock and acquiring the exclusive one.
+        const chunk = inner.chunkAt(position) orelse continue;
+        const state = blk: {
+            const data = chunk.read();
+            defer chunk.unlockRead();
+            break :blk data.uniformBlockState();
+        } orelse continue;
+
+        const result = if (state == AIR_BLOCK_STATE) inner.removeChunk(position) else inner.collapseToUniform(position, state);
+        result catch {
+            // Out of memory copying layers shared with a `Snapshot`. Try again next time.
+            requeue = true;
+            break;
+        };
+        collected += 1;
+    }
+
+    return collected;
+}
+
+/// Moves up to `REHASH_GROUPS_PER_COLLECT` of the hash map's old groups, if it's resizing.
+/// The calling thread must not hold either lock.
+fn stepRehash(self: *Self) void {
+    const isRehashing = blk: {
+        const inner = self.lockChunkModify();
+        defer self.unlockChunkModify();
+        break :blk inner.chunks.isRehashing();
+    };
+    if (!isRehashing) {
+        return;
+    }
+
+    const inner = self.lockTreeModify();
+    defer self.unlockTreeModify();
+    inner._chunksMutex.lock();
+    defer inner._chunksMutex.unlock();
+    // Out of memory growing a group. Try again next time.
+    _ = inner.chunks.rehash(REHASH_GROUPS_PER_COLLECT) catch false;
+    inner.countMapBytes();
 }
 
 pub const Inner = struct {
-    _rwLock: RwLock,
+    _treeLock: TreeLock,
+    /// Held by `SubtreeModify`, indexed by the subtree's index within the top layer.
+    _subtreeLocks: [TREE_NODES_PER_LAYER]Mutex,
     topNode: Node,
     chunks: LoadedChunksHashMap,
+    /// Must be held to modify `chunks`, or the neighbors of any chunk, which may be in another subtree.
+    _chunksMutex: Mutex,
     allocator: *Allocator,
+    /// Defers freeing anything removed from the tree while `ReadGuard`s may still observe it.
+    epoch: epoch.EpochManager,
+    /// Separately allocated so chunks can be marked dirty through `ChunkModify` access.
+    _dirty: *DirtyChunks,
+    /// Number of `Snapshot`s that have not been released.
+    _liveSnapshots: Atomic(usize),
+    /// Kept up to date as the tree changes, for `FatTree.stats()`.
+    counters: TreeCounters,
+    /// Raised by every change to the tree. See `generation()`.
+    _generation: Atomic(u64),
+    /// Generation of the last change to `topNode`, or anything within it. Only ever raised atomically.
+    _topGeneration: u64,
+
+    fn init(allocator: *Allocator) Allocator.Error!Inner {
+        const dirty = try allocator.create(DirtyChunks);
+        dirty.* = .{};
 
-    fn init(allocator: *Allocator) Inner {
         return Inner{
-            ._rwLock = .{},
+            ._treeLock = TreeLock{},
+            ._subtreeLocks = .{Mutex{}} ** TREE_NODES_PER_LAYER,
             .topNode = Node.init(),
             .chunks = LoadedChunksHashMap.init(allocator),
+            ._chunksMutex = .{},
             .allocator = allocator,
+            .epoch = epoch.EpochManager.init(allocator),
+            ._dirty = dirty,
+            ._liveSnapshots = Atomic(usize).init(0),
+            .counters = TreeCounters{},
+            ._generation = Atomic(u64).init(0),
+            ._topGeneration = 0,
         };
     }
 
     fn deinit(self: *Inner) void {
-        if (!self._rwLock.tryLock()) {
-            @panic("Cannot deinit FatTree while other threads have RwLock access to it's inner data");
+        if (!self._treeLock.tryLock(.treeModify)) {
+            @panic("Cannot deinit FatTree while other threads have access to it's inner data");
+        }
+        if (self._liveSnapshots.load(AtomicOrder.Acquire) != 0) {
+            @panic("Cannot deinit FatTree while snapshots of it have not been released");
+        }
+
+        // Free all owned stuff.
+        self.topNode.deinit();
+        self.chunks.deinit();
+        self.epoch.deinit();
+        self._dirty.positions.deinit(self.allocator.*);
+        self.allocator.destroy(self._dirty);
+
+        self._treeLock.unlock(.treeModify);
+    }
+
+    pub fn chunkAt(self: *const Inner, position: TreeLayerIndices) ?Chunk {
+        return self.chunks.find(position);
+    }
+
+    /// Calls `function` with `context` for every chunk in the tree, on the calling thread.
+    /// Requires either `ChunkModify` or `TreeModify` access.
+    pub fn forEachChunk(self: *const Inner, context: anytype, comptime function: fn (@TypeOf(context), Chunk) void) void {
+        self.topNode.forEachChunk(context, function);
+    }
+
+    /// Calls `function` with `context` for every chunk in the tree, splitting the tree into disjoint subtrees
+    /// and visiting them concurrently across the threads of `jobSystem`. Returns once every chunk has been visited.
+    /// `function` will be called from multiple threads at once, so `context` must be thread safe,
+    /// and each chunk must still be locked appropriately. Falls back to `forEachChunk()` if the subtrees
+    /// cannot be partitioned.
+    ///
+    /// Requires either `ChunkModify` or `TreeModify` access, held until this returns.
+    /// Useful for any full world pass, such as rebuilding lighting, or saving.
+    pub fn forEachChunkParallel(self: *const Inner, jobSystem: *JobSystem, context: anytype, comptime function: fn (@TypeOf(context), Chunk) void) void {
+        var subtrees = ArrayListUnmanaged(*const Node){};
+        defer subtrees.deinit(self.allocator.*);
+
+        self.partitionSubtrees(jobSystem.threadCount() * JOBS_PER_THREAD, &subtrees) catch {
+            self.forEachChunk(context, function);
+            return;
+        };
+
+        const Visitor = struct {
+            fn visit(ctx: @TypeOf(context), node: *const Node) void {
+                node.forEachChunk(ctx, function);
+            }
+        };
+        fanOut(subtrees.items, jobSystem, context, Visitor.visit);
+    }
+
+    /// Collects the roots of disjoint subtrees that together hold every chunk in the tree.
+    /// Descends from the top one layer at a time until there are at least `target` of them,
+    /// stopping at the layer holding the chunk nodes.
+    fn partitionSubtrees(self: *const Inner, target: usize, subtrees: *ArrayListUnmanaged(*const Node)) Allocator.Error!void {
+        const allocator = self.allocator.*;
+        subtrees.clearRetainingCapacity();
+        if (self.topNode.nodeType() == .empty) {
+            return;
+        }
+        try subtrees.append(allocator, &self.topNode);
+
+        var next = ArrayListUnmanaged(*const Node){};
+        defer next.deinit(allocator);
+
+        while (subtrees.items.len < target) {
+            next.clearRetainingCapacity();
+            var expanded = false;
+
+            for (subtrees.items) |node| {
+                const layer = node.layerOrNull() orelse {
+                    try next.append(allocator, node);
+                    continue;
+                };
+                if (layer.treeLayer == TREE_LAYERS - 1) {
+                    try next.append(allocator, node);
+                    continue;
+                }
+
+                expanded = true;
+                for (&layer._nodes) |*child| {
+                    if (child.nodeType() != .empty) {
+                        try next.append(allocator, child);
+                    }
+                }
+            }
+
+            if (!expanded) {
+                break;
+            }
+            std.mem.swap(ArrayListUnmanaged(*const Node), subtrees, &next);
+        }
+    }
+
+    /// Inserts `chunk` into the tree at it's `treePos`, creating any missing layers along the way,
+    /// and refreshing the level of detail of every layer on the path.
+    /// Takes ownership of `chunk`, unless inserting fails, in which case the caller still owns it.
+    /// Asserts that no chunk already exists at that position.
+    pub fn insertChunk(self: *Inner, chunk: Chunk) Allocator.Error!void {
+        var path = Path{};
+        try self.insertChunkAlong(&path, chunk);
+    }
+
+    /// Same as `insertChunk()`, but continues from the layers already on `path`.
+    fn insertChunkAlong(self: *Inner, path: *Path, chunk: Chunk) Allocator.Error!void {
+        const position = blk: {
+            const data = chunk.read();
+            defer chunk.unlockRead();
+            break :blk data.treePos;
+        };
+
+        // Nothing may fail once the chunk is placed, as the tree would own it.
+        try self.reserveDirtyChunks(1);
+        errdefer self.releaseDirtyChunks(1);
+
+        try self.extendPath(position, TREE_LAYERS - 1, path);
+
+        const node = path.deepest().nodeAtMut(position.indexAtLayer(TREE_LAYERS - 1));
+        assert(node.nodeType() == .empty);
+
+        const newGeneration = self.pathGeneration(path);
+        try self.placeChunk(node, position, chunk, newGeneration);
+        refreshLodAlongPath(path, position);
+        self.stampGeneration(position, newGeneration);
+
+        // A freshly inserted chunk may never have anything but air written to it.
+        self.queueReservedDirtyChunk(position);
+    }
+
+    /// Inserts every chunk in `chunks` at once, such as when loading or generating a region.
+    /// `chunks` is sorted in place by `TreeLayerIndices.pathKey()`, so consecutive chunks share most of their path
+    /// through the tree. Each layer is then only walked and created once, the level of detail is refreshed once
+    /// per deepest layer rather than per chunk, and the hash map and dirty list grow once up front.
+    /// Call once with `TreeModify` access rather than calling `insertChunk()` for each chunk.
+    /// On failure, the chunks inserted before it remain in the tree, and the rest are still owned by the caller.
+    pub fn insertChunksBulk(self: *Inner, chunks: []Chunk) Allocator.Error!void {
+        if (chunks.len == 0) {
+            return;
+        }
+
+        std.sort.pdq(Chunk, chunks, {}, chunkPathLessThan);
+        defer self.countMapBytes();
+        try self.chunks.reserve(chunks.len);
+        try self.reserveDirtyChunks(chunks.len);
+        var placed: usize = 0;
+        errdefer self.releaseDirtyChunks(chunks.len - placed);
+
+        var path = Path{};
+        var previous: ?TreeLayerIndices = null;
+        // Position of the last chunk placed into the deepest layer on `path`, if it's level of detail is stale.
+        var stale: ?TreeLayerIndices = null;
+        errdefer if (stale) |last| refreshLodAlongPath(&path, last);
+
+        for (chunks) |chunk| {
+            const position = chunk.unsafeRead().treePos;
+            if (previous) |last| {
+                const shared = last.firstDifferingLayer(position);
+                assert(shared != TREE_LAYERS); // duplicate chunk position
+                if (shared < TREE_LAYERS - 1) {
+                    refreshLodAlongPath(&path, last);
+                    stale = null;
+                }
+                // A layer at `treeLayer` is reached through the indices of every layer above it.
+                while (path.len > 0 and path.deepest().treeLayer > shared) {
+                    path.len -= 1;
+                }
+            }
+
+            try self.extendPath(position, TREE_LAYERS - 1, &path);
+            const deepest = path.deepest();
+            const index = position.indexAtLayer(TREE_LAYERS - 1);
+            const node = deepest.nodeAtMut(index);
+            assert(node.nodeType() == .empty);
+
+            const newGeneration = self.pathGeneration(&path);
+            try self.placeChunk(node, position, chunk, newGeneration);
+            // The layers above only need refreshing once every chunk in this layer has been placed.
+            deepest.setLodAt(index, node.lod());
+            previous = position;
+            stale = position;
+            self.stampGeneration(position, newGeneration);
+            self.queueReservedDirtyChunk(position);
+            placed += 1;
+        }
+
+        refreshLodAlongPath(&path, previous.?);
+    }
+
+    /// Get the block state of the block at `block` within the chunk at `position`.
+    /// Blocks within uniform nodes don't need any chunk, and blocks within empty regions are air.
+    pub fn blockStateAt(self: *const Inner, position: TreeLayerIndices, block: BlockIndex) BlockState {
+        return findBlockState(&self.topNode, position, block);
+    }
+
+    /// Sets the block at `block` within the chunk at `position` to `state`.
+    /// Does nothing if the block already has that state, so writing the state of a uniform region
+    /// into it does not allocate. Otherwise, uniform nodes along the path are split, and only the chunk
+    /// at `position` is allocated, holding the blocks of the region it was promoted from.
+    pub fn setBlockState(self: *Inner, position: TreeLayerIndices, block: BlockIndex, state: BlockState) Allocator.Error!void {
+        if (self.blockStateAt(position, block) == state) {
+            return;
+        }
+
+        var path = Path{};
+        try self.createPath(position, TREE_LAYERS - 1, &path);
+
+        const node = path.deepest().nodeAtMut(position.indexAtLayer(TREE_LAYERS - 1));
+        if (node.nodeType() != .chunk) {
+            const fillState = if (node.nodeType() == .uniform) node.uniformState() else AIR_BLOCK_STATE;
+            var newChunk = Chunk{ .inner = @ptrCast(try Chunk.Inner.initFilled(self.tree(), position, fillState)) };
+            errdefer newChunk.deinit();
+            try self.placeChunk(node, position, newChunk, self.pathGeneration(&path));
+        }
+
+        try self.unshareChunk(node, position);
+
+        var chunk = node.chunk();
+        {
+            const data = chunk.write();
+            defer chunk.unlockWrite();
+            try data.setBlockStateAt(state, block);
+        }
+        refreshLodAlongPath(&path, position);
+        self.stampGeneration(position, self.pathGeneration(&path));
+        try self.queueDirtyChunk(position);
+    }
+
+    /// Fills the entire volume of the node at `layer` along the path to `position` with `state`,
+    /// without allocating any chunk. Use `TREE_LAYERS - 1` to fill a single chunk.
+    /// Any chunks and layers previously within that volume are removed.
+    /// Filling with air leaves the node empty, pruning any layers left empty.
+    pub fn fillUniform(self: *Inner, position: TreeLayerIndices, layer: u8, state: BlockState) Allocator.Error!void {
+        assert(layer < TREE_LAYERS);
+
+        var path = Path{};
+        try self.createPath(position, layer, &path);
+
+        const node = path.deepest().nodeAtMut(position.indexAtLayer(layer));
+        const guard = self.epoch.pin();
+        defer guard.unpin();
+
+        self.retireSubtree(layer, node, guard);
+        if (state == AIR_BLOCK_STATE) {
+            self.pruneEmptyLayers(&path, position, guard);
+        } else {
+            node.setUniform(state);
+            self.countNodes(layer, node, .added);
+            self.mergeUniformLayers(&path, position, guard);
+        }
+
+        if (path.len > 0) {
+            refreshLodAlongPath(&path, position);
+        }
+        self.stampGeneration(position, self.pathGeneration(&path));
+    }
+
+    /// Replaces the chunk at `position`, which must hold only `state`, with a uniform node,
+    /// merging any layers left holding only `state` into their parent.
+    fn collapseToUniform(self: *Inner, position: TreeLayerIndices, state: BlockState) Allocator.Error!void {
+        assert(state != AIR_BLOCK_STATE);
+
+        var path = Path{};
+        if (!try self.findPath(position, &path)) {
+            @panic("Cannot collapse a chunk that is not in the FatTree");
+        }
+
+        const node = path.deepest().nodeAtMut(position.indexAtLayer(TREE_LAYERS - 1));
+        const guard = self.epoch.pin();
+        defer guard.unpin();
+
+        self.retireSubtree(TREE_LAYERS - 1, node, guard);
+        node.setUniform(state);
+        self.countNodes(TREE_LAYERS - 1, node, .added);
+        self.mergeUniformLayers(&path, position, guard);
+        if (path.len > 0) {
+            refreshLodAlongPath(&path, position);
+        }
+        self.stampGeneration(position, self.pathGeneration(&path));
+    }
+
+    /// Get the chunk at `position` to write to, first replacing it with a private copy if it's shared
+    /// with a `Snapshot`, along with any shared layers on the path to it.
+    /// Returns null if there is no chunk at `position`.
+    pub fn writableChunk(self: *Inner, position: TreeLayerIndices) Allocator.Error!?Chunk {
+        var path = Path{};
+        if (!try self.findPath(position, &path)) {
+            return null;
+        }
+
+        const node = path.deepest().nodeAtMut(position.indexAtLayer(TREE_LAYERS - 1));
+        if (node.nodeType() != .chunk) {
+            return null;
+        }
+
+        try self.unshareChunk(node, position);
+        // The caller is about to write to it.
+        self.stampGeneration(position, self.pathGeneration(&path));
+        return node.chunk();
+    }
+
+    /// Makes sure the layer held by `node` is not shared with any `Snapshot`, replacing it with a private copy
+    /// if it is, so that it can be modified.
+    fn unshareLayer(self: *Inner, node: *Node) Allocator.Error!void {
+        const copy: usize = switch (node.nodeType()) {
+            .childLayer => blk: {
+                const layer = node.childLayerMut();
+                if (!layer.isShared()) return;
+                break :blk @intFromEnum(Node.Type.childLayer) | @intFromPtr(try layer.clone());
+            },
+            .noodleLayer => blk: {
+                const noodle = node.noodleLayerMut();
+                if (!noodle.layer.isShared()) return;
+                break :blk @intFromEnum(Node.Type.noodleLayer) | @intFromPtr(try noodle.clone());
+            },
+            else => return,
+        };
+        self.replaceShared(node, copy);
+    }
+
+    /// Makes sure the chunk held by `node` at `position` is not shared with any `Snapshot`,
+    /// replacing it with a private copy if it is, so that it can be written to.
+    fn unshareChunk(self: *Inner, node: *Node, position: TreeLayerIndices) Allocator.Error!void {
+        const data = chunkInnerMut(node.chunk());
+        if (!data.isShared()) {
+            return;
+        }
+
+        const copy = Chunk{ .inner = @ptrCast(try data.clone()) };
+        self._chunksMutex.lock();
+        defer self._chunksMutex.unlock();
+        data.unlinkNeighbors();
+        self.replaceShared(node, @intFromEnum(Node.Type.chunk) | @intFromPtr(copy.inner));
+        self.chunks.replace(position, copy);
+        self.linkNeighbors(copy, position);
+    }
+
+    /// Publishes `value` in `node`, releasing the tree's reference to whatever it held once no `ReadGuard` can observe it.
+    fn replaceShared(self: *Inner, node: *Node, value: usize) void {
+        const guard = self.epoch.pin();
+        defer guard.unpin();
+
+        var old = node.atomicCopy();
+        node.store(value);
+        old.retire(guard);
+    }
+
+    /// Places `chunk` into the empty or uniform chunk `node` at `position`, tracking it in the hash map
+    /// and linking it with it's neighbors, as inserted at `newGeneration`. Does not refresh the level of detail.
+    fn placeChunk(self: *Inner, node: *Node, position: TreeLayerIndices, chunk: Chunk, newGeneration: u64) Allocator.Error!void {
+        self._chunksMutex.lock();
+        defer self._chunksMutex.unlock();
+
+        // Even a failed insert may have grown the map.
+        defer self.countMapBytes();
+        try self.chunks.insert(position, chunk);
+        chunkInnerMut(chunk).insertedGeneration = newGeneration;
+        self.countNodes(TREE_LAYERS - 1, node, .removed);
+        node.setChunk(chunk);
+        self.countNodes(TREE_LAYERS - 1, node, .added);
+        self.linkNeighbors(chunk, position);
+    }
+
+    /// Retires everything within `node`, which is within the layer at `treeLayer`,
+    /// unlinking and forgetting every chunk within it.
+    fn retireSubtree(self: *Inner, treeLayer: usize, node: *Node, guard: epoch.Guard) void {
+        node.forEachChunk(self, forgetChunk);
+        self.countNodes(treeLayer, node, .removed);
+        node.retire(guard);
+    }
+
+    /// Adds or removes `node`, which is within the layer at `treeLayer`, and everything below it,
+    /// from the counters used by `FatTree.stats()`. `treeLayer` is null for the top node, which is in no layer.
+    /// Call before a node is replaced with `.removed`, and after with `.added`.
+    fn countNodes(self: *Inner, treeLayer: ?usize, node: *const Node, comptime change: CountChange) void {
+        const kind = node.kind();
+        if (treeLayer) |layerIndex| {
+            if (kind != .empty) {
+                change.apply(&self.counters.nodes[layerIndex][@intFromEnum(kind)], 1);
+            }
+        }
+
+        const layer = node.layerOrNull() orelse return;
+        change.apply(&self.counters.layers[layer.treeLayer], 1);
+        if (kind == .noodleLayer) {
+            const noodle = node.noodleLayer();
+            change.apply(&self.counters.noodleLengths[@as(usize, noodle.jumpEnd) - noodle.jumpStart + 1], 1);
+        }
+        for (&layer._nodes) |*child| {
+            if (child.nodeType() != .empty) {
+                self.countNodes(layer.treeLayer, child, change);
+            }
+        }
+    }
+
+    fn forgetChunk(self: *Inner, chunk: Chunk) void {
+        self._chunksMutex.lock();
+        defer self._chunksMutex.unlock();
+
+        const data = chunkInnerMut(chunk);
+        data.unlinkNeighbors();
+        self.chunks.erase(data.treePos);
+        self.countMapBytes();
+    }
+
+    /// Stores how much memory `chunks` uses, for `FatTree.bytesUsed()`. Call after anything that may resize it,
+    /// with `TreeModify` access or `_chunksMutex` held.
+    fn countMapBytes(self: *Inner) void {
+        self.counters.mapBytes.store(self.chunks.stats().bytes, AtomicOrder.Monotonic);
+    }
+
+    /// Replaces every layer on `path` holding only uniform nodes of a single block state with a uniform node
+    /// in it's parent, from the bottom up. `path` is shortened to only the layers that remain.
+    fn mergeUniformLayers(self: *Inner, path: *Path, position: TreeLayerIndices, guard: epoch.Guard) void {
+        while (path.len > path.sharedTop) {
+            const state = path.deepest().uniformState() orelse return;
+
+            path.len -= 1;
+            const parentLayer: ?usize = if (path.len == 0) null else path.deepest().treeLayer;
+            const parentNode = if (path.len == 0) &self.topNode else path.deepest().nodeAtMut(position.indexAtLayer(parentLayer.?));
+            self.countNodes(parentLayer, parentNode, .removed);
+            parentNode.retire(guard);
+            parentNode.setUniform(state);
+            self.countNodes(parentLayer, parentNode, .added);
+        }
+    }
+
+    /// The `FatTree` owning this.
+    fn tree(self: *Inner) *Self {
+        return @fieldParentPtr(Self, "_inner", self);
+    }
+
+    /// Removes the chunk at `position` from the tree, pruning any layers left empty,
+    /// and refreshing the level of detail of every remaining layer on the path.
+    /// The chunk and pruned layers are retired, and will be deinitialized once no `ReadGuard` can observe them.
+    /// Can only fail if layers on the path are shared with a `Snapshot`, and copying them fails.
+    /// Panics if there is no chunk at `position`.
+    pub fn removeChunk(self: *Inner, position: TreeLayerIndices) Allocator.Error!void {
+        var path = Path{};
+        try self.removeChunkAlong(&path, position);
+    }
+
+    /// Same as `removeChunk()`, but continues from the layers already on `path`.
+    fn removeChunkAlong(self: *Inner, path: *Path, position: TreeLayerIndices) Allocator.Error!void {
+        if (!try self.findPath(position, path)) {
+            @panic("Cannot remove a chunk that is not in the FatTree");
+        }
+
+        const node = path.deepest().nodeAtMut(position.indexAtLayer(TREE_LAYERS - 1));
+        if (node.nodeType() != .chunk) {
+            @panic("Cannot remove a chunk that is not in the FatTree");
+        }
+
+        const guard = self.epoch.pin();
+        defer guard.unpin();
+
+        {
+            self._chunksMutex.lock();
+            defer self._chunksMutex.unlock();
+            chunkInnerMut(node.chunk()).unlinkNeighbors();
+            self.chunks.erase(position);
+            self.countMapBytes();
+        }
+        self.countNodes(TREE_LAYERS - 1, node, .removed);
+        node.retire(guard);
+        self.pruneEmptyLayers(path, position, guard);
+        if (path.len > 0) {
+            refreshLodAlongPath(path, position);
+        }
+        self.stampGeneration(position, self.pathGeneration(path));
+    }
+
+    /// Links `chunk` with each of the loaded chunks sharing a face with it.
+    /// `_chunksMutex` must be held.
+    fn linkNeighbors(self: *Inner, chunk: Chunk, position: TreeLayerIndices) void {
+        const data = chunkInnerMut(chunk);
+        for (0..6) |i| {
+            const facing = Chunk.Inner.faceFromIndex(i);
+            const adjacentPosition = position.adjacent(facing) orelse continue;
+            const adjacent = self.chunks.find(adjacentPosition) orelse continue;
+            data.linkNeighbor(chunkInnerMut(adjacent), facing);
+        }
+    }
+
+    /// Marks the chunk at `position` as modified, so the next `FatTree.collectGarbage()` pass
+    /// checks if it can be cleaned up, and `diff()` reports it. Is safe to call through `ChunkModify` access.
+    /// A chunk already waiting to be checked is only queued once, however many times it is written to.
+    pub fn markChunkDirty(self: *const Inner, position: TreeLayerIndices) Allocator.Error!void {
+        self.stampGeneration(position, self.reserveGeneration());
+        try self.queueDirtyChunk(position);
+    }
+
+    /// Queues `position` for `FatTree.collectGarbage()`, without stamping it's generation.
+    fn queueDirtyChunk(self: *const Inner, position: TreeLayerIndices) Allocator.Error!void {
+        self._dirty.mutex.lock();
+        defer self._dirty.mutex.unlock();
+        try self._dirty.positions.ensureUnusedCapacity(self.allocator.*, self._dirty.reserved + 1);
+        self._dirty.positions.putAssumeCapacity(position, {});
+    }
+
+    /// Sets aside room to queue `count` chunks through `queueReservedDirtyChunk()`, which can't fail,
+    /// for chunks that will already be owned by the tree by the time they are marked.
+    fn reserveDirtyChunks(self: *const Inner, count: usize) Allocator.Error!void {
+        self._dirty.mutex.lock();
+        defer self._dirty.mutex.unlock();
+        try self._dirty.positions.ensureUnusedCapacity(self.allocator.*, self._dirty.reserved + count);
+        self._dirty.reserved += count;
+    }
+
+    /// Gives back room set aside by `reserveDirtyChunks()` that won't be used.
+    fn releaseDirtyChunks(self: *const Inner, count: usize) void {
+        self._dirty.mutex.lock();
+        defer self._dirty.mutex.unlock();
+        assert(self._dirty.reserved >= count);
+        self._dirty.reserved -= count;
+    }
+
+    /// Same as `queueDirtyChunk()`, using room set aside by `reserveDirtyChunks()`.
+    fn queueReservedDirtyChunk(self: *const Inner, position: TreeLayerIndices) void {
+        self._dirty.mutex.lock();
+        defer self._dirty.mutex.unlock();
+        assert(self._dirty.reserved > 0);
+        self._dirty.reserved -= 1;
+        self._dirty.positions.putAssumeCapacity(position, {});
+    }
+
+    /// The number of chunks waiting to be checked by `FatTree.collectGarbage()`.
+    pub fn dirtyChunkCount(self: *const Inner) usize {
+        self._dirty.mutex.lock();
+        defer self._dirty.mutex.unlock();
+        return self._dirty.positions.count();
+    }
+
+    /// Keeps the room of the popped chunk set aside, as if by `reserveDirtyChunks(1)`, so it can be queued again
+    /// without allocating. Either queue it through `queueReservedDirtyChunk()`, or call `releaseDirtyChunks(1)`.
+    fn popDirtyChunk(self: *const Inner) ?TreeLayerIndices {
+        self._dirty.mutex.lock();
+        defer self._dirty.mutex.unlock();
+        const entry = self._dirty.positions.popOrNull() orelse return null;
+        self._dirty.reserved += 1;
+        return entry.key;
+    }
+
+    /// The generation of the most recent change to the tree. Pass it to `diff()` later on
+    /// to find everything that changed after this point.
+    pub fn generation(self: *const Inner) u64 {
+        return self._generation.load(AtomicOrder.Monotonic);
+    }
+
+    /// Iterates over everything that changed after `since`, a value previously returned by `generation()`.
+    /// Only nodes with a newer generation are descended into, so unchanged subtrees are skipped entirely.
+    /// Requires either `ChunkModify` or `TreeModify` access, held until iteration is done.
+    pub fn diff(self: *const Inner, since: u64) DiffIterator {
+        return DiffIterator{ .inner = self, .since = since };
+    }
+
+    /// Takes the next generation for a change. Every layer or chunk the change creates, and the stamp along it's path,
+    /// use the same generation, so no other `SubtreeModify` holder can take a generation between them.
+    fn reserveGeneration(self: *const Inner) u64 {
+        return @constCast(&self._generation).fetchAdd(1, AtomicOrder.Monotonic) + 1;
+    }
+
+    /// The generation of the change being made along `path`, reserved the first time it's needed.
+    fn pathGeneration(self: *const Inner, path: *Path) u64 {
+        if (path.generation == null) {
+            path.generation = self.reserveGeneration();
+        }
+        return path.generation.?;
+    }
+
+    /// Raises the generation of every node along the path to `position` to `newGeneration`, from `reserveGeneration()`.
+    /// Call after anything at `position` changes, once the tree's structure has been updated.
+    /// Generations are only raised atomically, so this is safe through `ChunkModify` access.
+    fn stampGeneration(self: *const Inner, position: TreeLayerIndices, newGeneration: u64) void {
+        raiseGeneration(@constCast(&self._topGeneration), newGeneration);
+
+        var layer = self.topNode.descend(position) orelse return;
+        while (true) {
+            const index = position.indexAtLayer(layer.treeLayer);
+            raiseGeneration(@constCast(&layer._generations[index.index]), newGeneration);
+            layer = layer.nodeAt(index).descend(position) orelse return;
+        }
+    }
+
+    /// Allocates a new layer at `treeLayer`, marking it as created at `newGeneration`.
+    fn initLayer(self: *Inner, treeLayer: u8, newGeneration: u64) Allocator.Error!*Layer {
+        const layer = try Layer.init(self.allocator, treeLayer);
+        layer._createdGeneration = newGeneration;
+        return layer;
+    }
+
+    /// Frees every layer on `path` that holds no nodes, from the bottom up, including any
+    /// `NoodleLayer` chains. `path` is shortened to only the layers that remain.
+    fn pruneEmptyLayers(self: *Inner, path: *Path, position: TreeLayerIndices, guard: epoch.Guard) void {
+        while (path.len > path.sharedTop) {
+            const layer = path.deepest();
+            if (!layer.isAllEmpty()) {
+                return;
+            }
+
+            path.len -= 1;
+            if (path.len == 0) {
+                self.countNodes(null, &self.topNode, .removed);
+                self.topNode.retire(guard);
+            } else {
+                const parent = path.deepest();
+                const node = parent.nodeAtMut(position.indexAtLayer(parent.treeLayer));
+                self.countNodes(parent.treeLayer, node, .removed);
+                node.retire(guard);
+            }
+        }
+    }
+
+    /// Recomputes the level of detail of every layer on the path to `position`, from the bottom up.
+    /// Call after modifying the blocks of the chunk at `position`.
+    /// Only one node of each layer on the path is touched, as chunks and layers keep running totals
+    /// of their occupancy, so this is cheap enough to call after every write.
+    pub fn refreshLod(self: *Inner, position: TreeLayerIndices) Allocator.Error!void {
+        var path = Path{};
+        if (!try self.findPath(position, &path)) {
+            return;
+        }
+        refreshLodAlongPath(&path, position);
+        self.stampGeneration(position, self.pathGeneration(&path));
+    }
+
+    /// Get the level of detail of the node at `layer` along the path to `position`.
+    /// Allows far away regions to be queried without touching any chunk data.
+    /// Returns null if the tree has no layer at `layer` along that path.
+    pub fn lodAt(self: *const Inner, position: TreeLayerIndices, layer: usize) ?Lod {
+        assert(layer < TREE_LAYERS);
+
+        if (self.topNode.nodeType() != .childLayer) {
+            return null;
+        }
+
+        var current = self.topNode.childLayer();
+        while (true) {
+            const index = position.indexAtLayer(current.treeLayer);
+            if (current.treeLayer == layer) {
+                return current.lodAt(index);
+            }
+            current = current.nodeAt(index).descend(position) orelse return null;
+            if (current.treeLayer > layer) { // skipped over by a noodle
+                return null;
+            }
+        }
+    }
+
+    /// Walks down the tree to `position`, until reaching the layer `deepestLayer`, creating any missing layers,
+    /// splitting any uniform nodes, and copying any layers shared with a `Snapshot` along the way.
+    fn createPath(self: *Inner, position: TreeLayerIndices, deepestLayer: usize, path: *Path) Allocator.Error!void {
+        assert(path.len == 0);
+        try self.extendPath(position, deepestLayer, path);
+    }
+
+    /// Same as `createPath()`, but continues from the layers already on `path`,
+    /// which must lead towards `position`.
+    fn extendPath(self: *Inner, position: TreeLayerIndices, deepestLayer: usize, path: *Path) Allocator.Error!void {
+        if (path.len == 0) {
+            switch (self.topNode.nodeType()) {
+                .empty => {
+                    self.topNode.setChildLayer(try self.initLayer(0, self.pathGeneration(path)));
+                    self.countNodes(null, &self.topNode, .added);
+                },
+                .uniform => try self.splitUniform(&self.topNode, 0, self.pathGeneration(path)),
+                else => try self.unshareLayer(&self.topNode),
+            }
+            path.push(self.topNode.childLayerMut());
+        }
+
+        var current = path.deepest();
+        while (true) {
+            if (current.treeLayer == deepestLayer) {
+                return;
+            }
+
+            const node = current.nodeAtMut(position.indexAtLayer(current.treeLayer));
+            switch (node.nodeType()) {
+                .empty => {
+                    node.setChildLayer(try self.initLayer(current.treeLayer + 1, self.pathGeneration(path)));
+                    self.countNodes(current.treeLayer, node, .added);
+                },
+                .uniform => try self.splitUniform(node, current.treeLayer + 1, self.pathGeneration(path)),
+                .childLayer, .noodleLayer => try self.unshareLayer(node),
+                .chunk => unreachable,
+            }
+
+            current = node.descendMut(position) orelse @panic("Splitting a NoodleLayer is not yet supported");
+            if (current.treeLayer > deepestLayer) {
+                @panic("Splitting a NoodleLayer is not yet supported");
+            }
+            path.push(current);
+        }
+    }
+
+    /// Replaces the uniform `node` with a new layer at `treeLayer`, of uniform nodes all holding the same block state,
+    /// so that part of the region can be changed.
+    fn splitUniform(self: *Inner, node: *Node, treeLayer: u8, newGeneration: u64) Allocator.Error!void {
+        const state = node.uniformState();
+
+        const layer = try self.initLayer(treeLayer, newGeneration);
+        @memset(&layer._nodes, Node{ .value = @intFromEnum(Node.Type.uniform) | state });
+        @memset(&layer._lodOccupancy, Lod.FULL.occupancy);
+        layer._lodOccupancySum = TREE_NODES_PER_LAYER * @as(u32, Lod.FULL.occupancy);
+
+        const parentLayer: ?usize = if (treeLayer == 0) null else treeLayer - 1;
+        self.countNodes(parentLayer, node, .removed);
+        node.setChildLayer(layer);
+        self.countNodes(parentLayer, node, .added);
+    }
+
+    /// Walks down the existing tree to `position`, copying any layers shared with a `Snapshot` along the way,
+    /// so that the layers on `path` can be modified. Continues from the layers already on `path`, if any.
+    /// Returns true if the deepest layer, which holds the chunk nodes, was reached.
+    fn findPath(self: *Inner, position: TreeLayerIndices, path: *Path) Allocator.Error!bool {
+        if (path.len == 0) {
+            if (self.topNode.nodeType() != .childLayer) {
+                return false;
+            }
+            try self.unshareLayer(&self.topNode);
+            path.push(self.topNode.childLayerMut());
+        }
+
+        var current = path.deepest();
+        while (current.treeLayer != TREE_LAYERS - 1) {
+            const node = current.nodeAtMut(position.indexAtLayer(current.treeLayer));
+            try self.unshareLayer(node);
+            current = node.descendMut(position) orelse return false;
+            path.push(current);
+        }
+        return true;
+    }
+
+    fn refreshLodAlongPath(path: *const Path, position: TreeLayerIndices) void {
+        const deepest = path.deepest();
+        const index = position.indexAtLayer(deepest.treeLayer);
+        deepest.setLodAt(index, deepest.nodeAt(index).lod());
+
+        var i = path.len - 1;
+        while (i > 0) : (i -= 1) {
+            const parent = path.layers[i - 1];
+            parent.setLodAt(position.indexAtLayer(parent.treeLayer), path.layers[i].summarizeLod());
+        }
+    }
+};
+
+fn chunkPathLessThan(_: void, lhs: Chunk, rhs: Chunk) bool {
+    return lhs.unsafeRead().treePos.pathKey() < rhs.unsafeRead().treePos.pathKey();
+}
+
+/// Walks down from `topNode` to find the chunk at `position`, without using the hash map.
+/// Safe to use without any lock, as every node is read atomically.
+fn findChunk(topNode: *const Node, position: TreeLayerIndices) ?Chunk {
+    var node = topNode.atomicCopy();
+    var current = node.descend(position) orelse return null;
+
+    while (current.treeLayer != TREE_LAYERS - 1) {
+        node = current.nodeAt(position.indexAtLayer(current.treeLayer)).atomicCopy();
+        current = node.descend(position) orelse return null;
+    }
+
+    node = current.nodeAt(position.indexAtLayer(current.treeLayer)).atomicCopy();
+    if (node.nodeType() != .chunk) {
+        return null;
+    }
+    return node.chunk();
+}
+
+/// Walks down from `topNode` to find the block state of the block at `block` within the chunk at `position`.
+/// Blocks within uniform nodes don't need any chunk, and blocks within empty regions are air.
+fn findBlockState(topNode: *const Node, position: TreeLayerIndices, block: BlockIndex) BlockState {
+    var node = topNode.atomicCopy();
+    while (true) {
+        switch (node.nodeType()) {
+            .empty => return AIR_BLOCK_STATE,
+            .uniform => return node.uniformState(),
+            .chunk => {
+                const chunk = node.chunk();
+                const data = chunk.read();
+                defer chunk.unlockRead();
+                return data.blockStateAt(block);
+            },
+            .childLayer, .noodleLayer => {
+                const layer = node.descend(position) orelse return AIR_BLOCK_STATE;
+                node = layer.nodeAt(position.indexAtLayer(layer.treeLayer)).atomicCopy();
+            },
+        }
+    }
+}
+
+/// Splits `subtrees` into batches, calling `visit` with `context` for each subtree root across the threads
+/// of `jobSystem`, and waits for all of them. A batch that cannot be queued is run on the calling thread instead.
+fn fanOut(subtrees: []const *const Node, jobSystem: *JobSystem, context: anytype, comptime visit: fn (@TypeOf(context), *const Node) void) void {
+    const Batch = struct {
+        fn run(nodes: []const *const Node, ctx: @TypeOf(context)) void {
+            for (nodes) |node| {
+                visit(ctx, node);
+            }
+        }
+    };
+
+    const jobCount = @min(subtrees.len, jobSystem.threadCount() * JOBS_PER_THREAD, MAX_FAN_OUT_JOBS);
+    var futures: [MAX_FAN_OUT_JOBS]?Future(void) = undefined;
+
+    for (0..jobCount) |i| {
+        const batch = subtrees[(i * subtrees.len / jobCount)..((i + 1) * subtrees.len / jobCount)];
+        futures[i] = jobSystem.runJob(Batch.run, .{ batch, context }) catch blk: {
+            Batch.run(batch, context);
+            break :blk null;
+        };
+    }
+
+    for (futures[0..jobCount]) |future| {
+        if (future) |f| {
+            f.wait();
+        }
+    }
+}
+
+/// Gets the inner data of `chunk` without locking it. Only valid with `TreeModify` access,
+/// as no other thread can have the chunk locked.
+fn chunkInnerMut(chunk: Chunk) *Chunk.Inner {
+    return @ptrCast(@alignCast(chunk.inner));
+}
+
+/// Raises `value` to `newGeneration`, unless another thread already raised it further.
+fn raiseGeneration(value: *u64, newGeneration: u64) void {
+    _ = @atomicRmw(u64, value, .Max, newGeneration, AtomicOrder.Monotonic);
+}
+
+/// Aggregate level of detail data for a node in the tree.
+/// Allows the renderer, and any far-field queries, to stop at a coarse layer
+/// instead of touching per-block data for distant regions.
+/// Block states have no color to average yet, so only occupancy is tracked.
+pub const Lod = struct {
+    /// How much of the node's volume is not air. 0 is entirely empty, and 255 is entirely full.
+    /// Any non-empty volume will be at least 1.
+    occupancy: u8 = 0,
+
+    /// A node filled entirely with a block state other than air, such as a uniform node.
+    pub const FULL = Lod{ .occupancy = 255 };
+};
+
+/// Something that changed within the tree, yielded by `DiffIterator`.
+pub const Change = struct {
+    pub const Kind = enum {
+        /// `chunk` was inserted.
+        added,
+        /// `chunk` was written to, or replaced by a copy.
+        modified,
+        /// Everything previously within the node was removed. The node is now empty, or anything it
+        /// now holds is yielded by the changes that follow.
+        removed,
+        /// The node is now filled entirely with `state`, replacing everything previously within it.
+        filled,
+    };
+
+    kind: Kind,
+    /// Path to the node that changed. Indices below `layer` are 0.
+    position: TreeLayerIndices,
+    /// Tree layer of the node that changed, where `TREE_LAYERS - 1` is a single chunk.
+    /// Null if the whole tree changed.
+    layer: ?u8,
+    /// The chunk that was added or modified.
+    chunk: ?Chunk = null,
+    /// The block state a filled node holds.
+    state: BlockState = AIR_BLOCK_STATE,
+};
+
+/// Walks the nodes of a tree with a generation newer than `since`, yielding what changed within them.
+/// Returned by `Inner.diff()`. Chunks added and then removed again may be reported as removed,
+/// and chunks may be reported as modified more than once across separate diffs.
+pub const DiffIterator = struct {
+    /// One layer being iterated over.
+    const Frame = struct {
+        layer: *const Layer,
+        nextIndex: usize = 0,
+        /// The layer is newer than `since`, so everything within it is yielded.
+        isNew: bool,
+    };
+
+    inner: *const Inner,
+    since: u64,
+    started: bool = false,
+    frames: [TREE_LAYERS]Frame = undefined,
+    depth: usize = 0,
+    position: TreeLayerIndices = TreeLayerIndices{},
+
+    /// Get the next change, or null once every change has been yielded.
+    pub fn next(self: *DiffIterator) ?Change {
+        if (!self.started) {
+            self.started = true;
+            const top = self.inner.topNode.atomicCopy();
+            if (@atomicLoad(u64, &self.inner._topGeneration, AtomicOrder.Monotonic) <= self.since) {
+                return null;
+            }
+            if (top.layerOrNull()) |layer| {
+                const isNew = layer._createdGeneration > self.since;
+                self.push(&top, isNew);
+                if (isNew) {
+                    return Change{ .kind = .removed, .position = TreeLayerIndices{}, .layer = null };
+                }
+            } else {
+                return self.leafChange(top, null, false);
+            }
+        }
+
+        while (self.depth > 0) {
+            const frame = &self.frames[self.depth - 1];
+            if (frame.nextIndex == TREE_NODES_PER_LAYER) {
+                self.depth -= 1;
+                continue;
+            }
+
+            const index = TreeLayerIndices.Index{ .index = @intCast(frame.nextIndex) };
+            frame.nextIndex += 1;
+            const layer = frame.layer;
+            const node = layer.nodeAt(index).atomicCopy();
+            if (node.nodeType() == .empty and frame.isNew) {
+                continue;
+            }
+            if (!frame.isNew and layer.generationAt(index) <= self.since) {
+                continue;
+            }
+
+            self.position.setIndexAtLayer(layer.treeLayer, index);
+            const child = node.layerOrNull() orelse return self.leafChange(node, layer.treeLayer, frame.isNew);
+            const childIsNew = frame.isNew or child._createdGeneration > self.since;
+            self.push(&node, childIsNew);
+            if (childIsNew and !frame.isNew) {
+                return Change{ .kind = .removed, .position = self.regionPosition(layer.treeLayer), .layer = layer.treeLayer };
+            }
+        }
+        return null;
+    }
+
+    /// Starts iterating over the layer held by `node`, filling in the indices of any layers a `NoodleLayer` skips.
+    fn push(self: *DiffIterator, node: *const Node, isNew: bool) void {
+        if (node.nodeType() == .noodleLayer) {
+            const noodle = node.noodleLayer();
+            for (noodle.jumpStart..noodle.jumpEnd) |i| {
+                self.position.setIndexAtLayer(i, noodle.indices[i]);
+            }
+        }
+        self.frames[self.depth] = Frame{ .layer = node.layerOrNull().?, .isNew = isNew };
+        self.depth += 1;
+    }
+
+    /// The change for a `node` holding no layer, at `treeLayer` along `position`.
+    fn leafChange(self: *const DiffIterator, node: Node, treeLayer: ?u8, withinNewLayer: bool) Change {
+        const position = if (treeLayer) |layer| self.regionPosition(layer) else TreeLayerIndices{};
+        return switch (node.nodeType()) {
+            .empty => Change{ .kind = .removed, .position = position, .layer = treeLayer },
+            .uniform => Change{ .kind = .filled, .position = position, .layer = treeLayer, .state = node.uniformState() },
+            .chunk => blk: {
+                const chunk = node.chunk();
+                const isAdded = withinNewLayer or chunkInnerMut(chunk).insertedGeneration > self.since;
+                break :blk Change{ .kind = if (isAdded) .added else .modified, .position = position, .layer = treeLayer, .chunk = chunk };
+            },
+            .childLayer, .noodleLayer => unreachable,
+        };
+    }
+
+    /// The current position, with the indices of every layer below `treeLayer` set to 0.
+    fn regionPosition(self: *const DiffIterator, treeLayer: u8) TreeLayerIndices {
+        var position = self.position;
+        for ((@as(usize, treeLayer) + 1)..TREE_LAYERS) |i| {
+            position.setIndexAtLayer(i, TreeLayerIndices.Index{ .index = 0 });
+        }
+        return position;
+    }
+};
+
+/// Chunks that have been modified since they were last checked by `FatTree.collectGarbage()`.
+const DirtyChunks = struct {
+    mutex: Mutex = .{},
+    /// A set, so writing to the same chunk repeatedly doesn't queue it again. Popped from the back, like a stack.
+    positions: std.AutoArrayHashMapUnmanaged(TreeLayerIndices, void) = .{},
+    /// Room within `positions` set aside by `Inner.reserveDirtyChunks()` or `Inner.popDirtyChunk()`, which other appends must leave free,
+    /// as other `SubtreeModify` holders may be inserting chunks at the same time.
+    reserved: usize = 0,
+};
+
+/// The kinds of access to the tree.
+const AccessMode = enum {
+    chunkModify,
+    subtreeModify,
+    treeModify,
+};
+
+/// Any number of threads can hold `chunkModify` access at once, or any number can hold `subtreeModify` access
+/// at once, but never both, and `treeModify` access is exclusive. Threads waiting for `treeModify` access
+/// are let in first, so streaming threads can't starve them.
+const TreeLock = struct {
+    mutex: Mutex = .{},
+    condition: Condition = .{},
+    chunkHolders: usize = 0,
+    subtreeHolders: usize = 0,
+    treeHeld: bool = false,
+    treeWaiters: usize = 0,
+
+    fn lock(self: *TreeLock, comptime mode: AccessMode) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        if (mode == .treeModify) self.treeWaiters += 1;
+        while (!self.canAcquire(mode)) {
+            self.condition.wait(&self.mutex);
+        }
+        if (mode == .treeModify) self.treeWaiters -= 1;
+        self.acquire(mode);
+    }
+
+    fn tryLock(self: *TreeLock, comptime mode: AccessMode) bool {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        if (!self.canAcquire(mode)) {
+            return false;
+        }
+        self.acquire(mode);
+        return true;
+    }
+
+    fn unlock(self: *TreeLock, comptime mode: AccessMode) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        switch (mode) {
+            .chunkModify => self.chunkHolders -= 1,
+            .subtreeModify => self.subtreeHolders -= 1,
+            .treeModify => self.treeHeld = false,
+        }
+        self.condition.broadcast();
+    }
+
+    fn canAcquire(self: *const TreeLock, comptime mode: AccessMode) bool {
+        if (self.treeHeld) {
+            return false;
         }
+        return switch (mode) {
+            .chunkModify => self.subtreeHolders == 0 and self.treeWaiters == 0,
+            .subtreeModify => self.chunkHolders == 0 and self.treeWaiters == 0,
+            .treeModify => self.chunkHolders == 0 and self.subtreeHolders == 0,
+        };
+    }
+
+    fn acquire(self: *TreeLock, comptime mode: AccessMode) void {
+        switch (mode) {
+            .chunkModify => self.chunkHolders += 1,
+            .subtreeModify => self.subtreeHolders += 1,
+            .treeModify => self.treeHeld = true,
+        }
+    }
+};
 
-        // Free all owned stuff.
-        self.topNode.deinit();
-        self.chunks.deinit();
+/// The layers walked through to reach a node, ordered from the top of the tree down.
+const Path = struct {
+    layers: [TREE_LAYERS]*Layer = undefined,
+    len: usize = 0,
+    /// Number of layers at the top that other `SubtreeModify` holders are also using,
+    /// which must be kept even if left empty or uniform.
+    sharedTop: usize = 0,
+    /// Generation of the change being made along this path. See `Inner.pathGeneration()`.
+    generation: ?u64 = null,
 
-        self._rwLock.unlock();
+    fn push(self: *Path, layer: *Layer) void {
+        self.layers[self.len] = layer;
+        self.len += 1;
     }
 
-    pub fn chunkAt(self: *const Inner, position: TreeLayerIndices) ?Chunk {
-        return self.chunks.find(position);
+    fn deepest(self: *const Path) *Layer {
+        assert(self.len > 0);
+        return self.layers[self.len - 1];
     }
 };
 
 /// Corresponds with `NodeType` enum to make a tagged union,
 /// but with the advantage of Struct of Arrays for SIMD operations on the tags.
-const Node = struct { // TODO store LOD data inline?
+/// Level of detail data for each node is stored in `Layer`, parallel to the nodes.
+/// `Node`, `Layer` and `NoodleLayer` are public so the tree can be read by encoders such as `GpuTree`,
+/// but must only be modified through `Inner`.
+pub const Node = struct {
     const POINTER_MASK: usize = 0x0000FFFFFFFFFFFF;
-    const TYPE_MASK: usize = 0xF000000000000000;
+    const TYPE_MASK: usize = 0x000F000000000000;
     const TYPE_SHIFT: u6 = 48;
 
     pub const Type = enum(usize) {
@@ -154,6 +1627,8 @@ const Node = struct { // TODO store LOD data inline?
         childLayer = @shlExact(1, TYPE_SHIFT),
         noodleLayer = @shlExact(2, TYPE_SHIFT),
         chunk = @shlExact(3, TYPE_SHIFT),
+        /// Holds a single block state inline, filling the entire volume of the node.
+        uniform = @shlExact(4, TYPE_SHIFT),
     };
 
     value: usize,
@@ -162,57 +1637,65 @@ const Node = struct { // TODO store LOD data inline?
         return Node{ .value = 0 };
     }
 
-    /// Calls `deinit()` on the chunk or child layer,
-    /// depending on if this node is either.
+    /// Releases this node's reference to the chunk or child layer,
+    /// depending on if this node is either, deinitializing it if nothing else shares it.
     pub fn deinit(self: *Node) void {
         switch (self.nodeType()) {
             .empty => {},
-            .childLayer => {
-                var c = self.childLayerMut();
-                c.deinit();
-            },
-            .noodleLayer => {
-                var c = self.noodleLayerMut();
-                c.deinit();
-            },
-            .chunk => {
-                var c = self.chunk();
-                c.deinit();
-            },
+            .childLayer => self.childLayerMut().release(),
+            .noodleLayer => self.noodleLayerMut().release(),
+            .chunk => chunkInnerMut(self.chunk()).release(),
+            .uniform => {},
+        }
+    }
+
+    /// Adds a reference to the chunk or child layer this node holds, so that another node can share it.
+    pub fn acquire(self: *const Node) void {
+        const ptr = self.load() & POINTER_MASK;
+        switch (self.nodeType()) {
+            .childLayer => @as(*Layer, @ptrFromInt(ptr)).acquire(),
+            .noodleLayer => @as(*NoodleLayer, @ptrFromInt(ptr)).layer.acquire(),
+            .chunk => @as(*Chunk.Inner, @ptrFromInt(ptr)).acquire(),
+            .empty, .uniform => {},
         }
     }
 
     pub fn nodeType(self: *const Node) Type {
-        const maskedTag = self.value & TYPE_MASK;
+        const maskedTag = self.load() & TYPE_MASK;
         return @enumFromInt(maskedTag);
     }
 
+    /// Same as `nodeType()`, but numbered from 0 for indexing, such as by `TreeCounters`.
+    pub fn kind(self: *const Node) tree_stats.NodeKind {
+        return @enumFromInt(@intFromEnum(self.nodeType()) >> TYPE_SHIFT);
+    }
+
     /// Asserts that this node is a child layer node.
     /// Gets immutable access to the child layer data of this node.
     pub fn childLayer(self: *const Node) *const Layer {
         assert(self.nodeType() == .childLayer);
-        return @ptrFromInt(self.value & POINTER_MASK);
+        return @ptrFromInt(self.load() & POINTER_MASK);
     }
 
     /// Asserts that this node is a child layer node.
     /// Gets immutable access to the child noodle layer data of this node.
     pub fn noodleLayer(self: *const Node) *const NoodleLayer {
         assert(self.nodeType() == .noodleLayer);
-        return @ptrFromInt(self.value & POINTER_MASK);
+        return @ptrFromInt(self.load() & POINTER_MASK);
     }
 
     /// Asserts that this node is a child layer node.
     /// Gets mutable access to the child layer data of this node.
     pub fn childLayerMut(self: *Node) *Layer {
         assert(self.nodeType() == .childLayer);
-        return @ptrFromInt(self.value & POINTER_MASK);
+        return @ptrFromInt(self.load() & POINTER_MASK);
     }
 
     /// Asserts that this node is a child layer node.
     /// Gets mutable access to the child noodle layer data of this node.
     pub fn noodleLayerMut(self: *Node) *NoodleLayer {
         assert(self.nodeType() == .noodleLayer);
-        return @ptrFromInt(self.value & POINTER_MASK);
+        return @ptrFromInt(self.load() & POINTER_MASK);
     }
 
     /// Asserts that this node is a chunk node.
@@ -222,23 +1705,137 @@ const Node = struct { // TODO store LOD data inline?
     /// will have a valid lifetime until the engine's cleanup cycle during a frame.
     pub fn chunk(self: *const Node) Chunk {
         assert(self.nodeType() == .chunk);
-        return Chunk{ .inner = @ptrFromInt(self.value & POINTER_MASK) };
+        return Chunk{ .inner = @ptrFromInt(self.load() & POINTER_MASK) };
+    }
+
+    /// Asserts that this node is a uniform node.
+    /// Get the block state filling the entire volume of this node.
+    pub fn uniformState(self: *const Node) BlockState {
+        assert(self.nodeType() == .uniform);
+        return self.load() & POINTER_MASK;
+    }
+
+    /// Computes the level of detail of this node from whatever it holds.
+    pub fn lod(self: *const Node) Lod {
+        switch (self.nodeType()) {
+            .empty => return Lod{},
+            .uniform => return Lod.FULL,
+            .chunk => {
+                const c = self.chunk();
+                const data = c.read();
+                defer c.unlockRead();
+                return data.lodSummary();
+            },
+            .childLayer, .noodleLayer => return self.layerOrNull().?.summarizeLod(),
+        }
+    }
+
+    /// Get the layer one step further down the tree towards `position`.
+    /// Returns null if this node doesn't hold a layer, or holds a `NoodleLayer` that skips
+    /// over a different path than `position`.
+    pub fn descend(self: *const Node, position: TreeLayerIndices) ?*const Layer {
+        switch (self.nodeType()) {
+            .childLayer => return self.childLayer(),
+            .noodleLayer => {
+                const noodle = self.noodleLayer();
+                if (!noodle.covers(position)) return null;
+                return &noodle.layer;
+            },
+            else => return null,
+        }
+    }
+
+    /// Get the layer one step further down the tree towards `position` mutably.
+    /// Returns null if this node doesn't hold a layer, or holds a `NoodleLayer` that skips
+    /// over a different path than `position`.
+    pub fn descendMut(self: *Node, position: TreeLayerIndices) ?*Layer {
+        switch (self.nodeType()) {
+            .childLayer => return self.childLayerMut(),
+            .noodleLayer => {
+                const noodle = self.noodleLayerMut();
+                if (!noodle.covers(position)) return null;
+                return &noodle.layer;
+            },
+            else => return null,
+        }
+    }
+
+    /// Get the layer this node holds, either directly or within a `NoodleLayer`.
+    /// Returns null if this node doesn't hold a layer.
+    pub fn layerOrNull(self: *const Node) ?*const Layer {
+        switch (self.nodeType()) {
+            .childLayer => return self.childLayer(),
+            .noodleLayer => return &self.noodleLayer().layer,
+            else => return null,
+        }
+    }
+
+    /// Calls `function` with `context` for every chunk in this node's subtree.
+    pub fn forEachChunk(self: *const Node, context: anytype, comptime function: fn (@TypeOf(context), Chunk) void) void {
+        if (self.nodeType() == .chunk) {
+            function(context, self.chunk());
+            return;
+        }
+
+        const layer = self.layerOrNull() orelse return;
+        for (&layer._nodes) |*child| {
+            child.forEachChunk(context, function);
+        }
     }
 
     /// Calls `deinit()`.
     /// Sets this node to hold no data.
     pub fn setEmpty(self: *Node) void {
         self.deinit();
-        self.value = 0;
+        self.store(0);
+    }
+
+    /// Sets this node to hold no data, retiring whatever it held through `guard`,
+    /// so it's only released once no pinned reader can still observe it.
+    pub fn retire(self: *Node, guard: epoch.Guard) void {
+        switch (self.nodeType()) {
+            .empty => {},
+            .childLayer => guard.retireObject(Layer, self.childLayerMut(), Layer.release),
+            .noodleLayer => guard.retireObject(NoodleLayer, self.noodleLayerMut(), NoodleLayer.release),
+            .chunk => guard.retireObject(Chunk.Inner, chunkInnerMut(self.chunk()), Chunk.Inner.release),
+            .uniform => {},
+        }
+        self.store(0);
+    }
+
+    /// Atomically copies this node, so that a reader not holding any lock works
+    /// with a consistent value, even if a writer replaces it concurrently.
+    pub fn atomicCopy(self: *const Node) Node {
+        return Node{ .value = self.load() };
+    }
+
+    fn load(self: *const Node) usize {
+        return @atomicLoad(usize, &self.value, AtomicOrder.Acquire);
+    }
+
+    /// Publishes a new value. Anything `value` points to must be fully initialized beforehand.
+    fn store(self: *Node, value: usize) void {
+        @atomicStore(usize, &self.value, value, AtomicOrder.Release);
+    }
+
+    /// Calls `deinit()`.
+    /// Sets this node to have it's entire volume filled with `state`, without any allocation.
+    /// Asserts that `state` is not air, as that is an empty node, and that it fits within the node.
+    pub fn setUniform(self: *Node, state: BlockState) void {
+        assert(state != AIR_BLOCK_STATE);
+        assert(state <= POINTER_MASK);
+        self.deinit();
+
+        self.store(@intFromEnum(Type.uniform) | state);
     }
 
     /// Calls `deinit()`.
     /// Sets this node to hold a `Chunk`.
     pub fn setChunk(self: *Node, newChunk: Chunk) void {
         self.deinit();
-        const chunkAsUSize: usize = @bitCast(newChunk);
+        const chunkAsUSize: usize = @intFromPtr(newChunk.inner);
 
-        self.value = @intFromEnum(Type.chunk) | chunkAsUSize;
+        self.store(@intFromEnum(Type.chunk) | chunkAsUSize);
     }
 
     /// Calls `deinit()`.
@@ -247,7 +1844,7 @@ const Node = struct { // TODO store LOD data inline?
         self.deinit();
         const layerAsUSize: usize = @intFromPtr(newLayer);
 
-        self.value = @intFromEnum(Type.childLayer) | layerAsUSize;
+        self.store(@intFromEnum(Type.childLayer) | layerAsUSize);
     }
 
     /// Calls `deinit()` on self.
@@ -256,16 +1853,29 @@ const Node = struct { // TODO store LOD data inline?
         self.deinit();
         const noodleAsUsize: usize = @intFromPtr(newNoodle);
 
-        self.value = @intFromEnum(Type.noodleLayer) | noodleAsUsize;
+        self.store(@intFromEnum(Type.noodleLayer) | noodleAsUsize);
     }
 };
 
-const Layer = struct {
+pub const Layer = struct {
     /// This is the allocator used by the tree.
     allocator: *Allocator,
     /// DO NOT MODIFY
     treeLayer: u8,
     _nodes: [tree_layer_indices.TREE_NODES_PER_LAYER]Node align(64),
+    /// Level of detail occupancy of each node, parallel to `_nodes`. See `Lod.occupancy`.
+    _lodOccupancy: [TREE_NODES_PER_LAYER]u8,
+    /// Sum of `_lodOccupancy`, kept up to date by `setLodAt()`, so `summarizeLod()` doesn't add up every node.
+    _lodOccupancySum: u32,
+    /// References from parent nodes and `Snapshot`s. A layer with more than one is shared,
+    /// and must be copied before being modified.
+    _refCount: Atomic(u32),
+    /// Generation of the last change within each node, parallel to `_nodes`. Only ever raised atomically.
+    /// See `Inner.diff()`.
+    _generations: [TREE_NODES_PER_LAYER]u64,
+    /// Generation this layer was added to the tree after. Anything within it may have replaced whatever
+    /// that region held before.
+    _createdGeneration: u64,
 
     /// If `parent` is null, `indexInParent` is useless. Use 0.
     pub fn init(allocator: *Allocator, treeLayer: u8) Allocator.Error!*Layer {
@@ -282,6 +1892,44 @@ const Layer = struct {
         allocator.destroy(self);
     }
 
+    /// Adds a reference to this layer.
+    pub fn acquire(self: *Layer) void {
+        _ = self._refCount.fetchAdd(1, AtomicOrder.Monotonic);
+    }
+
+    /// Removes a reference to this layer, calling `deinit()` once there are none left.
+    pub fn release(self: *Layer) void {
+        if (self._refCount.fetchSub(1, AtomicOrder.AcqRel) == 1) {
+            self.deinit();
+        }
+    }
+
+    /// Checks if anything other than it's parent node references this layer.
+    pub fn isShared(self: *const Layer) bool {
+        return self._refCount.load(AtomicOrder.Acquire) > 1;
+    }
+
+    /// Creates a copy of this layer, sharing all of it's children with it.
+    pub fn clone(self: *const Layer) Allocator.Error!*Layer {
+        const copy = try self.allocator.create(Layer);
+        copy.* = Layer.create(self.allocator, self.treeLayer);
+        copy.shareChildrenOf(self);
+        return copy;
+    }
+
+    /// Copies the nodes, level of detail, and generations of `other`, adding a reference to each child.
+    fn shareChildrenOf(self: *Layer, other: *const Layer) void {
+        for (0..TREE_NODES_PER_LAYER) |i| {
+            const node = other._nodes[i].atomicCopy();
+            node.acquire();
+            self._nodes[i] = node;
+            self._generations[i] = @atomicLoad(u64, &other._generations[i], AtomicOrder.Monotonic);
+        }
+        self._lodOccupancy = other._lodOccupancy;
+        self._lodOccupancySum = other._lodOccupancySum;
+        self._createdGeneration = other._createdGeneration;
+    }
+
     /// Does not free the memory associated with `self`.
     pub fn deinitWithoutFree(self: *Layer) void {
         for (0..tree_layer_indices.TREE_NODES_PER_LAYER) |i| {
@@ -297,16 +1945,32 @@ const Layer = struct {
             .allocator = allocator,
             .treeLayer = treeLayer,
             ._nodes = .{Node.init()} ** tree_layer_indices.TREE_NODES_PER_LAYER,
+            ._lodOccupancy = .{0} ** TREE_NODES_PER_LAYER,
+            ._lodOccupancySum = 0,
+            ._refCount = Atomic(u32).init(1),
+            ._generations = .{0} ** TREE_NODES_PER_LAYER,
+            ._createdGeneration = 0,
         };
     }
 
-    pub fn isAllEmpty(self: Layer) bool { // TODO optimize with avx512
+    pub fn isAllEmpty(self: *const Layer) bool { // TODO optimize with avx512
         for (0..tree_layer_indices.TREE_NODES_PER_LAYER) |i| {
-            if (self._nodes[i].nodeType() == .empty) return false;
+            if (self._nodes[i].nodeType() != .empty) return false;
         }
         return true;
     }
 
+    /// Get the block state filling every node in this layer, or null if any node is not uniform with that same block state.
+    pub fn uniformState(self: *const Layer) ?BlockState {
+        const first = self._nodes[0].atomicCopy();
+        if (first.nodeType() != .uniform) return null;
+
+        for (self._nodes[1..]) |*node| {
+            if (node.atomicCopy().value != first.value) return null;
+        }
+        return first.uniformState();
+    }
+
     pub fn nodeAt(self: *const Layer, index: TreeLayerIndices.Index) *const Node {
         return &self._nodes[index.index];
     }
@@ -314,9 +1978,28 @@ const Layer = struct {
     pub fn nodeAtMut(self: *Layer, index: TreeLayerIndices.Index) *Node {
         return &self._nodes[index.index];
     }
+
+    pub fn lodAt(self: *const Layer, index: TreeLayerIndices.Index) Lod {
+        return Lod{ .occupancy = self._lodOccupancy[index.index] };
+    }
+
+    pub fn setLodAt(self: *Layer, index: TreeLayerIndices.Index, lod: Lod) void {
+        self._lodOccupancySum = self._lodOccupancySum - self._lodOccupancy[index.index] + lod.occupancy;
+        self._lodOccupancy[index.index] = lod.occupancy;
+    }
+
+    /// Generation of the last change within the node at `index`.
+    pub fn generationAt(self: *const Layer, index: TreeLayerIndices.Index) u64 {
+        return @atomicLoad(u64, &self._generations[index.index], AtomicOrder.Monotonic);
+    }
+
+    /// Combines the level of detail of every node in this layer into one.
+    pub fn summarizeLod(self: *const Layer) Lod {
+        return Lod{ .occupancy = @intCast((self._lodOccupancySum + TREE_NODES_PER_LAYER - 1) / TREE_NODES_PER_LAYER) };
+    }
 };
 
-const NoodleLayer = struct {
+pub const NoodleLayer = struct {
     indices: [tree_layer_indices.TREE_LAYERS]TreeLayerIndices.Index,
     jumpStart: u4 = 0,
     jumpEnd: u4 = 0,
@@ -347,6 +2030,36 @@ const NoodleLayer = struct {
         const allocator = self.layer.allocator;
         allocator.destroy(self);
     }
+
+    /// Removes a reference to this noodle, calling `deinit()` once there are none left.
+    /// The reference count is held by `layer`.
+    pub fn release(self: *NoodleLayer) void {
+        if (self.layer._refCount.fetchSub(1, AtomicOrder.AcqRel) == 1) {
+            self.deinit();
+        }
+    }
+
+    /// Creates a copy of this noodle, sharing all of it's children with it.
+    pub fn clone(self: *const NoodleLayer) Allocator.Error!*NoodleLayer {
+        const allocator = self.layer.allocator;
+        const copy = try allocator.create(NoodleLayer);
+        copy.* = NoodleLayer{
+            .indices = self.indices,
+            .jumpStart = self.jumpStart,
+            .jumpEnd = self.jumpEnd,
+            .layer = Layer.create(allocator, self.layer.treeLayer),
+        };
+        copy.layer.shareChildrenOf(&self.layer);
+        return copy;
+    }
+
+    /// Checks if `position` follows the same path through the layers this noodle skips over.
+    pub fn covers(self: *const NoodleLayer, position: TreeLayerIndices) bool {
+        for (self.jumpStart..self.jumpEnd) |i| {
+            if (!self.indices[i].eql(position.indexAtLayer(i))) return false;
+        }
+        return true;
+    }
 };
 
 test "Node size and align" {
@@ -364,3 +2077,569 @@ test "init deinit FatTree" {
     var tree = try Self.init(std.testing.allocator);
     tree.deinit();
 }
+
+test "insert remove chunk" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const position = TreeLayerIndices{};
+    try inner.insertChunk(try Chunk.init(tree, position));
+    try expect(inner.chunkAt(position) != null);
+    try expect(inner.lodAt(position, 0).?.occupancy == 0);
+    try expect(inner.lodAt(position, TREE_LAYERS - 1).?.occupancy == 0);
+
+    try inner.removeChunk(position);
+    try expect(inner.chunkAt(position) == null);
+    try expect(inner.topNode.nodeType() == .empty); // all layers pruned
+}
+
+test "neighbor links" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const west = BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = false, .west = true };
+    const east = BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = true, .west = false };
+
+    const first = TreeLayerIndices{}; // At the minimum corner of the world
+    const second = first.adjacent(west).?;
+    try expect(first.adjacent(east) == null);
+
+    try inner.insertChunk(try Chunk.init(tree, first));
+    try inner.insertChunk(try Chunk.init(tree, second));
+
+    const firstChunk = inner.chunkAt(first).?;
+    const secondChunk = inner.chunkAt(second).?;
+    try expect(chunkInnerMut(firstChunk).neighbor(west).?.inner == secondChunk.inner);
+    try expect(chunkInnerMut(secondChunk).neighbor(east).?.inner == firstChunk.inner);
+    try expect(chunkInnerMut(firstChunk).neighbor(east) == null);
+
+    try inner.removeChunk(second);
+    try expect(chunkInnerMut(firstChunk).neighbor(west) == null);
+}
+
+test "insert chunks bulk" {
+    const bulkTree = try Self.init(std.testing.allocator);
+    defer bulkTree.deinit();
+    const singleTree = try Self.init(std.testing.allocator);
+    defer singleTree.deinit();
+
+    const west = BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = false, .west = true };
+    const origin = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    var positions: [5]TreeLayerIndices = undefined;
+    positions[0..4].* = testParallelPositions(); // Includes the origin
+    positions[4] = origin.adjacent(west).?;
+
+    const bulk = bulkTree.lockTreeModify();
+    defer bulkTree.unlockTreeModify();
+    const single = singleTree.lockTreeModify();
+    defer singleTree.unlockTreeModify();
+
+    var chunks: [positions.len]Chunk = undefined;
+    for (positions, 0..) |position, i| {
+        chunks[i] = try Chunk.init(bulkTree, position);
+        try single.insertChunk(try Chunk.init(singleTree, position));
+    }
+    try bulk.insertChunksBulk(&chunks);
+
+    try expect(bulk.dirtyChunkCount() == positions.len);
+    for (positions) |position| {
+        const chunk = bulk.chunkAt(position).?;
+        try expect(chunk.unsafeRead().treePos.equal(position));
+        try expect(findChunk(&bulk.topNode, position).?.inner == chunk.inner);
+
+        for (0..TREE_LAYERS) |layer| {
+            const expected = single.lodAt(position, layer).?;
+            const actual = bulk.lodAt(position, layer).?;
+            try expect(actual.occupancy == expected.occupancy);
+        }
+    }
+
+    const center = bulk.chunkAt(origin).?;
+    try expect(chunkInnerMut(center).neighbor(west).?.inner == bulk.chunkAt(positions[4]).?.inner);
+}
+
+fn testParallelPositions() [4]TreeLayerIndices {
+    const min = world_transform.WORLD_MIN_BLOCK_POS;
+    const max = world_transform.WORLD_MAX_BLOCK_POS;
+    return .{
+        (BlockPosition{ .x = min, .y = min, .z = min }).asTreeIndices(),
+        (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices(),
+        (BlockPosition{ .x = max, .y = max, .z = max }).asTreeIndices(),
+        (BlockPosition{ .x = 0, .y = max, .z = min }).asTreeIndices(),
+    };
+}
+
+fn testCountChunk(counter: *Atomic(usize), _: Chunk) void {
+    _ = counter.fetchAdd(1, AtomicOrder.Monotonic);
+}
+
+test "for each chunk parallel" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    var jobs = try JobSystem.init(std.testing.allocator, 2);
+    defer jobs.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    for (testParallelPositions()) |position| {
+        try inner.insertChunk(try Chunk.init(tree, position));
+    }
+
+    var serialCount = Atomic(usize).init(0);
+    inner.forEachChunk(&serialCount, testCountChunk);
+    try expect(serialCount.load(AtomicOrder.Monotonic) == 4);
+
+    var parallelCount = Atomic(usize).init(0);
+    inner.forEachChunkParallel(&jobs, &parallelCount, testCountChunk);
+    try expect(parallelCount.load(AtomicOrder.Monotonic) == 4);
+}
+
+test "deinit parallel" {
+    const tree = try Self.init(std.testing.allocator);
+
+    var jobs = try JobSystem.init(std.testing.allocator, 2);
+    defer jobs.deinit();
+
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        for (testParallelPositions()) |position| {
+            try inner.insertChunk(try Chunk.init(tree, position));
+        }
+    }
+
+    tree.deinitParallel(&jobs); // the testing allocator catches anything leaked
+}
+
+test "uniform fill and promote" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const stone: BlockState = 5;
+    const dirt: BlockState = 6;
+    const position = TreeLayerIndices{};
+    const block = BlockIndex.init(1, 2, 3);
+
+    try inner.fillUniform(position, TREE_LAYERS - 2, stone); // 64 chunks
+    try expect(inner.chunkAt(position) == null);
+    try expect(inner.blockStateAt(position, block) == stone);
+    try expect(inner.lodAt(position, TREE_LAYERS - 2).?.occupancy == 255);
+
+    try inner.setBlockState(position, block, stone);
+    try expect(inner.chunkAt(position) == null); // same state, so nothing allocated
+
+    try inner.setBlockState(position, block, dirt);
+    try expect(inner.chunkAt(position) != null);
+    try expect(inner.blockStateAt(position, block) == dirt);
+    try expect(inner.blockStateAt(position, BlockIndex.init(0, 0, 0)) == stone);
+
+    try inner.fillUniform(position, TREE_LAYERS - 2, AIR_BLOCK_STATE);
+    try expect(inner.chunkAt(position) == null);
+    try expect(inner.topNode.nodeType() == .empty);
+}
+
+test "collect garbage uniform chunk" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const stone: BlockState = 5;
+    const position = TreeLayerIndices{};
+    const block = BlockIndex.init(1, 2, 3);
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+
+        try inner.fillUniform(position, TREE_LAYERS - 2, stone);
+        try inner.setBlockState(position, block, 6);
+        try inner.setBlockState(position, block, stone);
+        try expect(inner.chunkAt(position) != null);
+    }
+
+    try expect(tree.collectGarbage(1_000_000) == 1);
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+    try expect(inner.chunkAt(position) == null);
+    try expect(inner.blockStateAt(position, block) == stone);
+
+    // The chunk layer was merged back into a single uniform node
+    var path = Path{};
+    try expect(!try inner.findPath(position, &path));
+    try expect(path.len == TREE_LAYERS - 1);
+}
+
+test "snapshot copy on write" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const position = TreeLayerIndices{};
+    const block = BlockIndex.init(1, 2, 3);
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.setBlockState(position, block, 5);
+    }
+
+    var snap = tree.snapshot();
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+
+        try inner.setBlockState(position, block, 6);
+        try expect(inner.blockStateAt(position, block) == 6);
+        try expect(snap.blockStateAt(position, block) == 5);
+        try expect(snap.chunkAt(position).?.inner != inner.chunkAt(position).?.inner);
+
+        try inner.removeChunk(position);
+        try expect(inner.chunkAt(position) == null);
+    }
+
+    try expect(snap.chunkAt(position) != null);
+    try expect(snap.blockStateAt(position, block) == 5);
+    snap.release(); // the testing allocator catches anything leaked
+}
+
+test "snapshot shares untouched layers" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const first = TreeLayerIndices{};
+    const second = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.insertChunk(try Chunk.init(tree, first));
+        try inner.insertChunk(try Chunk.init(tree, second));
+    }
+
+    var snap = tree.snapshot();
+    defer snap.release();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const untouched = inner.chunkAt(second).?;
+    try expect((try inner.writableChunk(first)) != null);
+    try expect(snap.chunkAt(first).?.inner != inner.chunkAt(first).?.inner);
+    try expect(snap.chunkAt(second).?.inner == untouched.inner); // still shared
+}
+
+test "stats" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const position = TreeLayerIndices{};
+    const chunkKind = @intFromEnum(tree_stats.NodeKind.chunk);
+    const emptyKind = @intFromEnum(tree_stats.NodeKind.empty);
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.setBlockState(position, BlockIndex.init(1, 2, 3), 5);
+    }
+
+    var treeStats = tree.stats();
+    for (0..TREE_LAYERS) |i| {
+        try expect(treeStats.layers[i] == 1);
+    }
+    try expect(treeStats.nodes[0][@intFromEnum(tree_stats.NodeKind.childLayer)] == 1);
+    try expect(treeStats.nodes[TREE_LAYERS - 1][chunkKind] == 1);
+    try expect(treeStats.nodes[TREE_LAYERS - 1][emptyKind] == TREE_NODES_PER_LAYER - 1);
+    try expect(treeStats.chunksByBitWidth[@intFromEnum(BlockStateIndices.IndexBitWidth.b1)] == 1);
+    try expect(treeStats.paletteEntries == 2);
+    try expect(treeStats.map.chunks == 1);
+    try expect(treeStats.bytes.chunks == @sizeOf(Chunk.Inner));
+    try expect(treeStats.bytes.layers == TREE_LAYERS * @sizeOf(Layer));
+    try expect(tree.bytesUsed() == treeStats.bytes.total());
+
+    var higher = position;
+    higher.setIndexAtLayer(2, .{ .index = 1 });
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.fillUniform(higher, 3, 7);
+        try inner.removeChunk(position);
+    }
+
+    treeStats = tree.stats();
+    try expect(treeStats.layers[3] == 1);
+    try expect(treeStats.layers[4] == 0);
+    try expect(treeStats.nodes[3][@intFromEnum(tree_stats.NodeKind.uniform)] == 1);
+    try expect(treeStats.nodes[TREE_LAYERS - 1][chunkKind] == 0);
+    try expect(treeStats.map.chunks == 0);
+    try expect(tree.bytesUsed() == treeStats.bytes.total());
+}
+
+test "pinned read" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const position = TreeLayerIndices{};
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.insertChunk(try Chunk.init(tree, position));
+    }
+
+    const reader = tree.pinRead();
+    try expect(reader.chunkAt(position) != null);
+
+    {
+        // Does not wait for the reader
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.removeChunk(position);
+    }
+
+    try expect(reader.chunkAt(position) == null);
+    reader.unpin();
+    tree.reclaimRetired();
+}
+
+/// Chunks each thread inserts into it's own subtree in "subtree modify concurrently".
+const TEST_SUBTREE_CHUNKS = 16;
+
+fn testSubtreePosition(base: TreeLayerIndices, i: usize) TreeLayerIndices {
+    var position = base;
+    position.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i) });
+    return position;
+}
+
+/// Inserts every chunk, then removes every other one.
+fn testStreamSubtree(tree: *Self, base: TreeLayerIndices) void {
+    testStreamSubtreeFallible(tree, base) catch @panic("Out of memory");
+}
+
+fn testStreamSubtreeFallible(tree: *Self, base: TreeLayerIndices) Allocator.Error!void {
+    for (0..TEST_SUBTREE_CHUNKS) |i| {
+        const position = testSubtreePosition(base, i);
+        const subtree = try tree.lockSubtreeModify(position);
+        defer tree.unlockSubtreeModify(subtree);
+        try subtree.insertChunk(try Chunk.init(tree, position));
+    }
+    for (0..TEST_SUBTREE_CHUNKS / 2) |i| {
+        const position = testSubtreePosition(base, i * 2);
+        const subtree = try tree.lockSubtreeModify(position);
+        defer tree.unlockSubtreeModify(subtree);
+        try subtree.removeChunk(position);
+        assert(subtree.chunkAt(position) == null);
+    }
+}
+
+test "subtree modify concurrently" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    // Each position is in a different subtree.
+    const positions = testParallelPositions();
+    var threads: [positions.len]std.Thread = undefined;
+    for (&threads, positions) |*thread, position| {
+        thread.* = try std.Thread.spawn(.{}, testStreamSubtree, .{ tree, position });
+    }
+    for (threads) |thread| {
+        thread.join();
+    }
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    var count = Atomic(usize).init(0);
+    inner.forEachChunk(&count, testCountChunk);
+    try expect(count.load(AtomicOrder.Monotonic) == positions.len * TEST_SUBTREE_CHUNKS / 2);
+    for (positions) |base| {
+        for (0..TEST_SUBTREE_CHUNKS) |i| {
+            const chunk = inner.chunkAt(testSubtreePosition(base, i));
+            try expect((chunk != null) == (i % 2 == 1));
+        }
+    }
+    try expect(inner.counters.nodes[TREE_LAYERS - 1][@intFromEnum(tree_stats.NodeKind.chunk)].load(AtomicOrder.Monotonic) == count.load(AtomicOrder.Monotonic));
+}
+
+test "subtree modify keeps snapshot" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const position = TreeLayerIndices{};
+    var before = tree.snapshot();
+    defer before.release();
+
+    // The top layer is created, as the tree is empty.
+    {
+        const subtree = try tree.lockSubtreeModify(position);
+        defer tree.unlockSubtreeModify(subtree);
+        try subtree.insertChunk(try Chunk.init(tree, position));
+    }
+
+    var later = tree.snapshot();
+    defer later.release();
+
+    // The top layer is now shared with `later`, so it's copied.
+    {
+        const subtree = try tree.lockSubtreeModify(position);
+        defer tree.unlockSubtreeModify(subtree);
+        try subtree.removeChunk(position);
+    }
+
+    try expect(before.chunkAt(position) == null);
+    try expect(later.chunkAt(position) != null);
+    try expect(tree.lockChunkModify().chunkAt(position) == null);
+    tree.unlockChunkModify();
+}
+
+test "collect garbage air chunk" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const position = TreeLayerIndices{};
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        try inner.insertChunk(try Chunk.init(tree, position));
+    }
+
+    try expect(tree.collectGarbage(1_000_000) == 1);
+
+    const inner = tree.lockChunkModify();
+    defer tree.unlockChunkModify();
+    try expect(inner.chunkAt(position) == null);
+    try expect(inner.dirtyChunkCount() == 0);
+    try expect(inner.topNode.nodeType() == .empty);
+}
+
+test "collect garbage finishes rehashing" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    var positions: [64]TreeLayerIndices = undefined;
+    {
+        const inner = tree.lockTreeModify();
+        defer tree.unlockTreeModify();
+        for (&positions, 0..) |*position, i| {
+            position.* = TreeLayerIndices{};
+            position.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i) });
+            try inner.insertChunk(try Chunk.init(tree, position.*));
+            // Not uniform, so isn't collected.
+            try inner.setBlockState(position.*, BlockIndex.init(0, 0, 0), 1);
+        }
+        try inner.chunks.reserve(4096);
+        try expect(inner.chunks.isRehashing());
+    }
+
+    try expect(tree.collectGarbage(1_000_000) == 0);
+
+    const inner = tree.lockChunkModify();
+    defer tree.unlockChunkModify();
+    try expect(!inner.chunks.isRehashing());
+    for (positions) |position| {
+        try expect(inner.chunkAt(position) != null);
+    }
+}
+
+test "dirty chunks are queued once" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const position = TreeLayerIndices{};
+    try inner.insertChunk(try Chunk.init(tree, position));
+    for (0..8) |i| {
+        try inner.setBlockState(position, BlockIndex.init(@intCast(i), 0, 0), 1);
+    }
+    try inner.markChunkDirty(position);
+    try expect(inner.dirtyChunkCount() == 1);
+
+    try inner.markChunkDirty(position.adjacent(BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = false, .west = true }).?);
+    try expect(inner.dirtyChunkCount() == 2);
+}
+
+test "diff since generation" {
+    const tree = try Self.init(std.testing.allocator);
+    defer tree.deinit();
+
+    const inner = tree.lockTreeModify();
+    defer tree.unlockTreeModify();
+
+    const stone: BlockState = 5;
+    const corners = testParallelPositions();
+    const written = (BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    const removed = (BlockPosition{ .x = world_transform.CHUNK_LENGTH, .y = 0, .z = 0 }).asTreeIndices(); // same deepest layer
+    const untouched = corners[0];
+    const added = corners[2];
+
+    try inner.insertChunk(try Chunk.init(tree, written));
+    try inner.insertChunk(try Chunk.init(tree, removed));
+    try inner.insertChunk(try Chunk.init(tree, untouched));
+
+    const since = inner.generation();
+    var unchanged = inner.diff(since);
+    try expect(unchanged.next() == null);
+
+    try inner.setBlockState(written, BlockIndex.init(1, 2, 3), stone);
+    try inner.removeChunk(removed);
+    try inner.insertChunk(try Chunk.init(tree, added));
+    // The new layers, the chunk, and the stamp along it's path all share the one generation the insert reserved.
+    try expect(chunkInnerMut(inner.chunkAt(added).?).insertedGeneration == inner.generation());
+    try expect(inner.topNode.childLayer().nodeAt(added.indexAtLayer(0)).descend(added).?._createdGeneration == inner.generation());
+
+    var modifiedCount: usize = 0;
+    var addedCount: usize = 0;
+    var removedChunk = false;
+    var iter = inner.diff(since);
+    while (iter.next()) |change| {
+        switch (change.kind) {
+            .added => {
+                addedCount += 1;
+                try expect(change.chunk.?.unsafeRead().treePos.equal(added));
+            },
+            .modified => {
+                modifiedCount += 1;
+                try expect(change.chunk.?.unsafeRead().treePos.equal(written));
+            },
+            // Also reports the new layers leading to `added`.
+            .removed => if (change.layer == TREE_LAYERS - 1) {
+                try expect(change.position.equal(removed));
+                removedChunk = true;
+            },
+            .filled => return error.UnexpectedChange,
+        }
+    }
+    try expect(addedCount == 1);
+    try expect(modifiedCount == 1);
+    try expect(removedChunk);
+
+    const later = inner.generation();
+    try inner.fillUniform(untouched, TREE_LAYERS - 1, stone);
+    iter = inner.diff(later);
+    const filled = iter.next().?;
+    try expect(filled.kind == .filled and filled.state == stone);
+    try expect(filled.layer == TREE_LAYERS - 1 and filled.position.equal(untouched));
+    try expect(iter.next() == null);
+}
+
+test "Layer summarize lod" {
+    var allocator = std.testing.allocator;
+    const layer = try Layer.init(&allocator, 0);
+    defer layer.deinit();
+
+    try expect(layer.summarizeLod().occupancy == 0);
+
+    layer.setLodAt(.{ .index = 0 }, Lod.FULL);
+    layer.setLodAt(.{ .index = 1 }, .{ .occupancy = 1 });
+
+    try expect(layer.summarizeLod().occupancy == 4); // (255 + 1) / 64 rounded up
+
+    layer.setLodAt(.{ .index = 0 }, .{ .occupancy = 0 });
+    try expect(layer.summarizeLod().occupancy == 1);
+}
@@ -1,30 +1,110 @@
 //! Spatial hashing for the active chunks owned by the `FatTree`.
 //! Allows extremely fast fetching of chunks, without having
 //! to traverse the entire tree structure.
+//!
+//! Each group holds a control byte per entry, either 0 for an empty entry, or a set flag with 7 bits of the hash.
+//! Groups are probed by comparing `PROBE_WIDTH` control bytes at once against the wanted control byte,
+//! and only checking the keys of the entries that match.
+//!
+//! Keys and chunks are stored inline within each group, after it's control bytes, so inserting and erasing
+//! never allocate, and a hit only touches the control bytes and the single cache line of it's entry.
+//!
+//! The map grows by doubling it's groups, but entries are not moved all at once. The old groups are kept
+//! alongside the new ones, and moved a few at a time by each insert, or by `rehash()`, so no single insert
+//! takes time proportional to the size of the map. Lookups check the new group first, then the old one.
+//!
+//! Erasing clears the control byte, leaving no tombstone, as every probe checks the whole group anyway.
+//! Groups that erasing leaves sparse halve their capacity, and the map shrinks it's groups the same way
+//! it grows them once it's sparse, so memory and probe lengths follow the chunks currently loaded,
+//! rather than the most ever loaded. `shrinkToFit()` does all of it at once.
 
 const std = @import("std");
+const builtin = @import("builtin");
 const Allocator = std.mem.Allocator;
-const Chunk = @import("../chunk/chunk.zig");
-const TreeLayerIndices = @import("tree_layer_indices.zig").TreeLayerIndices;
+const Chunk = @import("../chunk/Chunk.zig");
+const tree_layer_indices = @import("tree_layer_indices.zig");
+const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
+const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
 const FatTree = @import("FatTree.zig");
+const MapStats = @import("tree_stats.zig").MapStats;
 const assert = std.debug.assert;
 const expect = std.testing.expect;
 
 const Self = @This();
 
+/// Number of control bytes compared at once when probing a group. The widest vector the target has
+/// byte compares for, as a group's capacity is always a multiple of 64.
+pub const PROBE_WIDTH = blk: {
+    const cpu = builtin.cpu;
+    if (cpu.arch == .x86_64) {
+        if (std.Target.x86.featureSetHas(cpu.features, .avx512bw)) break :blk 64;
+        if (std.Target.x86.featureSetHas(cpu.features, .avx2)) break :blk 32;
+    }
+    break :blk 16;
+};
+/// One bit for each control byte compared by `matchControlBytes()`.
+const ProbeMask = std.meta.Int(.unsigned, PROBE_WIDTH);
+
+/// Low bits of a Morton code dropped to choose a group in `GroupMode.spatial`, so each 2x2x2 cell
+/// of chunks shares a group, and consecutive cells use consecutive groups.
+const MORTON_CELL_BITS = 3;
+/// Average entries per group past which the map grows, as 75% of a group's initial capacity.
+const MAX_GROUP_LOAD = Group.GROUP_ALLOC_SIZE / 4 * 3;
+/// Average entries per group right after growing.
+const GROWN_GROUP_LOAD = MAX_GROUP_LOAD / 2;
+/// Average entries per group below which the map shrinks. Growing and shrinking both resize to `GROWN_GROUP_LOAD`,
+/// which is 4 times this, and half of `MAX_GROUP_LOAD`, so a map that just resized is far from resizing again either way.
+const MIN_GROUP_LOAD = GROWN_GROUP_LOAD / 4;
+/// Keys resolved together by `findMany()`. Enough to keep many cache misses in flight,
+/// while the per key state stays in registers and the stack.
+const FIND_MANY_BATCH = 16;
+/// Old groups moved into the new groups by each insert while resizing.
+/// The map grows by doubling, so resizing always finishes long before the next one is needed.
+const REHASH_GROUPS_PER_INSERT = 2;
+
+/// How chunks are assigned to groups.
+pub const GroupMode = enum {
+    /// By the hash of the chunk's position, spreading chunks evenly over the groups wherever they are.
+    hashed,
+    /// By the Morton code of the chunk's position, so neighboring chunks share the same or adjacent groups,
+    /// and lookups of chunks near each other, such as while meshing, lighting, or raycasting, touch fewer cache lines.
+    /// Groups are less evenly filled, as loaded chunks are rarely spread evenly through space.
+    /// Entries are still found within each group by the hash of the position.
+    spatial,
+};
+
 groups: []Group,
+/// The groups from before the last resize, which are moved into `groups` a few at a time
+/// rather than all at once. Empty once every one of them has been moved.
+_oldGroups: []Group,
+/// Number of `_oldGroups` that have been moved into `groups`, and freed.
+_rehashed: usize = 0,
 chunkCount: usize = 0,
+/// Total entries every group has memory for. Kept up to date for `stats()`.
+slotCount: usize = 0,
 allocator: *Allocator, // NOTE this field may be unnecessary, as the `Inner` owning this has a reference to the same allocator
+mode: GroupMode,
 
 pub fn init(allocator: *Allocator) Self {
+    return initWithMode(allocator, .hashed);
+}
+
+pub fn initWithMode(allocator: *Allocator, mode: GroupMode) Self {
     var slice: []Group = undefined;
     slice.len = 0;
-    return Self{ .groups = slice, .allocator = allocator };
+    return Self{ .groups = slice, ._oldGroups = slice, .allocator = allocator, .mode = mode };
 }
 
 /// Does not call deinit on the chunks, since this map only stores references to them.
 pub fn deinit(self: Self) void {
-    if (self.chunkCount == 0) {
+    if (self._oldGroups.len > 0) {
+        for (self._oldGroups[self._rehashed..]) |group| {
+            group.deinit(self.allocator);
+        }
+        self.allocator.free(self._oldGroups);
+    }
+
+    if (self.groups.len == 0) {
         return;
     }
 
@@ -39,148 +119,311 @@ pub fn find(self: Self, key: TreeLayerIndices) ?Chunk {
         return null;
     }
 
-    const hashCode = key.hash();
-    const groupBitmask = HashGroupBitmask.init(hashCode);
-    const groupIndex = @mod(groupBitmask.value, self.groups.len);
+    const slot = self.locate(key, key.hash()) orelse return null;
+    return slot.group.entries[slot.index].value;
+}
 
-    const found = self.groups[groupIndex].find(key, hashCode);
-    if (found == null) {
-        return null;
+/// Same as calling `find()` for each of `keys`, writing the results to `outChunks`, which must be the same length.
+/// Rather than each lookup waiting on memory one after another, keys are resolved in batches of `FIND_MANY_BATCH`.
+/// Every key in a batch is hashed and it's group is prefetched, then each group's control bytes are prefetched,
+/// then the first matching entry of each, before any key is compared, so their cache misses overlap.
+/// Useful when many chunks are needed at once, such as the neighborhoods of chunks being meshed or lit.
+pub fn findMany(self: Self, keys: []const TreeLayerIndices, outChunks: []?Chunk) void {
+    assert(keys.len == outChunks.len);
+    if (self.chunkCount == 0) {
+        @memset(outChunks, null);
+        return;
     }
 
-    return self.groups[groupIndex].pairs[found.?].value;
+    var start: usize = 0;
+    while (start < keys.len) : (start += FIND_MANY_BATCH) {
+        const end = @min(start + FIND_MANY_BATCH, keys.len);
+        const batchKeys = keys[start..end];
+
+        var hashCodes: [FIND_MANY_BATCH]usize = undefined;
+        var batchGroups: [FIND_MANY_BATCH]*const Group = undefined;
+        for (batchKeys, 0..) |key, i| {
+            hashCodes[i] = key.hash();
+            batchGroups[i] = &self.groups[groupIndex(self.groupBits(key, hashCodes[i]), self.groups.len)];
+            @prefetch(batchGroups[i], .{});
+        }
+
+        for (0..batchKeys.len) |i| {
+            const group = batchGroups[i];
+            if (group.capacity > 0) {
+                @prefetch(group.hashMasks, .{});
+            }
+        }
+
+        for (0..batchKeys.len) |i| {
+            const group = batchGroups[i];
+            if (group.capacity == 0) {
+                continue;
+            }
+            const matches = matchControlBytes(group.hashMasks, 0, HashPairBitmask.init(hashCodes[i]).value);
+            if (matches != 0) {
+                @prefetch(&group.entries[@ctz(matches)], .{});
+            }
+        }
+
+        for (batchKeys, 0..) |key, i| {
+            const slot = self.locate(key, hashCodes[i]);
+            outChunks[start + i] = if (slot) |found| found.group.entries[found.index].value else null;
+        }
+    }
 }
 
 /// Trying to add a duplicate entry is strictly not allowed, because it is not allowed by the FatTree.
 /// Asserts the entry doesn't already exist.
+/// While resizing, also moves up to `REHASH_GROUPS_PER_INSERT` of the old groups into the new ones.
 pub fn insert(self: *Self, key: TreeLayerIndices, value: Chunk) Allocator.Error!void {
     if (self.shouldReallocate(self.chunkCount + 1)) {
         try self.reallocate(self.chunkCount + 1);
     }
+    _ = try self.rehash(REHASH_GROUPS_PER_INSERT);
 
     const hashCode = key.hash();
-    const groupBitmask = HashGroupBitmask.init(hashCode);
-    const groupIndex = @mod(groupBitmask.value, self.groups.len);
-
-    try self.groups[groupIndex].insert(key, value, hashCode, self.allocator);
+    try self.insertIntoGroup(&self.groups[groupIndex(self.groupBits(key, hashCode), self.groups.len)], key, value, hashCode);
     self.chunkCount += 1;
 }
 
+/// Grows the map once so that `additional` more chunks can be inserted without reallocating,
+/// such as before inserting many chunks at once.
+pub fn reserve(self: *Self, additional: usize) Allocator.Error!void {
+    const requiredCapacity = self.chunkCount + additional;
+    if (self.shouldReallocate(requiredCapacity)) {
+        try self.reallocate(requiredCapacity);
+    }
+}
+
+/// Replaces the chunk mapped to `key` with `value`, such as when the `FatTree` copies a chunk shared with a snapshot.
+/// Asserts that the entry exists.
+pub fn replace(self: *Self, key: TreeLayerIndices, value: Chunk) void {
+    if (self.chunkCount == 0) {
+        @panic("Cannot replace chunk entry that is not mapped");
+    }
+
+    const slot = self.locate(key, key.hash()) orelse @panic("Cannot replace chunk entry that is not mapped");
+    slot.group.entries[slot.index].value = value;
+}
+
 /// Erase a chunk reference entry from the cached map.
 /// Asserts that the entry exists.
 pub fn erase(self: *Self, key: TreeLayerIndices) void {
     if (self.chunkCount == 0) return;
 
-    const hashCode = key.hash();
-    const groupBitmask = HashGroupBitmask.init(hashCode);
-    const groupIndex = @mod(groupBitmask.value, self.groups.len);
-
-    const result = self.groups[groupIndex].erase(key, hashCode, self.allocator);
+    const slot = self.locate(key, key.hash()) orelse @panic("Cannot erase chunk entry that is not mapped");
+    slot.group.eraseAt(slot.index);
     self.chunkCount -= 1;
-    if (result == false) {
-        @panic("Cannot erase chunk entry that is not mapped");
+
+    // Both need memory, so are skipped when out of it, and tried again on the next erase.
+    if (slot.group.capacity > Group.GROUP_ALLOC_SIZE and slot.group.pairCount <= slot.group.capacity / 4) {
+        self.reallocateGroup(slot.group, slot.group.capacity / 2) catch {};
+    }
+    if (self.isRehashing()) {
+        _ = self.rehash(REHASH_GROUPS_PER_INSERT) catch false;
+    } else if (self.groups.len > 1 and self.chunkCount < self.groups.len * MIN_GROUP_LOAD) {
+        self.resize(calculateNewGroupCount(self.chunkCount)) catch {};
     }
 }
 
-fn shouldReallocate(self: Self, requiredCapacity: usize) bool {
-    if (self.groups.len == 0) {
-        return true;
+/// Shrinks the groups and their memory to the minimum needed for the chunks currently mapped,
+/// such as after unloading most of the world. Finishes any resize in progress.
+pub fn shrinkToFit(self: *Self) Allocator.Error!void {
+    _ = try self.rehash(std.math.maxInt(usize));
+    if (self.chunkCount == 0) {
+        self.deinit();
+        self.* = Self.initWithMode(self.allocator, self.mode);
+        return;
     }
 
-    const loadFactorScaledPairCount = @shrExact(self.chunkCount & ~@as(usize, 0b11), 2) * 3; // multiply by 0.75
-    return requiredCapacity > loadFactorScaledPairCount;
+    const fittedGroupCount = calculateNewGroupCount(self.chunkCount);
+    if (fittedGroupCount < self.groups.len) {
+        try self.resize(fittedGroupCount);
+        _ = try self.rehash(std.math.maxInt(usize));
+    }
+
+    for (self.groups) |*group| {
+        const fittedCapacity = if (group.pairCount == 0)
+            0
+        else
+            std.math.ceilPowerOfTwoAssert(usize, std.math.divCeil(usize, group.pairCount, Group.GROUP_ALLOC_SIZE) catch unreachable) * Group.GROUP_ALLOC_SIZE;
+        if (fittedCapacity < group.capacity) {
+            try self.reallocateGroup(group, fittedCapacity);
+        }
+    }
 }
 
-fn reallocate(self: *Self, requiredCapacity: usize) Allocator.Error!void {
-    const newGroupCount = calculateNewGroupCount(requiredCapacity);
-    if (newGroupCount <= self.groups.len) {
-        return;
+/// Moves up to `maxGroups` of the groups from before the last resize into the current groups,
+/// such as once per frame to finish resizing sooner than inserts alone would.
+/// Returns true once every old group has been moved.
+pub fn rehash(self: *Self, maxGroups: usize) Allocator.Error!bool {
+    var remaining = maxGroups;
+    while (self._rehashed < self._oldGroups.len and remaining > 0) : (remaining -= 1) {
+        try self.rehashGroup(&self._oldGroups[self._rehashed]);
+        self._rehashed += 1;
     }
 
-    const newGroups = try self.allocator.alloc(Group, newGroupCount);
-    for (0..newGroups.len) |i| {
-        newGroups[i] = try Group.init(self.allocator);
+    if (self._rehashed < self._oldGroups.len) {
+        return false;
+    }
+    if (self._oldGroups.len > 0) {
+        self.allocator.free(self._oldGroups);
+        self._oldGroups.len = 0;
+        self._rehashed = 0;
     }
+    return true;
+}
 
-    for (self.groups) |oldGroup| {
-        for (0..oldGroup.capacity) |i| {
-            if (oldGroup.hashMasks[i] == 0) {
-                continue;
-            }
+/// Whether old groups from before the last resize are still being moved. See `rehash()`.
+pub fn isRehashing(self: *const Self) bool {
+    return self._oldGroups.len > 0;
+}
 
-            const pair = oldGroup.pairs[i];
-            const hashCode = pair.key.hash();
-            const groupBitmask = HashGroupBitmask.init(hashCode);
-            const groupIndex = @mod(groupBitmask.value, self.groups.len);
+/// Occupancy and memory usage of this map, from counters rather than walking every group.
+/// While resizing, the old groups still count towards the slots and bytes.
+pub fn stats(self: *const Self) MapStats {
+    return MapStats{
+        .chunks = self.chunkCount,
+        .groups = self.groups.len,
+        .slots = self.slotCount,
+        .bytes = (self.groups.len + self._oldGroups.len) * @sizeOf(Group) + calculateChunksHashGroupAllocationSize(self.slotCount),
+    };
+}
 
-            const newGroup = &newGroups[groupIndex];
+const Slot = struct {
+    group: *Group,
+    index: usize,
+};
 
-            if (newGroup.pairCount == newGroup.capacity) {
-                try newGroup.reallocate(newGroup.capacity * 2, self.allocator);
-            }
+/// Where `key` is mapped, or null if it is not. While resizing, `key` may still be in an old group.
+fn locate(self: Self, key: TreeLayerIndices, hashCode: usize) ?Slot {
+    const bits = self.groupBits(key, hashCode);
+    const group = &self.groups[groupIndex(bits, self.groups.len)];
+    if (group.find(key, hashCode)) |index| {
+        return Slot{ .group = group, .index = index };
+    }
+    if (self._oldGroups.len == 0) {
+        return null;
+    }
+
+    const oldIndex = groupIndex(bits, self._oldGroups.len);
+    if (oldIndex < self._rehashed) {
+        return null;
+    }
+    const oldGroup = &self._oldGroups[oldIndex];
+    const index = oldGroup.find(key, hashCode) orelse return null;
+    return Slot{ .group = oldGroup, .index = index };
+}
 
-            newGroup.hashMasks[newGroup.pairCount] = oldGroup.hashMasks[i];
-            newGroup.pairs[newGroup.pairCount] = pair;
-            newGroup.pairCount += 1;
+fn reallocateGroup(self: *Self, group: *Group, newCapacity: usize) Allocator.Error!void {
+    const oldCapacity = group.capacity;
+    try group.reallocate(newCapacity, self.allocator);
+    self.slotCount = self.slotCount - oldCapacity + newCapacity;
+}
+
+fn insertIntoGroup(self: *Self, group: *Group, key: TreeLayerIndices, value: Chunk, hashCode: usize) Allocator.Error!void {
+    const oldCapacity = group.capacity;
+    try group.insert(key, value, hashCode, self.allocator);
+    self.slotCount += group.capacity - oldCapacity;
+}
+
+/// Moves every entry of `oldGroup` into `groups`, then frees it. Every entry is only ever in one group,
+/// so if moving fails part way through, the remaining entries are simply moved next time.
+fn rehashGroup(self: *Self, oldGroup: *Group) Allocator.Error!void {
+    for (0..oldGroup.capacity) |i| {
+        if (oldGroup.hashMasks[i] == 0) {
+            continue;
         }
 
-        const currentAllocationSize = calculateChunksHashGroupAllocationSize(oldGroup.capacity);
+        const entry = oldGroup.entries[i];
+        const hashCode = entry.key.hash();
+        try self.insertIntoGroup(&self.groups[groupIndex(self.groupBits(entry.key, hashCode), self.groups.len)], entry.key, entry.value, hashCode);
+        oldGroup.eraseAt(i);
+    }
 
-        var allocSlice: []align(64) u8 = undefined;
-        allocSlice.ptr = oldGroup.hashMasks;
-        allocSlice.len = currentAllocationSize;
+    self.slotCount -= oldGroup.capacity;
+    oldGroup.deinit(self.allocator);
+    oldGroup.* = Group.init();
+}
 
-        self.allocator.free(allocSlice);
+fn shouldReallocate(self: Self, requiredCapacity: usize) bool {
+    if (self.groups.len == 0) {
+        return true;
     }
 
-    if (self.groups.len > 0) {
-        self.allocator.free(self.groups);
+    return requiredCapacity > self.groups.len * MAX_GROUP_LOAD;
+}
+
+/// Replaces the groups with enough for `requiredCapacity`, without moving any entries. The old groups
+/// are moved by `rehash()` over the following inserts. New groups only allocate once inserted into,
+/// so this takes time proportional to the number of groups, rather than the number of entries.
+fn reallocate(self: *Self, requiredCapacity: usize) Allocator.Error!void {
+    const newGroupCount = calculateNewGroupCount(requiredCapacity);
+    if (newGroupCount <= self.groups.len) {
+        return;
     }
+    try self.resize(newGroupCount);
+}
+
+/// Replaces the groups with `newGroupCount` groups, growing or shrinking the map. See `reallocate()`.
+fn resize(self: *Self, newGroupCount: usize) Allocator.Error!void {
+    // Only one resize is in progress at a time. Resizing by a factor of 2 or more means this is only reached
+    // early by `reserve()`, or `shrinkToFit()`.
+    _ = try self.rehash(std.math.maxInt(usize));
+
+    const newGroups = try self.allocator.alloc(Group, newGroupCount);
+    @memset(newGroups, Group.init());
 
+    if (self.groups.len > 0) {
+        self._oldGroups = self.groups;
+        self._rehashed = 0;
+    }
     self.groups = newGroups;
 }
 
 fn calculateNewGroupCount(requiredCapacity: usize) usize {
-    if (requiredCapacity < Group.GROUP_ALLOC_SIZE) {
-        return 1;
-    } else {
-        const out = requiredCapacity / (Group.GROUP_ALLOC_SIZE / 16);
-        return out;
-    }
+    return @max(1, std.math.divCeil(usize, requiredCapacity, GROWN_GROUP_LOAD) catch unreachable);
+}
+
+/// Bits choosing the group of `key`, depending on the `GroupMode`. See `groupIndex()`.
+fn groupBits(self: Self, key: TreeLayerIndices, hashCode: usize) usize {
+    return switch (self.mode) {
+        .hashed => HashGroupBitmask.init(hashCode).value,
+        .spatial => @truncate(key.mortonCode() >> MORTON_CELL_BITS),
+    };
 }
 
-const Group = struct {
-    const GROUP_ALLOC_SIZE = 64;
-    const INITIAL_ALLOCATION_SIZE = calculateChunksHashGroupAllocationSize(64);
+fn groupIndex(bits: usize, groupCount: usize) usize {
+    return @mod(bits, groupCount);
+}
+
+pub const Group = struct {
+    pub const GROUP_ALLOC_SIZE = 64;
     const ALIGNMENT = 64;
 
     hashMasks: [*]align(64) u8,
-    pairs: [*]*Pair,
+    /// Parallel to `hashMasks`, directly after them within the same allocation.
+    entries: [*]Entry,
     pairCount: usize = 0,
-    capacity: usize = GROUP_ALLOC_SIZE,
+    capacity: usize,
 
-    fn init(allocator: *Allocator) Allocator.Error!Group {
-        const memory = try allocator.alignedAlloc(u8, ALIGNMENT, INITIAL_ALLOCATION_SIZE);
-        @memset(memory, 0);
-
-        const hashMasks = memory.ptr;
-        const pairs: [*]*Pair = @ptrCast(memory.ptr + GROUP_ALLOC_SIZE);
+    /// Aligned so an entry never straddles two cache lines.
+    pub const Entry = struct {
+        key: TreeLayerIndices align(32),
+        value: Chunk,
+    };
 
-        return Group{
-            .hashMasks = hashMasks,
-            .pairs = pairs,
-        };
+    /// Nothing is allocated until the first entry is inserted.
+    fn init() Group {
+        return Group{ .hashMasks = undefined, .entries = undefined, .capacity = 0 };
     }
 
+    /// The chunks referenced by the entries are not deinitialized.
     fn deinit(self: Group, allocator: *Allocator) void {
-        for (0..self.capacity) |i| {
-            if (self.hashMasks[i] == 0) {
-                continue;
-            }
-
-            allocator.destroy(self.pairs[i]);
+        if (self.capacity == 0) {
+            return;
         }
-
         const currentAllocationSize = calculateChunksHashGroupAllocationSize(self.capacity);
 
         var allocSlice: []align(64) u8 = undefined;
@@ -191,26 +434,23 @@ const Group = struct {
     }
 
     fn find(self: Group, key: TreeLayerIndices, hashCode: usize) ?usize {
-        // TODO avx
-
-        //const iterationCount = self.capacity / GROUP_ALLOC_SIZE;
-
         const mask = HashPairBitmask.init(hashCode);
 
-        for (0..self.capacity) |i| {
-            if (self.hashMasks[i] != mask.value) {
-                continue;
-            }
-
-            if (self.pairs[i].key.equal(key)) {
-                return i;
+        var offset: usize = 0;
+        while (offset < self.capacity) : (offset += PROBE_WIDTH) {
+            var matches = matchControlBytes(self.hashMasks, offset, mask.value);
+            while (matches != 0) : (matches &= matches - 1) {
+                const i = offset + @ctz(matches);
+                if (self.entries[i].key.equal(key)) {
+                    return i;
+                }
             }
         }
 
         return null;
     }
 
-    /// Asserts that the entry doesn't exist.
+    /// Asserts that the entry doesn't exist. Only allocates if the group is full.
     fn insert(self: *Group, key: TreeLayerIndices, value: Chunk, hashCode: usize, allocator: *Allocator) Allocator.Error!void {
         const mask = HashPairBitmask.init(hashCode);
 
@@ -222,21 +462,19 @@ const Group = struct {
         }
 
         if (self.pairCount == self.capacity) {
-            try self.reallocate(self.capacity * 2, allocator);
+            try self.reallocate(@max(GROUP_ALLOC_SIZE, self.capacity * 2), allocator);
         }
 
-        // TODO avx
-        for (0..self.capacity) |i| {
-            if (self.hashMasks[i] != 0) {
+        var offset: usize = 0;
+        while (offset < self.capacity) : (offset += PROBE_WIDTH) {
+            const empty = matchControlBytes(self.hashMasks, offset, 0);
+            if (empty == 0) {
                 continue;
             }
 
-            const newPair = try allocator.create(Pair);
-            newPair.key = key;
-            newPair.value = value;
-
+            const i = offset + @ctz(empty);
             self.hashMasks[i] = mask.value;
-            self.pairs[i] = newPair;
+            self.entries[i] = Entry{ .key = key, .value = value };
             self.pairCount += 1;
             return;
         }
@@ -244,91 +482,131 @@ const Group = struct {
         @panic("Unreachable. Insert a mapped FatTree chunk failed.");
     }
 
-    fn erase(self: *Group, key: TreeLayerIndices, hashCode: usize, allocator: *Allocator) bool {
+    fn erase(self: *Group, key: TreeLayerIndices, hashCode: usize) bool {
         const found = self.find(key, hashCode);
 
         if (found == null) {
             return false;
         }
 
-        self.hashMasks[found.?] = 0;
-        allocator.destroy(self.pairs[found.?]);
-        self.pairCount -= 1;
+        self.eraseAt(found.?);
         return true;
     }
 
+    fn eraseAt(self: *Group, index: usize) void {
+        assert(self.hashMasks[index] != 0);
+        self.hashMasks[index] = 0;
+        self.pairCount -= 1;
+    }
+
+    /// Moves the entries to the front of new memory with `newCapacity` entries, which may be smaller than the current capacity.
+    /// Frees the group's memory if `newCapacity` is 0.
     fn reallocate(self: *Group, newCapacity: usize, allocator: *Allocator) Allocator.Error!void {
         assert(newCapacity % 64 == 0);
-        assert(newCapacity > self.capacity);
+        assert(newCapacity >= self.pairCount);
 
-        const memory = try allocator.alignedAlloc(u8, ALIGNMENT, newCapacity);
-        @memset(memory, 0);
+        if (newCapacity == 0) {
+            self.deinit(allocator);
+            self.* = Group.init();
+            return;
+        }
+
+        const memory = try allocator.alignedAlloc(u8, ALIGNMENT, calculateChunksHashGroupAllocationSize(newCapacity));
+        @memset(memory[0..newCapacity], 0);
 
         const hashMasks = memory.ptr;
-        const pairs: [*]*Pair = @ptrCast(@alignCast(memory.ptr + newCapacity));
+        const entries: [*]Entry = @ptrCast(@alignCast(memory.ptr + newCapacity));
 
         var moved: usize = 0;
-        for (0..newCapacity) |i| {
+        for (0..self.capacity) |i| {
             if (self.hashMasks[i] == 0) {
                 continue;
             }
 
-            hashMasks[i] = self.hashMasks[i];
-            pairs[i] = self.pairs[i];
+            hashMasks[moved] = self.hashMasks[i];
+            entries[moved] = self.entries[i];
             moved += 1;
         }
 
-        {
-            const currentAllocationSize = calculateChunksHashGroupAllocationSize(self.capacity);
-            var allocSlice: []align(64) u8 = undefined;
-            allocSlice.ptr = self.hashMasks;
-            allocSlice.len = currentAllocationSize;
-
-            allocator.free(allocSlice);
-        }
+        self.deinit(allocator);
 
         self.hashMasks = hashMasks;
-        self.pairs = pairs;
+        self.entries = entries;
         self.capacity = newCapacity;
     }
-
-    const Pair = struct {
-        // NOTE if TreeLayerIndices has a hash function that isn't just returning the internal mask, cache the hash code.
-        key: TreeLayerIndices,
-        value: Chunk,
-    };
 };
 
-const HashGroupBitmask = struct {
+/// Compares the `PROBE_WIDTH` control bytes starting at `offset` against `controlByte` at once,
+/// returning a mask with a bit set for each one that is equal.
+pub fn matchControlBytes(controlBytes: [*]align(64) const u8, offset: usize, controlByte: u8) ProbeMask {
+    const bytes: @Vector(PROBE_WIDTH, u8) = controlBytes[offset..][0..PROBE_WIDTH].*;
+    const matches = bytes == @as(@Vector(PROBE_WIDTH, u8), @splat(controlByte));
+    return @bitCast(matches);
+}
+
+pub const HashGroupBitmask = struct {
     const BITMASK = 18446744073709551488; // ~0b1111111 as usize
 
     value: usize,
 
-    fn init(hashCode: usize) HashGroupBitmask {
+    pub fn init(hashCode: usize) HashGroupBitmask {
         return HashGroupBitmask{ .value = @shrExact(hashCode & BITMASK, 7) };
     }
 };
 
-const HashPairBitmask = struct {
+pub const HashPairBitmask = struct {
     const BITMASK = 127; // 0b1111111
     const SET_FLAG = 0b10000000;
 
     value: u8,
 
-    fn init(hashCode: usize) HashPairBitmask {
+    pub fn init(hashCode: usize) HashPairBitmask {
         return HashPairBitmask{ .value = @intCast((hashCode & BITMASK) | SET_FLAG) };
     }
 };
 
-fn calculateChunksHashGroupAllocationSize(requiredCapacity: usize) usize {
+pub fn calculateChunksHashGroupAllocationSize(requiredCapacity: usize) usize {
     assert(requiredCapacity % 64 == 0);
 
-    // number of hash masks + size of pointer * required capacity;
-    return requiredCapacity + (@sizeOf(*Self.Group.Pair) * requiredCapacity);
+    // number of hash masks + size of inline entry * required capacity;
+    return requiredCapacity + (@sizeOf(Group.Entry) * requiredCapacity);
 }
 
 test "calculateChunksHashGroupAllocationSize 64" {
-    try expect(calculateChunksHashGroupAllocationSize(64) == 576);
+    try expect(calculateChunksHashGroupAllocationSize(64) == 2112);
+}
+
+test "Group probing" {
+    var allocator = std.testing.allocator;
+
+    var group = Group.init();
+    defer group.deinit(&allocator);
+
+    // Every entry shares the same control byte, so each probe has to check every match's key.
+    const hashCode: usize = 0x35;
+    var keys: [Group.GROUP_ALLOC_SIZE + 3]TreeLayerIndices = undefined;
+    for (&keys, 0..) |*key, i| {
+        key.* = TreeLayerIndices{};
+        key.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i % 64) });
+        key.setIndexAtLayer(TREE_LAYERS - 2, .{ .index = @intCast(i / 64) });
+        try group.insert(key.*, Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) }, hashCode, &allocator);
+    }
+    try expect(group.capacity == Group.GROUP_ALLOC_SIZE * 2);
+
+    for (keys, 0..) |key, i| {
+        const found = group.find(key, hashCode).?;
+        try expect(@intFromPtr(group.entries[found].value.inner) == 0x1000 + i * 64);
+    }
+
+    // Erasing leaves a gap that the next insert fills.
+    try expect(group.erase(keys[5], hashCode));
+    try expect(group.find(keys[5], hashCode) == null);
+    try group.insert(keys[5], Chunk{ .inner = @ptrFromInt(0x1000) }, hashCode, &allocator);
+    try expect(group.find(keys[5], hashCode).? == 5);
+
+    var missing = TreeLayerIndices{};
+    missing.setIndexAtLayer(0, .{ .index = 1 });
+    try expect(group.find(missing, hashCode) == null);
 }
 
 test "Group size and align" {
@@ -359,3 +637,192 @@ test "Insert chunk" {
 
     try map.insert(indices, chunk);
 }
+
+test "Replace chunk" {
+    var allocator = std.testing.allocator;
+
+    const tree = try FatTree.init(allocator);
+    defer tree.deinit();
+
+    var map = Self.init(&allocator);
+    defer map.deinit();
+
+    const indices = TreeLayerIndices{};
+
+    var first = try Chunk.init(tree, indices);
+    defer first.deinit();
+    var second = try Chunk.init(tree, indices);
+    defer second.deinit();
+
+    try map.insert(indices, first);
+    map.replace(indices, second);
+    try expect(map.find(indices).?.inner == second.inner);
+}
+
+test "Reserve" {
+    var allocator = std.testing.allocator;
+
+    var map = Self.init(&allocator);
+    defer map.deinit();
+
+    try map.reserve(1000);
+    const groupCount = map.groups.len;
+    try expect(groupCount > 1);
+
+    try map.reserve(10);
+    try expect(map.groups.len == groupCount);
+}
+
+test "Stats" {
+    var allocator = std.testing.allocator;
+
+    const tree = try FatTree.init(allocator);
+    defer tree.deinit();
+
+    var map = Self.init(&allocator);
+    defer map.deinit();
+
+    const indices = TreeLayerIndices{};
+    var chunk = try Chunk.init(tree, indices);
+    defer chunk.deinit();
+
+    try map.insert(indices, chunk);
+    const mapStats = map.stats();
+    try expect(mapStats.chunks == 1);
+    try expect(mapStats.groups == map.groups.len);
+    try expect(mapStats.slots == Group.GROUP_ALLOC_SIZE * map.groups.len);
+    try expect(mapStats.bytes > 0);
+}
+
+test "Incremental rehash" {
+    var allocator = std.testing.allocator;
+
+    var map = Self.init(&allocator);
+    defer map.deinit();
+
+    var keys: [2000]TreeLayerIndices = undefined;
+    var wasRehashing = false;
+    for (&keys, 0..) |*key, i| {
+        key.* = TreeLayerIndices{};
+        key.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i % 64) });
+        key.setIndexAtLayer(TREE_LAYERS - 2, .{ .index = @intCast(i / 64) });
+        // The map only holds references to chunks, so they never need to be allocated.
+        try map.insert(key.*, Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) });
+        wasRehashing = wasRehashing or map.isRehashing();
+
+        // Chunks in groups that haven't been moved yet are still found.
+        try expect(@intFromPtr(map.find(keys[i / 2]).?.inner) == 0x1000 + (i / 2) * 64);
+    }
+    try expect(wasRehashing);
+
+    for (keys[0..500]) |key| {
+        map.erase(key);
+    }
+    try expect(try map.rehash(std.math.maxInt(usize)));
+    try expect(!map.isRehashing());
+    try expect(map.chunkCount == 1500);
+    for (keys, 0..) |key, i| {
+        if (i < 500) {
+            try expect(map.find(key) == null);
+        } else {
+            try expect(@intFromPtr(map.find(key).?.inner) == 0x1000 + i * 64);
+        }
+    }
+}
+
+test "Find many" {
+    var allocator = std.testing.allocator;
+
+    var map = Self.init(&allocator);
+    defer map.deinit();
+
+    var keys: [FIND_MANY_BATCH * 3 + 5]TreeLayerIndices = undefined;
+    for (&keys, 0..) |*key, i| {
+        key.* = TreeLayerIndices{};
+        key.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i % 64) });
+        key.setIndexAtLayer(TREE_LAYERS - 2, .{ .index = @intCast(i / 64) });
+        // Every other key is left unmapped.
+        if (i % 2 == 0) {
+            try map.insert(key.*, Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) });
+        }
+    }
+
+    var found: [keys.len]?Chunk = undefined;
+    map.findMany(&keys, &found);
+    for (found, 0..) |chunk, i| {
+        if (i % 2 == 0) {
+            try expect(@intFromPtr(chunk.?.inner) == 0x1000 + i * 64);
+        } else {
+            try expect(chunk == null);
+        }
+    }
+}
+
+test "Shrink" {
+    var allocator = std.testing.allocator;
+
+    var map = Self.init(&allocator);
+    defer map.deinit();
+
+    var keys: [3000]TreeLayerIndices = undefined;
+    for (&keys, 0..) |*key, i| {
+        key.* = TreeLayerIndices{};
+        key.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = @intCast(i % 64) });
+        key.setIndexAtLayer(TREE_LAYERS - 2, .{ .index = @intCast(i / 64) });
+        // The map only holds references to chunks, so they never need to be allocated.
+        try map.insert(key.*, Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) });
+    }
+    const peakGroupCount = map.groups.len;
+    const peakSlotCount = map.slotCount;
+
+    // Like teleporting away from most of the loaded world.
+    for (keys[100..]) |key| {
+        map.erase(key);
+    }
+    try expect(map.groups.len < peakGroupCount);
+    try expect(map.slotCount < peakSlotCount);
+
+    try map.shrinkToFit();
+    try expect(!map.isRehashing());
+    try expect(map.groups.len == calculateNewGroupCount(100));
+    for (keys[0..100], 0..) |key, i| {
+        try expect(@intFromPtr(map.find(key).?.inner) == 0x1000 + i * 64);
+    }
+
+    for (keys[0..100]) |key| {
+        map.erase(key);
+    }
+    try map.shrinkToFit();
+    try expect(map.groups.len == 0);
+    try expect(map.slotCount == 0);
+    try expect(map.find(keys[0]) == null);
+}
+
+test "Spatial groups" {
+    var allocator = std.testing.allocator;
+
+    var map = Self.initWithMode(&allocator, .spatial);
+    defer map.deinit();
+
+    // An 8x8x8 cube of chunks.
+    var keys: [512]TreeLayerIndices = undefined;
+    for (&keys, 0..) |*key, i| {
+        const x: u3 = @intCast(i % 8);
+        const y: u3 = @intCast(i / 8 % 8);
+        const z: u3 = @intCast(i / 64);
+        key.* = TreeLayerIndices{};
+        key.setIndexAtLayer(TREE_LAYERS - 1, TreeLayerIndices.Index.init(@truncate(x), @truncate(y), @truncate(z)));
+        key.setIndexAtLayer(TREE_LAYERS - 2, TreeLayerIndices.Index.init(@intCast(x >> 2), @intCast(y >> 2), @intCast(z >> 2)));
+        // The map only holds references to chunks, so they never need to be allocated.
+        try map.insert(key.*, Chunk{ .inner = @ptrFromInt(0x1000 + i * 64) });
+    }
+    _ = try map.rehash(std.math.maxInt(usize));
+
+    for (keys, 0..) |key, i| {
+        try expect(@intFromPtr(map.find(key).?.inner) == 0x1000 + i * 64);
+
+        // Every chunk within a 2x2x2 cell shares a group.
+        const cellCorner = keys[i & ~@as(usize, 0b1001001)];
+        try expect(groupIndex(map.groupBits(key, key.hash()), map.groups.len) == groupIndex(map.groupBits(cellCorner, cellCorner.hash()), map.groups.len));
+    }
+}
@@ -2,8 +2,11 @@
 //! Fundamentally, it's just an array of `TREE_LAYERS` indices.
 
 const std = @import("std");
+const builtin = @import("builtin");
 const assert = std.debug.assert;
 const expect = std.testing.expect;
+const world_transform = @import("../world_transform.zig");
+const BlockFacing = world_transform.BlockFacing;
 
 /// How many nodes long / wide / tall each layer of the FatTree is.
 pub const TREE_NODE_LENGTH = 4;
@@ -22,6 +25,35 @@ const INDICES_PER_INT = 5;
 const BITSHIFT_MULTIPLY = 6;
 ///
 const BITMASK_LAYER_INDEX: u32 = 0b111111;
+/// Number of bits of a `ChunkKey` holding indices.
+const KEY_BITS = TREE_LAYERS * BITSHIFT_MULTIPLY;
+/// Arbitrary odd constants mixed into `TreeLayerIndices.hash()`, so that zeroed values don't hash to 0.
+const HASH_SEED_LOW: u64 = 0xa0761d6478bd642f;
+const HASH_SEED_HIGH: u64 = 0xe7037ed1a0b428db;
+/// Number of positions converted at once by the batched conversions of `ChunkKey`.
+const BATCH_LANES = 8;
+/// Bits of a chunk coordinate along one axis, 2 for the index of each layer.
+pub const COORDINATE_BITS = TREE_LAYERS * 2;
+/// Whether PDEP and PEXT can spread coordinates into, and gather them from, a `ChunkKey`.
+const HAS_BMI2 = builtin.cpu.arch == .x86_64 and std.Target.x86.featureSetHas(builtin.cpu.features, .bmi2);
+/// Every 2 bits of a coordinate are spread 6 bits apart within a `ChunkKey`,
+/// so the low word holds the first 11 pairs, with the 11th at bits 60 and 61.
+const LOW_WORD_PAIRS = 11;
+/// The bits of each word of a `ChunkKey` holding the x coordinate, the lowest 2 bits of each index.
+const LOW_WORD_SPREAD_MASK: u64 = spreadMask(0, LOW_WORD_PAIRS, 0);
+const HIGH_WORD_SPREAD_MASK: u64 = spreadMask(LOW_WORD_PAIRS, TREE_LAYERS, 64);
+/// Each 6 bit layer index, as the high bits of it's x, z, and y followed by their low bits, for `TreeLayerIndices.mortonCode()`.
+const MORTON_DIGITS = blk: {
+    var digits: [TREE_NODES_PER_LAYER]u8 = undefined;
+    for (0..TREE_NODES_PER_LAYER) |i| {
+        const index = TreeLayerIndex{ .index = i };
+        const x: u8 = index.x();
+        const y: u8 = index.y();
+        const z: u8 = index.z();
+        digits[i] = ((y >> 1) << 5) | ((z >> 1) << 4) | ((x >> 1) << 3) | ((y & 1) << 2) | ((z & 1) << 1) | (x & 1);
+    }
+    break :blk digits;
+};
 
 pub const TreeLayerIndices = extern struct {
     const Self = @This();
@@ -79,13 +111,346 @@ pub const TreeLayerIndices = extern struct {
         self.values[valueIndex] = (self.values[valueIndex] & mask) | @shlExact(indexAsU32, @truncate(bitshift));
     }
 
+    /// Position of the chunk sharing the face in the direction of `facing` with the chunk at this position,
+    /// or null if it would be outside of the world. Follows the same axes as `BlockPosition.adjacent()`.
+    pub fn adjacent(self: Self, facing: BlockFacing) ?Self {
+        var dx: i32 = 0;
+        var dy: i32 = 0;
+        var dz: i32 = 0;
+        if (facing.east) dx -= 1;
+        if (facing.west) dx += 1;
+        if (facing.down) dy -= 1;
+        if (facing.up) dy += 1;
+        if (facing.north) dz -= 1;
+        if (facing.south) dz += 1;
+        return self.offset(dx, dy, dz);
+    }
+
+    /// Position of the chunk `dx`, `dy`, and `dz` chunks away from this position, or null if it would be outside of the world.
+    /// Adds to the indices as base 4 digits, from the deepest layer up, stopping at the first layer left
+    /// without a carry, so stepping to a nearby chunk usually only touches the deepest layer,
+    /// rather than converting through `BlockPosition`.
+    pub fn offset(self: Self, dx: i32, dy: i32, dz: i32) ?Self {
+        var result = self;
+        var carries = [3]i64{ dx, dy, dz };
+        var layer: usize = TREE_LAYERS;
+        while (carries[0] != 0 or carries[1] != 0 or carries[2] != 0) {
+            if (layer == 0) {
+                return null;
+            }
+            layer -= 1;
+
+            const index = result.indexAtLayer(layer);
+            const digits = [3]i64{ index.x(), index.y(), index.z() };
+            var newDigits: [3]u2 = undefined;
+            for (0..3) |axis| {
+                const sum = digits[axis] + carries[axis];
+                newDigits[axis] = @intCast(sum & (TREE_NODE_LENGTH - 1));
+                // Arithmetic shift, so negative sums borrow from the next layer up.
+                carries[axis] = sum >> 2;
+            }
+            result.setIndexAtLayer(layer, Index.init(newDigits[0], newDigits[1], newDigits[2]));
+        }
+        return result;
+    }
+
     /// Equality comparison between two `TreeLayerIndices`'s.
     pub fn equal(self: Self, other: Self) bool {
         return self.values[0] == other.values[0] and self.values[1] == other.values[1] and self.values[2] == other.values[2];
     }
 
+    /// Key ordering positions the way the FatTree is walked: by the index at layer 0, then layer 1, and so on.
+    /// As each index is a 4x4x4 cell, this is a hierarchical Z-order curve, so sorting by it places
+    /// positions sharing long paths through the tree next to each other.
+    pub fn pathKey(self: Self) u128 {
+        return self.key().value;
+    }
+
+    /// Interleaves the bits of the x, y, and z coordinates of this position, from the highest down, into a Morton code.
+    /// Unlike `pathKey()`, which orders the 4x4x4 cells of each layer by x, then z, then y, positions within
+    /// every 2x2x2 cell are consecutive, so positions close in space have close codes at every scale.
+    pub fn mortonCode(self: Self) u128 {
+        var code: u128 = 0;
+        inline for (0..TREE_LAYERS) |layer| {
+            code = (code << BITSHIFT_MULTIPLY) | MORTON_DIGITS[self.indexAtLayer(layer).index];
+        }
+        return code;
+    }
+
+    /// The canonical packed form of this position. See `ChunkKey`.
+    pub fn key(self: Self) ChunkKey {
+        return ChunkKey.fromIndices(self);
+    }
+
+    /// Get the first layer at which `self` and `other` have different indices, meaning every layer
+    /// down to, and including, the returned layer is shared by both paths through the FatTree.
+    /// Returns `TREE_LAYERS` if they are equal.
+    pub fn firstDifferingLayer(self: Self, other: Self) usize {
+        const difference = self.pathKey() ^ other.pathKey();
+        if (difference == 0) {
+            return TREE_LAYERS;
+        }
+        const highestBit = 127 - @clz(difference);
+        return TREE_LAYERS - 1 - highestBit / BITSHIFT_MULTIPLY;
+    }
+
+    /// Mixes all 96 bits into a 64 bit hash, so positions differing in any layer, such as neighboring chunks
+    /// differing only in the deepest layers, land in different groups of `LoadedChunksHashMap`
+    /// with different control bytes. Every bit of the result depends on every bit of the indices,
+    /// through a single 64x64 bit multiply folding it's high half into it's low half.
     pub fn hash(self: Self) usize {
-        return self.values[0]; // TODO better hash
+        const low = @as(u64, self.values[0]) | (@as(u64, self.values[1]) << 32);
+        const high: u64 = self.values[2];
+        const product = @as(u128, low ^ HASH_SEED_LOW) * (high ^ HASH_SEED_HIGH);
+        return @truncate(product ^ (product >> 64));
+    }
+};
+
+/// Canonical packed form of a `TreeLayerIndices`, holding the index at each layer in 6 bits,
+/// from layer 0 in the highest bits down to the deepest layer in the lowest.
+/// The 90 bits don't fit in a single u64, so it spans 2 words, but compares, sorts, and hashes
+/// as one integer, rather than comparing each of the 3 interleaved values of `TreeLayerIndices`.
+/// Converting to and from it is lossless, and sorting by it orders positions by `TreeLayerIndices.pathKey()`.
+pub const ChunkKey = struct {
+    /// Only the lowest `KEY_BITS` bits are ever set.
+    value: u128 = 0,
+
+    pub fn fromIndices(indices: TreeLayerIndices) ChunkKey {
+        var value: u128 = 0;
+        inline for (0..TREE_LAYERS) |layer| {
+            const index = (indices.values[layer % 3] >> valueShift(layer)) & BITMASK_LAYER_INDEX;
+            value |= @as(u128, index) << keyShift(layer);
+        }
+        return ChunkKey{ .value = value };
+    }
+
+    pub fn toIndices(self: ChunkKey) TreeLayerIndices {
+        var indices = TreeLayerIndices{};
+        inline for (0..TREE_LAYERS) |layer| {
+            const index: u32 = @truncate((self.value >> keyShift(layer)) & BITMASK_LAYER_INDEX);
+            indices.values[layer % 3] |= index << valueShift(layer);
+        }
+        return indices;
+    }
+
+    /// Converts every position in `indices` into `keys`, `BATCH_LANES` at a time with SIMD.
+    /// Asserts both have the same length.
+    pub fn fromIndicesBatch(indices: []const TreeLayerIndices, keys: []ChunkKey) void {
+        assert(indices.len == keys.len);
+        const V32 = @Vector(BATCH_LANES, u32);
+        const V64 = @Vector(BATCH_LANES, u64);
+
+        var i: usize = 0;
+        while (i + BATCH_LANES <= indices.len) : (i += BATCH_LANES) {
+            var words: [3][BATCH_LANES]u32 = undefined;
+            for (0..BATCH_LANES) |lane| {
+                for (0..3) |w| {
+                    words[w][lane] = indices[i + lane].values[w];
+                }
+            }
+
+            var low: V64 = @splat(0);
+            var high: V64 = @splat(0);
+            inline for (0..TREE_LAYERS) |layer| {
+                const word: V32 = words[layer % 3];
+                const masked = (word >> splat32(comptime valueShift(layer))) & @as(V32, @splat(BITMASK_LAYER_INDEX));
+                const index: V64 = @intCast(masked);
+                const shift = comptime keyShift(layer);
+                if (shift >= 64) {
+                    high |= index << splat64(shift - 64);
+                } else {
+                    // The upper bits of an index straddling both words are shifted out of `low`, into `high`.
+                    low |= index << splat64(shift);
+                    if (shift + BITSHIFT_MULTIPLY > 64) {
+                        high |= index >> splat64(64 - shift);
+                    }
+                }
+            }
+
+            const lows: [BATCH_LANES]u64 = low;
+            const highs: [BATCH_LANES]u64 = high;
+            for (0..BATCH_LANES) |lane| {
+                keys[i + lane] = ChunkKey{ .value = (@as(u128, highs[lane]) << 64) | lows[lane] };
+            }
+        }
+
+        while (i < indices.len) : (i += 1) {
+            keys[i] = fromIndices(indices[i]);
+        }
+    }
+
+    /// Converts every key in `keys` back into `indices`, `BATCH_LANES` at a time with SIMD.
+    /// Asserts both have the same length.
+    pub fn toIndicesBatch(keys: []const ChunkKey, indices: []TreeLayerIndices) void {
+        assert(indices.len == keys.len);
+        const V32 = @Vector(BATCH_LANES, u32);
+        const V64 = @Vector(BATCH_LANES, u64);
+
+        var i: usize = 0;
+        while (i + BATCH_LANES <= keys.len) : (i += BATCH_LANES) {
+            var lows: [BATCH_LANES]u64 = undefined;
+            var highs: [BATCH_LANES]u64 = undefined;
+            for (0..BATCH_LANES) |lane| {
+                lows[lane] = @truncate(keys[i + lane].value);
+                highs[lane] = @truncate(keys[i + lane].value >> 64);
+            }
+            const low: V64 = lows;
+            const high: V64 = highs;
+
+            var words: [3]V32 = .{ @splat(0), @splat(0), @splat(0) };
+            inline for (0..TREE_LAYERS) |layer| {
+                const shift = comptime keyShift(layer);
+                const index: V64 = if (shift >= 64)
+                    high >> splat64(shift - 64)
+                else if (shift + BITSHIFT_MULTIPLY > 64)
+                    (low >> splat64(shift)) | (high << splat64(64 - shift))
+                else
+                    low >> splat64(shift);
+                const masked: V32 = @truncate(index & @as(V64, @splat(BITMASK_LAYER_INDEX)));
+                words[layer % 3] |= masked << splat32(comptime valueShift(layer));
+            }
+
+            for (0..3) |w| {
+                const values: [BATCH_LANES]u32 = words[w];
+                for (0..BATCH_LANES) |lane| {
+                    indices[i + lane].values[w] = values[lane];
+                }
+            }
+        }
+
+        while (i < keys.len) : (i += 1) {
+            indices[i] = keys[i].toIndices();
+        }
+    }
+
+    /// Packs the coordinates of a chunk, counted from 0 at the lowest corner of the world, by spreading every 2 bits
+    /// of each into the index of a layer, from the highest bits into layer 0 down to the lowest into the deepest layer.
+    /// Only shifts and masks, or PDEP where available, rather than dividing for each layer.
+    /// Asserts that each coordinate fits in `COORDINATE_BITS`.
+    pub fn fromCoordinates(x: u32, y: u32, z: u32) ChunkKey {
+        assert(x >> COORDINATE_BITS == 0);
+        assert(y >> COORDINATE_BITS == 0);
+        assert(z >> COORDINATE_BITS == 0);
+        return ChunkKey{ .value = spreadCoordinate(x) | (spreadCoordinate(y) << TreeLayerIndex.Y_SHIFT) | (spreadCoordinate(z) << TreeLayerIndex.Z_SHIFT) };
+    }
+
+    /// The x, y, and z coordinates of the chunk, the inverse of `fromCoordinates()`.
+    pub fn coordinates(self: ChunkKey) [3]u32 {
+        return .{
+            gatherCoordinate(self.value),
+            gatherCoordinate(self.value >> TreeLayerIndex.Y_SHIFT),
+            gatherCoordinate(self.value >> TreeLayerIndex.Z_SHIFT),
+        };
+    }
+
+    /// Same as `fromCoordinates()` for each of the x, y, and z coordinates in `chunkCoordinates`, `BATCH_LANES` at a time with SIMD.
+    /// Asserts both have the same length.
+    pub fn fromCoordinatesBatch(chunkCoordinates: []const [3]u32, keys: []ChunkKey) void {
+        assert(chunkCoordinates.len == keys.len);
+        const V64 = @Vector(BATCH_LANES, u64);
+
+        var i: usize = 0;
+        while (i + BATCH_LANES <= keys.len) : (i += BATCH_LANES) {
+            var axes: [3][BATCH_LANES]u64 = undefined;
+            for (0..BATCH_LANES) |lane| {
+                for (0..3) |axis| {
+                    axes[axis][lane] = chunkCoordinates[i + lane][axis];
+                }
+            }
+
+            var low: V64 = @splat(0);
+            var high: V64 = @splat(0);
+            inline for (AXIS_SHIFTS, 0..) |axisShift, axis| {
+                const coordinate: V64 = axes[axis];
+                inline for (0..TREE_LAYERS) |pair| {
+                    const bits = (coordinate >> splat64(pair * 2)) & @as(V64, @splat(0b11));
+                    // Pairs are at even bits, so never straddle both words.
+                    const shift = pair * BITSHIFT_MULTIPLY + axisShift;
+                    if (shift >= 64) {
+                        high |= bits << splat64(shift - 64);
+                    } else {
+                        low |= bits << splat64(shift);
+                    }
+                }
+            }
+
+            const lows: [BATCH_LANES]u64 = low;
+            const highs: [BATCH_LANES]u64 = high;
+            for (0..BATCH_LANES) |lane| {
+                keys[i + lane] = ChunkKey{ .value = (@as(u128, highs[lane]) << 64) | lows[lane] };
+            }
+        }
+
+        while (i < keys.len) : (i += 1) {
+            const coordinate = chunkCoordinates[i];
+            keys[i] = fromCoordinates(coordinate[0], coordinate[1], coordinate[2]);
+        }
+    }
+
+    /// Same as `coordinates()` for each of `keys`, `BATCH_LANES` at a time with SIMD.
+    /// Asserts both have the same length.
+    pub fn coordinatesBatch(keys: []const ChunkKey, chunkCoordinates: [][3]u32) void {
+        assert(chunkCoordinates.len == keys.len);
+        const V64 = @Vector(BATCH_LANES, u64);
+
+        var i: usize = 0;
+        while (i + BATCH_LANES <= keys.len) : (i += BATCH_LANES) {
+            var lows: [BATCH_LANES]u64 = undefined;
+            var highs: [BATCH_LANES]u64 = undefined;
+            for (0..BATCH_LANES) |lane| {
+                lows[lane] = @truncate(keys[i + lane].value);
+                highs[lane] = @truncate(keys[i + lane].value >> 64);
+            }
+            const low: V64 = lows;
+            const high: V64 = highs;
+
+            inline for (AXIS_SHIFTS, 0..) |axisShift, axis| {
+                var coordinate: V64 = @splat(0);
+                inline for (0..TREE_LAYERS) |pair| {
+                    const shift = pair * BITSHIFT_MULTIPLY + axisShift;
+                    const word = if (shift >= 64) high >> splat64(shift - 64) else low >> splat64(shift);
+                    coordinate |= (word & @as(V64, @splat(0b11))) << splat64(pair * 2);
+                }
+
+                const values: [BATCH_LANES]u64 = coordinate;
+                for (0..BATCH_LANES) |lane| {
+                    chunkCoordinates[i + lane][axis] = @intCast(values[lane]);
+                }
+            }
+        }
+
+        while (i < keys.len) : (i += 1) {
+            chunkCoordinates[i] = keys[i].coordinates();
+        }
+    }
+
+    pub fn eql(self: ChunkKey, other: ChunkKey) bool {
+        return self.value == other.value;
+    }
+
+    pub fn lessThan(self: ChunkKey, other: ChunkKey) bool {
+        return self.value < other.value;
+    }
+
+    fn splat32(comptime shift: u5) @Vector(BATCH_LANES, u5) {
+        return @splat(shift);
+    }
+
+    fn splat64(comptime shift: u6) @Vector(BATCH_LANES, u6) {
+        return @splat(shift);
+    }
+
+    /// Offset of the bits of the x, y, and z coordinates within each index.
+    const AXIS_SHIFTS = [3]comptime_int{ 0, TreeLayerIndex.Y_SHIFT, TreeLayerIndex.Z_SHIFT };
+
+    /// Bit position of the index at `layer` within `TreeLayerIndices.values`.
+    fn valueShift(comptime layer: usize) u5 {
+        return (layer % INDICES_PER_INT) * BITSHIFT_MULTIPLY;
+    }
+
+    /// Bit position of the index at `layer` within a key.
+    fn keyShift(comptime layer: usize) u7 {
+        return (TREE_LAYERS - 1 - layer) * BITSHIFT_MULTIPLY;
     }
 };
 
@@ -143,6 +508,68 @@ pub const TreeLayerIndex = struct {
     }
 };
 
+/// Spreads every 2 bits of `coordinate` 6 bits apart, into the lowest 2 bits of the index of each layer of a `ChunkKey`.
+fn spreadCoordinate(coordinate: u32) u128 {
+    if (comptime HAS_BMI2) {
+        const low = pdep(coordinate, LOW_WORD_SPREAD_MASK);
+        const high = pdep(coordinate >> (LOW_WORD_PAIRS * 2), HIGH_WORD_SPREAD_MASK);
+        return (@as(u128, high) << 64) | low;
+    }
+    return spreadCoordinatePortable(coordinate);
+}
+
+fn spreadCoordinatePortable(coordinate: u32) u128 {
+    var spread: u128 = 0;
+    inline for (0..TREE_LAYERS) |pair| {
+        spread |= @as(u128, (coordinate >> (pair * 2)) & 0b11) << (pair * BITSHIFT_MULTIPLY);
+    }
+    return spread;
+}
+
+/// The inverse of `spreadCoordinate()`, ignoring every bit but the lowest 2 of each index.
+fn gatherCoordinate(spread: u128) u32 {
+    if (comptime HAS_BMI2) {
+        const low = pext(@truncate(spread), LOW_WORD_SPREAD_MASK);
+        const high = pext(@truncate(spread >> 64), HIGH_WORD_SPREAD_MASK);
+        return @intCast(low | (high << (LOW_WORD_PAIRS * 2)));
+    }
+    return gatherCoordinatePortable(spread);
+}
+
+fn gatherCoordinatePortable(spread: u128) u32 {
+    var coordinate: u32 = 0;
+    inline for (0..TREE_LAYERS) |pair| {
+        coordinate |= (@as(u32, @truncate(spread >> (pair * BITSHIFT_MULTIPLY))) & 0b11) << (pair * 2);
+    }
+    return coordinate;
+}
+
+fn pdep(source: u64, mask: u64) u64 {
+    return asm ("pdep %[mask], %[source], %[result]"
+        : [result] "=r" (-> u64),
+        : [source] "r" (source),
+          [mask] "r" (mask),
+    );
+}
+
+fn pext(source: u64, mask: u64) u64 {
+    return asm ("pext %[mask], %[source], %[result]"
+        : [result] "=r" (-> u64),
+        : [source] "r" (source),
+          [mask] "r" (mask),
+    );
+}
+
+/// The lowest 2 bits of the index of each layer from `firstPair` up to `endPair` within a `ChunkKey`,
+/// relative to the word starting at bit `wordStart`.
+fn spreadMask(comptime firstPair: usize, comptime endPair: usize, comptime wordStart: usize) u64 {
+    var mask: u64 = 0;
+    for (firstPair..endPair) |pair| {
+        mask |= @as(u64, 0b11) << (pair * BITSHIFT_MULTIPLY - wordStart);
+    }
+    return mask;
+}
+
 fn calculateTotalNodeLength() comptime_int {
     var currentVal = 1;
     for (0..TREE_LAYERS) |_| {
@@ -175,3 +602,216 @@ test "tree layer indices init" {
         try expect(layers.indexAtLayer(i).index == i + 1);
     }
 }
+
+test "tree layer indices path key order" {
+    var low = TreeLayerIndices{};
+    low.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = 63 });
+    var high = TreeLayerIndices{};
+    high.setIndexAtLayer(0, .{ .index = 1 });
+    try expect(low.pathKey() < high.pathKey());
+}
+
+test "tree layer indices morton code" {
+    const deepest = TREE_LAYERS - 1;
+    var position = TreeLayerIndices{};
+    try expect(position.mortonCode() == 0);
+
+    position.setIndexAtLayer(deepest, TreeLayerIndex.init(1, 0, 0));
+    try expect(position.mortonCode() == 0b001);
+    position.setIndexAtLayer(deepest, TreeLayerIndex.init(0, 0, 1));
+    try expect(position.mortonCode() == 0b010);
+    position.setIndexAtLayer(deepest, TreeLayerIndex.init(0, 1, 0));
+    try expect(position.mortonCode() == 0b100);
+    position.setIndexAtLayer(deepest, TreeLayerIndex.init(2, 3, 1));
+    try expect(position.mortonCode() == 0b101_110);
+
+    position.setIndexAtLayer(deepest - 1, TreeLayerIndex.init(1, 0, 0));
+    try expect(position.mortonCode() >> 6 == 0b001);
+}
+
+test "tree layer indices first differing layer" {
+    var a = TreeLayerIndices{};
+    var b = TreeLayerIndices{};
+    try expect(a.firstDifferingLayer(b) == TREE_LAYERS);
+
+    b.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = 5 });
+    try expect(a.firstDifferingLayer(b) == TREE_LAYERS - 1);
+
+    a.setIndexAtLayer(3, .{ .index = 1 });
+    try expect(a.firstDifferingLayer(b) == 3);
+    try expect(b.firstDifferingLayer(a) == 3);
+}
+
+test "tree layer indices hash spreads deep layers" {
+    // Neighboring chunks only differ in the deepest layers, held by every value.
+    for ([_]usize{ TREE_LAYERS - 1, TREE_LAYERS - 2, TREE_LAYERS - 3 }) |layer| {
+        var seenTags = std.StaticBitSet(128).initEmpty();
+        var seenGroups = std.StaticBitSet(64).initEmpty();
+        for (0..64) |i| {
+            var indices = TreeLayerIndices{};
+            indices.setIndexAtLayer(layer, .{ .index = @intCast(i) });
+            const hashCode = indices.hash();
+            seenTags.set(hashCode & 127);
+            seenGroups.set((hashCode >> 7) % 64);
+        }
+        try expect(seenTags.count() >= 32);
+        try expect(seenGroups.count() >= 32);
+    }
+}
+
+fn testRandomIndices(random: std.rand.Random) TreeLayerIndices {
+    var indices = TreeLayerIndices{};
+    for (0..TREE_LAYERS) |i| {
+        indices.setIndexAtLayer(i, .{ .index = random.int(u6) });
+    }
+    return indices;
+}
+
+test "chunk key round trip" {
+    var prng = std.rand.DefaultPrng.init(0);
+    for (0..1000) |_| {
+        const indices = testRandomIndices(prng.random());
+        const key = indices.key();
+        try expect(key.toIndices().equal(indices));
+        try expect(key.value >> KEY_BITS == 0);
+
+        var expected: u128 = 0;
+        for (0..TREE_LAYERS) |i| {
+            expected = (expected << BITSHIFT_MULTIPLY) | indices.indexAtLayer(i).index;
+        }
+        try expect(key.value == expected);
+    }
+}
+
+test "chunk key order" {
+    var low = TreeLayerIndices{};
+    low.setIndexAtLayer(TREE_LAYERS - 1, .{ .index = 63 });
+    var high = TreeLayerIndices{};
+    high.setIndexAtLayer(4, .{ .index = 1 }); // straddles both words of the key
+    try expect(low.key().lessThan(high.key()));
+    try expect(!high.key().lessThan(low.key()));
+    try expect(high.key().eql(high.key()));
+}
+
+test "chunk key batch" {
+    var prng = std.rand.DefaultPrng.init(1);
+    var indices: [BATCH_LANES * 3 + 5]TreeLayerIndices = undefined;
+    for (&indices) |*i| {
+        i.* = testRandomIndices(prng.random());
+    }
+
+    var keys: [indices.len]ChunkKey = undefined;
+    ChunkKey.fromIndicesBatch(&indices, &keys);
+    for (indices, keys) |i, k| {
+        try expect(k.eql(i.key()));
+    }
+
+    var converted: [indices.len]TreeLayerIndices = undefined;
+    ChunkKey.toIndicesBatch(&keys, &converted);
+    for (indices, converted) |i, c| {
+        try expect(c.equal(i));
+    }
+}
+
+test "chunk key coordinates" {
+    var prng = std.rand.DefaultPrng.init(2);
+    const random = prng.random();
+    for (0..1000) |_| {
+        const x = random.int(std.meta.Int(.unsigned, COORDINATE_BITS));
+        const y = random.int(std.meta.Int(.unsigned, COORDINATE_BITS));
+        const z = random.int(std.meta.Int(.unsigned, COORDINATE_BITS));
+
+        const key = ChunkKey.fromCoordinates(x, y, z);
+        const indices = key.toIndices();
+        for (0..TREE_LAYERS) |layer| {
+            const shift: u5 = @intCast((TREE_LAYERS - 1 - layer) * 2);
+            const expected = TreeLayerIndex.init(@truncate(x >> shift), @truncate(y >> shift), @truncate(z >> shift));
+            try expect(indices.indexAtLayer(layer).eql(expected));
+        }
+
+        const converted = key.coordinates();
+        try expect(converted[0] == x and converted[1] == y and converted[2] == z);
+
+        // The portable fallback matches PDEP and PEXT.
+        try expect(spreadCoordinate(x) == spreadCoordinatePortable(x));
+        try expect(gatherCoordinate(key.value) == gatherCoordinatePortable(key.value));
+    }
+}
+
+test "chunk key coordinates batch" {
+    var prng = std.rand.DefaultPrng.init(3);
+    const random = prng.random();
+    var chunkCoordinates: [BATCH_LANES * 3 + 5][3]u32 = undefined;
+    for (&chunkCoordinates) |*coordinate| {
+        for (coordinate) |*axis| {
+            axis.* = random.int(std.meta.Int(.unsigned, COORDINATE_BITS));
+        }
+    }
+
+    var keys: [chunkCoordinates.len]ChunkKey = undefined;
+    ChunkKey.fromCoordinatesBatch(&chunkCoordinates, &keys);
+    for (chunkCoordinates, keys) |coordinate, key| {
+        try expect(key.eql(ChunkKey.fromCoordinates(coordinate[0], coordinate[1], coordinate[2])));
+    }
+
+    var converted: [chunkCoordinates.len][3]u32 = undefined;
+    ChunkKey.coordinatesBatch(&keys, &converted);
+    for (chunkCoordinates, converted) |coordinate, c| {
+        try expect(std.mem.eql(u32, &coordinate, &c));
+    }
+}
+
+test "tree layer indices offset" {
+    var prng = std.rand.DefaultPrng.init(5);
+    const random = prng.random();
+    const BlockPosition = world_transform.BlockPosition;
+    const CHUNK_LENGTH = world_transform.CHUNK_LENGTH;
+    for (0..1000) |_| {
+        const position = BlockPosition{
+            .x = random.intRangeAtMost(i64, world_transform.WORLD_MIN_BLOCK_POS, world_transform.WORLD_MAX_BLOCK_POS),
+            .y = random.intRangeAtMost(i64, world_transform.WORLD_MIN_BLOCK_POS, world_transform.WORLD_MAX_BLOCK_POS),
+            .z = random.intRangeAtMost(i64, world_transform.WORLD_MIN_BLOCK_POS, world_transform.WORLD_MAX_BLOCK_POS),
+        };
+        // Mostly small steps, with some crossing many layers at once.
+        const range: i32 = if (random.boolean()) 5 else 1 << 24;
+        const dx = random.intRangeAtMost(i32, -range, range);
+        const dy = random.intRangeAtMost(i32, -range, range);
+        const dz = random.intRangeAtMost(i32, -range, range);
+
+        const base = BlockPosition.fromTreeIndices(position.asTreeIndices());
+        const moved = BlockPosition{
+            .x = base.x + @as(i64, dx) * CHUNK_LENGTH,
+            .y = base.y + @as(i64, dy) * CHUNK_LENGTH,
+            .z = base.z + @as(i64, dz) * CHUNK_LENGTH,
+        };
+        const result = position.asTreeIndices().offset(dx, dy, dz);
+        const min = world_transform.WORLD_MIN_BLOCK_POS;
+        const max = world_transform.WORLD_MAX_BLOCK_POS;
+        if (moved.x < min or moved.x > max or moved.y < min or moved.y > max or moved.z < min or moved.z > max) {
+            try expect(result == null);
+        } else {
+            try expect(result.?.equal(moved.asTreeIndices()));
+        }
+    }
+}
+
+test "tree layer indices adjacent" {
+    const west = BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = false, .west = true };
+    const east = BlockFacing{ .down = false, .up = false, .north = false, .south = false, .east = true, .west = false };
+    const down = BlockFacing{ .down = true, .up = false, .north = false, .south = false, .east = false, .west = false };
+
+    const corner = TreeLayerIndices{}; // At the minimum corner of the world
+    try expect(corner.adjacent(east) == null);
+    try expect(corner.adjacent(down) == null);
+    try expect(corner.adjacent(west).?.indexAtLayer(TREE_LAYERS - 1).eql(TreeLayerIndex.init(1, 0, 0)));
+    try expect(corner.adjacent(west).?.adjacent(east).?.equal(corner));
+
+    // Carries across every layer below layer 0.
+    const origin = (world_transform.BlockPosition{ .x = 0, .y = 0, .z = 0 }).asTreeIndices();
+    const belowOrigin = origin.adjacent(east).?;
+    try expect(belowOrigin.indexAtLayer(0).eql(TreeLayerIndex.init(1, 2, 2)));
+    for (1..TREE_LAYERS) |layer| {
+        try expect(belowOrigin.indexAtLayer(layer).eql(TreeLayerIndex.init(3, 0, 0)));
+    }
+    try expect(belowOrigin.adjacent(west).?.equal(origin));
+}
@@ -0,0 +1,243 @@
+//! Memory accounting for a `FatTree`, answering where the memory of a world is going.
+//! `TreeCounters` is kept up to date as the tree and it's chunks change, so `FatTree.stats()`
+//! only copies counters, rather than walking the whole tree.
+
+const std = @import("std");
+const Atomic = std.atomic.Value;
+const AtomicOrder = std.builtin.AtomicOrder;
+const expect = std.testing.expect;
+const tree_layer_indices = @import("tree_layer_indices.zig");
+const BlockStateIndices = @import("../chunk/BlockStateIndices.zig");
+const IndexBitWidth = BlockStateIndices.IndexBitWidth;
+
+const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
+const TREE_NODES_PER_LAYER = tree_layer_indices.TREE_NODES_PER_LAYER;
+
+/// The kinds of node within a `FatTree`, in the same order as it's node types.
+pub const NodeKind = enum(u8) {
+    empty,
+    childLayer,
+    noodleLayer,
+    chunk,
+    uniform,
+};
+
+pub const NODE_KINDS = @typeInfo(NodeKind).Enum.fields.len;
+pub const BIT_WIDTHS = @typeInfo(IndexBitWidth).Enum.fields.len;
+/// Noodles cover at most every layer of the tree, so are indexed by length directly.
+pub const NOODLE_LENGTHS = TREE_LAYERS + 1;
+
+/// Whether a `TreeCounters` update is adding or removing something.
+pub const CountChange = enum {
+    added,
+    removed,
+
+    pub fn apply(comptime self: CountChange, value: *Atomic(usize), amount: usize) void {
+        switch (self) {
+            .added => _ = value.fetchAdd(amount, AtomicOrder.Monotonic),
+            .removed => _ = value.fetchSub(amount, AtomicOrder.Monotonic),
+        }
+    }
+};
+
+/// Counters owned by a `FatTree`, updated as it changes.
+///
+/// # Thread safety
+///
+/// Every counter is atomic. The structural counters are modified by different subtrees at once through
+/// `SubtreeModify` access, and the chunk counters are modified by chunks through `ChunkModify` access.
+pub const TreeCounters = struct {
+    /// Layers within the live tree, by their tree layer.
+    layers: [TREE_LAYERS]Atomic(usize) = .{Atomic(usize).init(0)} ** TREE_LAYERS,
+    /// Non-empty nodes within the layers of the live tree, by their tree layer and kind.
+    /// The `empty` count is always 0, as empty nodes are whatever is left over.
+    nodes: [TREE_LAYERS][NODE_KINDS]Atomic(usize) = .{.{Atomic(usize).init(0)} ** NODE_KINDS} ** TREE_LAYERS,
+    /// Noodle layers within the live tree, by how many layers they cover.
+    noodleLengths: [NOODLE_LENGTHS]Atomic(usize) = .{Atomic(usize).init(0)} ** NOODLE_LENGTHS,
+    /// Allocated chunks by the bit width of their block state indices. Includes chunks only kept alive
+    /// by a `Snapshot`, or waiting to be reclaimed, as they still use memory.
+    chunks: [BIT_WIDTHS]Atomic(usize) = .{Atomic(usize).init(0)} ** BIT_WIDTHS,
+    /// Total block states held by the palettes of every allocated chunk.
+    paletteEntries: Atomic(usize) = Atomic(usize).init(0),
+    /// Total block states the palettes of every allocated chunk have memory for.
+    paletteCapacity: Atomic(usize) = Atomic(usize).init(0),
+    /// Bytes used by the hash map of loaded chunks, stored whenever it may have been resized.
+    mapBytes: Atomic(usize) = Atomic(usize).init(0),
+
+    pub fn chunkAllocated(self: *TreeCounters, bitWidth: IndexBitWidth, paletteLen: usize, paletteCapacity: usize) void {
+        _ = self.chunks[@intFromEnum(bitWidth)].fetchAdd(1, AtomicOrder.Monotonic);
+        _ = self.paletteEntries.fetchAdd(paletteLen, AtomicOrder.Monotonic);
+        _ = self.paletteCapacity.fetchAdd(paletteCapacity, AtomicOrder.Monotonic);
+    }
+
+    pub fn chunkFreed(self: *TreeCounters, bitWidth: IndexBitWidth, paletteLen: usize, paletteCapacity: usize) void {
+        _ = self.chunks[@intFromEnum(bitWidth)].fetchSub(1, AtomicOrder.Monotonic);
+        _ = self.paletteEntries.fetchSub(paletteLen, AtomicOrder.Monotonic);
+        _ = self.paletteCapacity.fetchSub(paletteCapacity, AtomicOrder.Monotonic);
+    }
+
+    /// A chunk's block state indices were reallocated from `oldBitWidth` to `newBitWidth`.
+    pub fn chunkBitWidthChanged(self: *TreeCounters, oldBitWidth: IndexBitWidth, newBitWidth: IndexBitWidth) void {
+        if (oldBitWidth == newBitWidth) {
+            return;
+        }
+        _ = self.chunks[@intFromEnum(oldBitWidth)].fetchSub(1, AtomicOrder.Monotonic);
+        _ = self.chunks[@intFromEnum(newBitWidth)].fetchAdd(1, AtomicOrder.Monotonic);
+    }
+
+    /// A chunk added a block state to it's palette, growing it's memory from `oldCapacity` to `newCapacity`.
+    pub fn paletteEntryAdded(self: *TreeCounters, oldCapacity: usize, newCapacity: usize) void {
+        _ = self.paletteEntries.fetchAdd(1, AtomicOrder.Monotonic);
+        _ = self.paletteCapacity.fetchAdd(newCapacity - oldCapacity, AtomicOrder.Monotonic);
+    }
+};
+
+/// Occupancy of the hash map of loaded chunks.
+pub const MapStats = struct {
+    chunks: usize,
+    groups: usize,
+    /// Total entries every group has memory for.
+    slots: usize,
+    bytes: usize,
+
+    /// Fraction of the slots holding a chunk.
+    pub fn loadFactor(self: MapStats) f64 {
+        if (self.slots == 0) return 0;
+        return @as(f64, @floatFromInt(self.chunks)) / @as(f64, @floatFromInt(self.slots));
+    }
+
+    /// Average number of chunks within each group.
+    pub fn averageGroupOccupancy(self: MapStats) f64 {
+        if (self.groups == 0) return 0;
+        return @as(f64, @floatFromInt(self.chunks)) / @as(f64, @floatFromInt(self.groups));
+    }
+};
+
+/// Memory used by each part of a `FatTree`, in bytes.
+pub const Bytes = struct {
+    layers: usize = 0,
+    noodleLayers: usize = 0,
+    chunks: usize = 0,
+    blockStateIndices: usize = 0,
+    palettes: usize = 0,
+    map: usize = 0,
+
+    pub fn total(self: Bytes) usize {
+        return self.layers + self.noodleLayers + self.chunks + self.blockStateIndices + self.palettes + self.map;
+    }
+};
+
+/// Statistics of a `FatTree` at one moment, returned by `FatTree.stats()`.
+pub const TreeStats = struct {
+    /// Layers within the live tree, by their tree layer.
+    layers: [TREE_LAYERS]usize,
+    /// Nodes within the layers of the live tree, by their tree layer and kind.
+    nodes: [TREE_LAYERS][NODE_KINDS]usize,
+    noodleLengths: [NOODLE_LENGTHS]usize,
+    /// Allocated chunks by the bit width of their block state indices.
+    chunksByBitWidth: [BIT_WIDTHS]usize,
+    paletteEntries: usize,
+    paletteCapacity: usize,
+    map: MapStats,
+    bytes: Bytes,
+
+    /// Copies `counters`, filling in the empty nodes of each layer from how many layers there are.
+    pub fn fromCounters(counters: *const TreeCounters) TreeStats {
+        var self: TreeStats = undefined;
+        for (0..TREE_LAYERS) |i| {
+            self.layers[i] = counters.layers[i].load(AtomicOrder.Monotonic);
+            for (0..NODE_KINDS) |kind| {
+                self.nodes[i][kind] = counters.nodes[i][kind].load(AtomicOrder.Monotonic);
+            }
+        }
+        for (0..NOODLE_LENGTHS) |i| {
+            self.noodleLengths[i] = counters.noodleLengths[i].load(AtomicOrder.Monotonic);
+        }
+        for (0..TREE_LAYERS) |i| {
+            var used: usize = 0;
+            for (self.nodes[i]) |count| {
+                used += count;
+            }
+            self.nodes[i][@intFromEnum(NodeKind.empty)] = self.layers[i] * TREE_NODES_PER_LAYER - used;
+        }
+        for (0..BIT_WIDTHS) |i| {
+            self.chunksByBitWidth[i] = counters.chunks[i].load(AtomicOrder.Monotonic);
+        }
+        self.paletteEntries = counters.paletteEntries.load(AtomicOrder.Monotonic);
+        self.paletteCapacity = counters.paletteCapacity.load(AtomicOrder.Monotonic);
+        self.map = std.mem.zeroes(MapStats);
+        self.bytes = Bytes{};
+        return self;
+    }
+
+    pub fn allocatedChunks(self: *const TreeStats) usize {
+        var count: usize = 0;
+        for (self.chunksByBitWidth) |c| {
+            count += c;
+        }
+        return count;
+    }
+
+    pub fn format(self: TreeStats, comptime _: []const u8, _: std.fmt.FormatOptions, writer: anytype) !void {
+        try writer.print("FatTree: {} bytes total\n", .{self.bytes.total()});
+        try writer.print("  bytes: layers {}, noodle layers {}, chunks {}, block state indices {}, palettes {}, map {}\n", .{
+            self.bytes.layers,
+            self.bytes.noodleLayers,
+            self.bytes.chunks,
+            self.bytes.blockStateIndices,
+            self.bytes.palettes,
+            self.bytes.map,
+        });
+        for (0..TREE_LAYERS) |i| {
+            if (self.layers[i] == 0) continue;
+            try writer.print("  layer {}: {} layers", .{ i, self.layers[i] });
+            inline for (@typeInfo(NodeKind).Enum.fields) |field| {
+                try writer.print(", {s} {}", .{ field.name, self.nodes[i][field.value] });
+            }
+            try writer.writeByte('\n');
+        }
+        for (0..NOODLE_LENGTHS) |i| {
+            if (self.noodleLengths[i] == 0) continue;
+            try writer.print("  noodles of length {}: {}\n", .{ i, self.noodleLengths[i] });
+        }
+        try writer.print("  chunks: {}", .{self.allocatedChunks()});
+        inline for (@typeInfo(IndexBitWidth).Enum.fields) |field| {
+            try writer.print(", {s} {}", .{ field.name, self.chunksByBitWidth[field.value] });
+        }
+        try writer.print("\n  palettes: {} block states, capacity {}\n", .{ self.paletteEntries, self.paletteCapacity });
+        try writer.print("  map: {} chunks, {} groups, {} slots, load factor {d:.3}, {d:.2} chunks per group\n", .{
+            self.map.chunks,
+            self.map.groups,
+            self.map.slots,
+            self.map.loadFactor(),
+            self.map.averageGroupOccupancy(),
+        });
+    }
+};
+
+// Tests
+
+test "Count change" {
+    var value = Atomic(usize).init(3);
+    CountChange.added.apply(&value, 2);
+    try expect(value.load(AtomicOrder.Monotonic) == 5);
+    CountChange.removed.apply(&value, 5);
+    try expect(value.load(AtomicOrder.Monotonic) == 0);
+}
+
+test "Stats from counters" {
+    var counters = TreeCounters{};
+    CountChange.added.apply(&counters.layers[0], 1);
+    CountChange.added.apply(&counters.nodes[0][@intFromEnum(NodeKind.uniform)], 4);
+    counters.chunkAllocated(.b1, 1, 4);
+    counters.chunkBitWidthChanged(.b1, .b2);
+    counters.paletteEntryAdded(4, 8);
+
+    const stats = TreeStats.fromCounters(&counters);
+    try expect(stats.nodes[0][@intFromEnum(NodeKind.empty)] == TREE_NODES_PER_LAYER - 4);
+    try expect(stats.nodes[1][@intFromEnum(NodeKind.empty)] == 0);
+    try expect(stats.chunksByBitWidth[@intFromEnum(IndexBitWidth.b1)] == 0);
+    try expect(stats.chunksByBitWidth[@intFromEnum(IndexBitWidth.b2)] == 1);
+    try expect(stats.paletteEntries == 2);
+    try expect(stats.paletteCapacity == 8);
+}
@@ -3,8 +3,8 @@ const assert = std.debug.assert;
 const expect = std.testing.expect;
 const tree_layer_indices = @import("fat_tree/tree_layer_indices.zig");
 const TreeLayerIndices = tree_layer_indices.TreeLayerIndices;
+const ChunkKey = tree_layer_indices.ChunkKey;
 const TREE_LAYERS = tree_layer_indices.TREE_LAYERS;
-const TREE_NODE_LENGTH = tree_layer_indices.TREE_NODE_LENGTH;
 const TOTAL_NODES_DEEPEST_LAYER_WHOLE_TREE = tree_layer_indices.TOTAL_NODES_DEEPEST_LAYER_WHOLE_TREE;
 const vector_types = @import("../math/vector.zig");
 const vec3 = vector_types.vec3;
@@ -23,6 +23,9 @@ pub const WORLD_MAX_BLOCK_POS: comptime_int = WORLD_BLOCK_LENGTH / 2 - 1;
 /// # -17179869184
 /// Minimum position a block can exist at.
 pub const WORLD_MIN_BLOCK_POS: comptime_int = WORLD_MAX_BLOCK_POS - WORLD_BLOCK_LENGTH + 1;
+/// Number of positions `BlockPosition.asTreeIndicesBatch()` and `BlockPosition.fromTreeIndicesBatch()`
+/// convert at once, keeping the chunk coordinates and keys between each step on the stack.
+const CONVERSION_BATCH = 64;
 
 /// Facing direction of a block. Locked to 6 cube faces.
 /// Occupies only 1 byte.
@@ -133,41 +136,58 @@ pub const BlockPosition = extern struct {
         assert(self.z <= WORLD_MAX_BLOCK_POS);
         assert(self.z >= WORLD_MIN_BLOCK_POS);
 
-        const xShiftedPositive: i64 = @divTrunc(self.x + WORLD_MAX_BLOCK_POS + 1, CHUNK_LENGTH);
-        const yShiftedPositive: i64 = @divTrunc(self.y + WORLD_MAX_BLOCK_POS + 1, CHUNK_LENGTH);
-        const zShiftedPositive: i64 = @divTrunc(self.z + WORLD_MAX_BLOCK_POS + 1, CHUNK_LENGTH);
-
-        var indices: [TREE_LAYERS]TreeLayerIndices.Index = undefined;
-        inline for (0..TREE_LAYERS) |i| {
-            const iAsComptime: comptime_int = i;
-            indices[i] = calculateLayerIndex(iAsComptime, xShiftedPositive, yShiftedPositive, zShiftedPositive);
-        }
-
-        return TreeLayerIndices.init(indices);
+        return ChunkKey.fromCoordinates(chunkCoordinate(self.x), chunkCoordinate(self.y), chunkCoordinate(self.z)).toIndices();
     }
 
     /// Does not hold any information on which `BlockIndex` is used.
     /// Each component is effectively clamped to increments of `CHUNK_LENGTH`.
     pub fn fromTreeIndices(indices: TreeLayerIndices) Self {
+        const coordinates = indices.key().coordinates();
+        return BlockPosition{
+            .x = blockComponent(coordinates[0]),
+            .y = blockComponent(coordinates[1]),
+            .z = blockComponent(coordinates[2]),
+        };
+    }
 
-        // Ignore the 4th element. its not needed
-        var components = @Vector(4, i64){ 0, 0, 0, 0 };
-
-        inline for (0..TREE_LAYERS) |i| {
-            const iAsComptime: comptime_int = i;
-            const multiplier: i64 = calculateLayerMultiplier(iAsComptime);
-
-            const index = indices.indexAtLayer(i);
-
-            const indicesVec = @Vector(4, i64){ index.x(), index.y(), index.z(), 0 };
-            const scaledMultiplier: @Vector(4, i64) = @splat(multiplier / TREE_NODE_LENGTH);
-            components += indicesVec * scaledMultiplier;
+    /// Same as `asTreeIndices()` for each of `positions`, with the bit interleaving done with SIMD.
+    /// Asserts both have the same length.
+    pub fn asTreeIndicesBatch(positions: []const Self, indices: []TreeLayerIndices) void {
+        assert(positions.len == indices.len);
+        var coordinates: [CONVERSION_BATCH][3]u32 = undefined;
+        var keys: [CONVERSION_BATCH]ChunkKey = undefined;
+
+        var start: usize = 0;
+        while (start < positions.len) : (start += CONVERSION_BATCH) {
+            const count = @min(CONVERSION_BATCH, positions.len - start);
+            for (positions[start..][0..count], coordinates[0..count]) |position, *coordinate| {
+                coordinate.* = .{ chunkCoordinate(position.x), chunkCoordinate(position.y), chunkCoordinate(position.z) };
+            }
+            ChunkKey.fromCoordinatesBatch(coordinates[0..count], keys[0..count]);
+            ChunkKey.toIndicesBatch(keys[0..count], indices[start..][0..count]);
         }
+    }
 
-        components *= @splat(CHUNK_LENGTH);
-        components -= @splat(WORLD_MAX_BLOCK_POS + 1);
-
-        return BlockPosition{ .x = components[0], .y = components[1], .z = components[2] };
+    /// Same as `fromTreeIndices()` for each of `indices`, with the bit interleaving done with SIMD.
+    /// Asserts both have the same length.
+    pub fn fromTreeIndicesBatch(indices: []const TreeLayerIndices, positions: []Self) void {
+        assert(positions.len == indices.len);
+        var coordinates: [CONVERSION_BATCH][3]u32 = undefined;
+        var keys: [CONVERSION_BATCH]ChunkKey = undefined;
+
+        var start: usize = 0;
+        while (start < positions.len) : (start += CONVERSION_BATCH) {
+            const count = @min(CONVERSION_BATCH, positions.len - start);
+            ChunkKey.fromIndicesBatch(indices[start..][0..count], keys[0..count]);
+            ChunkKey.coordinatesBatch(keys[0..count], coordinates[0..count]);
+            for (coordinates[0..count], positions[start..][0..count]) |coordinate, *position| {
+                position.* = BlockPosition{
+                    .x = blockComponent(coordinate[0]),
+                    .y = blockComponent(coordinate[1]),
+                    .z = blockComponent(coordinate[2]),
+                };
+            }
+        }
     }
 
     /// Get the position adjacent to this one at a specific direction.
@@ -325,26 +345,19 @@ pub const WorldPosition = extern struct {
     }
 };
 
-fn calculateLayerIndex(comptime layer: comptime_int, xShiftedPositive: i64, yShiftedPositive: i64, zShiftedPositive: i64) TreeLayerIndices.Index {
-    if (layer >= TREE_LAYERS) {
-        @compileError("layer cannot exceed TREE_LAYERS");
-    }
-
-    const DIV = calculateLayerMultiplier(layer);
-
-    const normalizedX: u2 = @intCast(@divTrunc((@mod(xShiftedPositive, DIV) * TREE_NODE_LENGTH), DIV));
-    const normalizedY: u2 = @intCast(@divTrunc((@mod(yShiftedPositive, DIV) * TREE_NODE_LENGTH), DIV));
-    const normalizedZ: u2 = @intCast(@divTrunc((@mod(zShiftedPositive, DIV) * TREE_NODE_LENGTH), DIV));
-
-    return TreeLayerIndices.Index.init(normalizedX, normalizedY, normalizedZ);
+/// The coordinate of the chunk holding `component` along one axis, counted from 0 at `WORLD_MIN_BLOCK_POS`.
+/// Asserts that `component` is within the inclusive range of `WORLD_MAX_BLOCK_POS` and `WORLD_MIN_BLOCK_POS`.
+fn chunkCoordinate(component: i64) u32 {
+    assert(component <= WORLD_MAX_BLOCK_POS);
+    assert(component >= WORLD_MIN_BLOCK_POS);
+    // Unsigned, so the division is a shift.
+    const shiftedPositive: u64 = @intCast(component + WORLD_MAX_BLOCK_POS + 1);
+    return @intCast(shiftedPositive / CHUNK_LENGTH);
 }
 
-fn calculateLayerMultiplier(comptime layer: comptime_int) comptime_int {
-    var out = 1;
-    for (layer..TREE_LAYERS) |_| {
-        out *= TREE_NODE_LENGTH;
-    }
-    return out;
+/// The inverse of `chunkCoordinate()`, giving the lowest component within the chunk.
+fn blockComponent(coordinate: u32) i64 {
+    return @as(i64, coordinate) * CHUNK_LENGTH - (WORLD_MAX_BLOCK_POS + 1);
 }
 
 // Tests
@@ -510,6 +523,33 @@ test "BlockPosition equal" {
     }
 }
 
+test "BlockPosition tree indices batch" {
+    var prng = std.rand.DefaultPrng.init(4);
+    const random = prng.random();
+    var positions: [CONVERSION_BATCH * 2 + 11]BlockPosition = undefined;
+    for (&positions) |*position| {
+        position.* = BlockPosition{
+            .x = random.intRangeAtMost(i64, WORLD_MIN_BLOCK_POS, WORLD_MAX_BLOCK_POS),
+            .y = random.intRangeAtMost(i64, WORLD_MIN_BLOCK_POS, WORLD_MAX_BLOCK_POS),
+            .z = random.intRangeAtMost(i64, WORLD_MIN_BLOCK_POS, WORLD_MAX_BLOCK_POS),
+        };
+    }
+    positions[0] = BlockPosition{ .x = WORLD_MIN_BLOCK_POS, .y = WORLD_MAX_BLOCK_POS, .z = 0 };
+
+    var indices: [positions.len]TreeLayerIndices = undefined;
+    BlockPosition.asTreeIndicesBatch(&positions, &indices);
+    for (positions, indices) |position, treePos| {
+        try expect(treePos.equal(position.asTreeIndices()));
+    }
+
+    var converted: [positions.len]BlockPosition = undefined;
+    BlockPosition.fromTreeIndicesBatch(&indices, &converted);
+    for (positions, converted) |position, convertBack| {
+        try expect(convertBack.eql(BlockPosition.fromTreeIndices(position.asTreeIndices())));
+        try expect((position.x - @mod(position.x, CHUNK_LENGTH)) == convertBack.x);
+    }
+}
+
 test "WorldPosition size align offset" {
     try expect(@sizeOf(WorldPosition) == 24);
     try expect(@alignOf(WorldPosition) == 4);
@@ -4,11 +4,18 @@ comptime {
     _ = @import("engine/world/chunk/Chunk.zig");
     _ = @import("engine/world/chunk/Inner.zig");
     _ = @import("engine/world/fat_tree/FatTree.zig");
+    _ = @import("engine/world/ChunkMemoryPool.zig");
+    _ = @import("engine/world/ResidencyManager.zig");
     _ = @import("engine/types/color.zig");
     _ = @import("engine/types/light.zig");
     _ = @import("engine/types/job_system.zig");
+    _ = @import("engine/types/epoch.zig");
     _ = @import("engine/world/fat_tree/LoadedChunksHashMap.zig");
+    _ = @import("engine/world/fat_tree/ConcurrentChunksHashMap.zig");
+    _ = @import("engine/world/fat_tree/tree_stats.zig");
+    _ = @import("engine/world/fat_tree/tree_layer_indices.zig");
     _ = @import("engine/world/chunk/BlockStateIndices.zig");
+    _ = @import("engine/graphics/pathtracing/GpuTree.zig");
     _ = @import("engine/math/vector.zig");
     _ = @import("engine/math/detail/vector2.zig");
     _ = @import("engine/math/detail/vector3.zig");